@@ -0,0 +1,491 @@
+#include "anim.h"
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
+
+// Size of the table of plane offsets that starts an op 5 delta. Only the first 8 are used.
+#define DELTA_OFFSETS 16
+
+// Cells of a plane are marked while they are listed, so each is listed once
+#define MARK_WRITTEN 1
+#define MARK_DIRTY 2
+
+struct anim_frame {
+    // Ticks after the previous frame that this one is shown
+    unsigned int delay;
+    // Op 5 delta, NULL for the first frame
+    uint8_t *delta;
+    size_t delta_size;
+    // The delta applies to the previous frame rather than the one before it
+    bool from_previous;
+};
+
+/*
+ * Op 5 deltas apply to the frame two before their own, so the frames are decoded into two sets of bitplanes that take
+ * turns, and frame i is held in planes[i % 2]. A byte of a plane, a cell, covers 8 pixels; the cells written by the
+ * deltas are converted back into pixels, and those that come out different from image->pixels are listed as the
+ * changes of the frame.
+ */
+struct anim_frames {
+    unsigned int width, height, n_planes;
+    size_t row_bytes;   // bytes per row of a plane
+    size_t plane_size;  // bytes per plane
+
+    struct anim_frame *frames;
+    unsigned int n_frames;
+    // Frame that follows the last one. 2 if the last two frames repeat the first two, which is how animations that
+    // loop seamlessly are stored, else 0.
+    unsigned int loop_frame;
+    // Ticks taken by a loop from loop_frame back to it
+    unsigned long loop_ticks;
+
+    uint8_t *planes[2];
+    uint8_t *first_planes;
+    unsigned int current;
+    // Ticks since the current frame was shown
+    unsigned long ticks;
+
+    // Cells written by the delta being applied
+    uint32_t *written;
+    size_t n_written;
+    // Cells whose pixels changed in the last frame shown. The next frame can differ from it there too, since it is
+    // decoded from the frame before.
+    uint32_t *changed;
+    size_t n_changed;
+    // Union of both, to be converted into pixels
+    uint32_t *dirty;
+    size_t n_dirty;
+    uint8_t *marks;
+
+    uint64_t generation;
+    // The last generation that replaced the whole image
+    uint64_t reset_generation;
+    struct anim_change changes[ANIM_HISTORY];
+};
+
+static size_t get_row_bytes(unsigned int width) {
+    return ((width + 15) / 16) * 2;
+}
+
+static uint32_t read_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void planes_to_chunky(const uint8_t *planes, unsigned int n_planes, unsigned int width, unsigned int height,
+                      uint8_t *pixels) {
+    const size_t row_bytes = get_row_bytes(width);
+    const size_t plane_size = row_bytes * height;
+    memset(pixels, 0, (size_t)width * height);
+    for (unsigned int p = 0; p < n_planes; p++) {
+        const uint8_t *plane = planes + p * plane_size;
+        for (unsigned int row = 0; row < height; row++) {
+            const uint8_t *src = plane + row * row_bytes;
+            uint8_t *dst = pixels + (size_t)row * width;
+            for (unsigned int x = 0; x < width; x++) {
+                dst[x] |= ((src[x / 8] >> (7 - x % 8)) & 1) << p;
+            }
+        }
+    }
+}
+
+static void write_cell(struct anim_frames *frames, uint8_t *plane, size_t cell, uint8_t value, bool track) {
+    plane[cell] = value;
+    if (track && !(frames->marks[cell] & MARK_WRITTEN)) {
+        frames->marks[cell] |= MARK_WRITTEN;
+        frames->written[frames->n_written++] = cell;
+    }
+}
+
+// Apply the op 5 delta of a frame to the bitplanes of the frame it is relative to. Each plane that changes has a
+// list of ops for every byte column, running down it: skip rows, repeat a byte, or copy bytes. Returns false if the
+// delta runs out of its data or off the image, in which case the planes are left part way through.
+static bool apply_delta(struct anim_frames *frames, const struct anim_frame *frame, uint8_t *planes, bool track) {
+    const uint8_t *data = frame->delta;
+    const uint8_t *end = data + frame->delta_size;
+    if (frame->delta_size < DELTA_OFFSETS * sizeof(uint32_t)) {
+        return false;
+    }
+    for (unsigned int p = 0; p < frames->n_planes; p++) {
+        const uint32_t offset = read_be32(data + p * sizeof(uint32_t));
+        if (offset == 0) {
+            // This plane did not change
+            continue;
+        }
+        if (offset >= frame->delta_size) {
+            return false;
+        }
+        const uint8_t *src = data + offset;
+        uint8_t *plane = planes + p * frames->plane_size;
+        for (size_t col = 0; col < frames->row_bytes; col++) {
+            if (src >= end) {
+                return false;
+            }
+            unsigned int n_ops = *src++;
+            size_t row = 0;
+            for (unsigned int i = 0; i < n_ops; i++) {
+                if (src >= end) {
+                    return false;
+                }
+                const uint8_t op = *src++;
+                if (op == 0) {
+                    // Repeat a byte down the column
+                    if (end - src < 2 || src[0] > frames->height - row) {
+                        return false;
+                    }
+                    const unsigned int count = src[0];
+                    const uint8_t value = src[1];
+                    src += 2;
+                    for (unsigned int j = 0; j < count; j++, row++) {
+                        write_cell(frames, plane, row * frames->row_bytes + col, value, track);
+                    }
+                } else if (op & 0x80) {
+                    // Copy bytes down the column
+                    const unsigned int count = op & 0x7f;
+                    if ((size_t)(end - src) < count || count > frames->height - row) {
+                        return false;
+                    }
+                    for (unsigned int j = 0; j < count; j++, row++) {
+                        write_cell(frames, plane, row * frames->row_bytes + col, *src++, track);
+                    }
+                } else {
+                    // Skip rows that stay the same
+                    row += op;
+                    if (row > frames->height) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+static bool add_changed_pixel(struct anim_change *change, unsigned int pixel_idx, unsigned int width) {
+    if (change->list.n_pixels == change->capacity) {
+        size_t capacity = change->capacity ? change->capacity * 2 : 1024;
+        unsigned int *pixels = realloc(change->list.pixels, capacity * sizeof(unsigned int));
+        if (!pixels) {
+            return false;
+        }
+        change->list.pixels = pixels;
+        change->capacity = capacity;
+    }
+    change->list.pixels[change->list.n_pixels++] = pixel_idx;
+    const int x = pixel_idx % width;
+    const int y = pixel_idx / width;
+    change->bbox.min_x = MIN(change->bbox.min_x, x);
+    change->bbox.min_y = MIN(change->bbox.min_y, y);
+    change->bbox.max_x = MAX(change->bbox.max_x, x);
+    change->bbox.max_y = MAX(change->bbox.max_y, y);
+    return true;
+}
+
+// Convert a cell of the bitplanes into the 8 pixels it covers, and list those that change. Returns true if any did,
+// and sets *failed if the list could not grow.
+static bool update_cell(struct anim_frames *frames, const uint8_t *planes, uint32_t cell, uint8_t *pixels,
+                        struct anim_change *change, bool *failed) {
+    const unsigned int row = cell / frames->row_bytes;
+    const unsigned int x0 = (cell % frames->row_bytes) * 8;
+    if (x0 >= frames->width) {
+        // Padding at the end of the row
+        return false;
+    }
+    uint8_t bytes[8];
+    for (unsigned int p = 0; p < frames->n_planes; p++) {
+        bytes[p] = planes[p * frames->plane_size + cell];
+    }
+    const unsigned int n = MIN(8, frames->width - x0);
+    const unsigned int row_start = row * frames->width + x0;
+    bool changed = false;
+    for (unsigned int b = 0; b < n; b++) {
+        uint8_t value = 0;
+        for (unsigned int p = 0; p < frames->n_planes; p++) {
+            value |= ((bytes[p] >> (7 - b)) & 1) << p;
+        }
+        if (pixels[row_start + b] != value) {
+            pixels[row_start + b] = value;
+            changed = true;
+            if (!*failed && !add_changed_pixel(change, row_start + b, frames->width)) {
+                *failed = true;
+            }
+        }
+    }
+    return changed;
+}
+
+static int compare_cells(const void *a, const void *b) {
+    const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void add_dirty(struct anim_frames *frames, const uint32_t *cells, size_t n_cells) {
+    for (size_t i = 0; i < n_cells; i++) {
+        if (!(frames->marks[cells[i]] & MARK_DIRTY)) {
+            frames->marks[cells[i]] |= MARK_DIRTY;
+            frames->dirty[frames->n_dirty++] = cells[i];
+        }
+    }
+}
+
+// List the dirty cells in order, so that their pixels come out in row-major order. When many cells are dirty, a
+// scan of the marks is cheaper than sorting.
+static void sort_dirty(struct anim_frames *frames) {
+    if (frames->n_dirty > frames->plane_size / 32) {
+        size_t n = 0;
+        for (size_t cell = 0; cell < frames->plane_size; cell++) {
+            if (frames->marks[cell] & MARK_DIRTY) {
+                frames->dirty[n++] = cell;
+            }
+        }
+    } else {
+        qsort(frames->dirty, frames->n_dirty, sizeof(uint32_t), compare_cells);
+    }
+}
+
+static unsigned int next_frame(const struct anim_frames *frames) {
+    return frames->current + 1 < frames->n_frames ? frames->current + 1 : frames->loop_frame;
+}
+
+// Show the next frame, listing the pixels it changes as the changes of a new generation. Returns true if any pixel
+// changed.
+static bool show_next_frame(struct anim_frames *frames, struct lbm_image *image) {
+    const unsigned int next = next_frame(frames);
+    const size_t planes_size = frames->plane_size * frames->n_planes;
+    frames->generation++;
+    struct anim_change *change = &frames->changes[frames->generation % ANIM_HISTORY];
+    change->list.n_pixels = 0;
+    change->bbox.min_x = INT_MAX;
+    change->bbox.min_y = INT_MAX;
+    change->bbox.max_x = 0;
+    change->bbox.max_y = 0;
+
+    if (next == 0) {
+        // Back to the start, from which both sets of planes hold the first frame
+        memcpy(frames->planes[0], frames->first_planes, planes_size);
+        memcpy(frames->planes[1], frames->first_planes, planes_size);
+        planes_to_chunky(frames->first_planes, frames->n_planes, frames->width, frames->height, image->pixels);
+        frames->n_changed = 0;
+        frames->current = 0;
+        frames->reset_generation = frames->generation;
+        return true;
+    }
+
+    const struct anim_frame *frame = &frames->frames[next];
+    uint8_t *planes = frames->planes[next % 2];
+    if (frame->from_previous) {
+        memcpy(planes, frames->planes[frames->current % 2], planes_size);
+    }
+    frames->n_written = 0;
+    // Deltas were checked when the animation was loaded
+    apply_delta(frames, frame, planes, true);
+    frames->current = next;
+
+    frames->n_dirty = 0;
+    add_dirty(frames, frames->written, frames->n_written);
+    add_dirty(frames, frames->changed, frames->n_changed);
+    sort_dirty(frames);
+
+    bool failed = false;
+    frames->n_changed = 0;
+    for (size_t i = 0; i < frames->n_dirty; i++) {
+        const uint32_t cell = frames->dirty[i];
+        frames->marks[cell] = 0;
+        if (update_cell(frames, planes, cell, image->pixels, change, &failed)) {
+            frames->changed[frames->n_changed++] = cell;
+        }
+    }
+    if (failed) {
+        // Buffers showing earlier frames are rendered again in whole
+        frames->reset_generation = frames->generation;
+    }
+    return frames->n_changed > 0;
+}
+
+struct anim_frames *anim_frames_create(struct lbm_image *image, const struct ck_FORM *anim, uint8_t *planes,
+                                       unsigned int n_planes) {
+    unsigned int n_forms = 0;
+    for (const struct chunk *c = anim->base.child; c != NULL; c = c->next) {
+        if (c->id == FORM) {
+            n_forms++;
+        }
+    }
+    struct anim_frames *frames = calloc(1, sizeof(struct anim_frames));
+    if (!frames || n_forms < 2) {
+        goto error;
+    }
+    frames->width = image->width;
+    frames->height = image->height;
+    frames->n_planes = n_planes;
+    frames->row_bytes = get_row_bytes(image->width);
+    frames->plane_size = frames->row_bytes * image->height;
+    frames->frames = calloc(n_forms, sizeof(struct anim_frame));
+    if (!frames->frames) {
+        goto error;
+    }
+
+    // Take the frames up to the first one that cannot be played
+    for (const struct chunk *c = anim->base.child; c != NULL && frames->n_frames < n_forms; c = c->next) {
+        if (c->id != FORM) {
+            continue;
+        }
+        const struct ck_ANHD *anhd = NULL;
+        const struct ck_DLTA *dlta = NULL;
+        for (const struct chunk *child = c->child; child != NULL; child = child->next) {
+            if (child->id == ANHD) {
+                anhd = (const struct ck_ANHD *)child;
+            } else if (child->id == DLTA) {
+                dlta = (const struct ck_DLTA *)child;
+            }
+        }
+        struct anim_frame *frame = &frames->frames[frames->n_frames];
+        frame->delay = anhd && anhd->reltime > 0 ? anhd->reltime : 1;
+        if (frames->n_frames == 0) {
+            frames->n_frames++;
+            continue;
+        }
+        if (!anhd || anhd->operation != 5 || anhd->interleave > 2 || !dlta) {
+            break;
+        }
+        frame->from_previous = anhd->interleave == 1;
+        frame->delta_size = dlta->base.size;
+        frame->delta = malloc(frame->delta_size);
+        if (!frame->delta) {
+            break;
+        }
+        memcpy(frame->delta, dlta->data, frame->delta_size);
+        frames->n_frames++;
+    }
+
+    const size_t planes_size = frames->plane_size * n_planes;
+    frames->first_planes = planes;
+    planes = NULL;
+    frames->planes[0] = malloc(planes_size);
+    frames->planes[1] = malloc(planes_size);
+    frames->written = malloc(frames->plane_size * sizeof(uint32_t));
+    frames->changed = malloc(frames->plane_size * sizeof(uint32_t));
+    frames->dirty = malloc(frames->plane_size * sizeof(uint32_t));
+    frames->marks = calloc(frames->plane_size, 1);
+    if (!frames->planes[0] || !frames->planes[1] || !frames->written || !frames->changed || !frames->dirty ||
+        !frames->marks) {
+        goto error;
+    }
+
+    // Play the animation through once, to drop the frames from the first bad delta on, and to find out whether the
+    // last two frames lead back into the third
+    uint8_t *second_planes = NULL;
+    memcpy(frames->planes[0], frames->first_planes, planes_size);
+    memcpy(frames->planes[1], frames->first_planes, planes_size);
+    for (unsigned int i = 1; i < frames->n_frames; i++) {
+        const struct anim_frame *frame = &frames->frames[i];
+        if (frame->from_previous) {
+            memcpy(frames->planes[i % 2], frames->planes[(i - 1) % 2], planes_size);
+        }
+        if (!apply_delta(frames, frame, frames->planes[i % 2], false)) {
+            for (unsigned int j = i; j < frames->n_frames; j++) {
+                free(frames->frames[j].delta);
+            }
+            frames->n_frames = i;
+            break;
+        }
+        if (i == 1) {
+            second_planes = malloc(planes_size);
+            if (second_planes) {
+                memcpy(second_planes, frames->planes[1], planes_size);
+            }
+        }
+    }
+    const unsigned int last = frames->n_frames - 1;
+    if (frames->n_frames >= 5 && last % 2 == 1 && second_planes &&
+        memcmp(frames->planes[0], frames->first_planes, planes_size) == 0 &&
+        memcmp(frames->planes[1], second_planes, planes_size) == 0) {
+        frames->loop_frame = 2;
+    }
+    free(second_planes);
+    if (frames->n_frames < 2) {
+        goto error;
+    }
+    memcpy(frames->planes[0], frames->first_planes, planes_size);
+    memcpy(frames->planes[1], frames->first_planes, planes_size);
+    // The delay of loop_frame is taken when coming back to it
+    for (unsigned int i = frames->loop_frame; i < frames->n_frames; i++) {
+        frames->loop_ticks += frames->frames[i].delay;
+    }
+    for (unsigned int i = 0; i < ANIM_HISTORY; i++) {
+        frames->changes[i].bbox.min_x = INT_MAX;
+        frames->changes[i].bbox.min_y = INT_MAX;
+    }
+    return frames;
+
+error:
+    free(planes);
+    anim_frames_destroy(frames);
+    return NULL;
+}
+
+void anim_frames_destroy(struct anim_frames *frames) {
+    if (!frames) {
+        return;
+    }
+    for (unsigned int i = 0; i < frames->n_frames; i++) {
+        free(frames->frames[i].delta);
+    }
+    free(frames->frames);
+    free(frames->planes[0]);
+    free(frames->planes[1]);
+    free(frames->first_planes);
+    free(frames->written);
+    free(frames->changed);
+    free(frames->dirty);
+    free(frames->marks);
+    for (unsigned int i = 0; i < ANIM_HISTORY; i++) {
+        free(frames->changes[i].list.pixels);
+    }
+    free(frames);
+}
+
+size_t anim_frames_memory(const struct anim_frames *frames) {
+    size_t size = sizeof(struct anim_frames) + frames->n_frames * sizeof(struct anim_frame);
+    for (unsigned int i = 0; i < frames->n_frames; i++) {
+        size += frames->frames[i].delta_size;
+    }
+    size += 3 * frames->plane_size * frames->n_planes;
+    size += frames->plane_size * (3 * sizeof(uint32_t) + 1);
+    for (unsigned int i = 0; i < ANIM_HISTORY; i++) {
+        size += frames->changes[i].capacity * sizeof(unsigned int);
+    }
+    return size;
+}
+
+bool anim_frames_advance(struct anim_frames *frames, struct lbm_image *image, unsigned long ticks) {
+    if (ticks >= frames->loop_ticks) {
+        // Whole loops end where they started
+        ticks %= frames->loop_ticks;
+    }
+    frames->ticks += ticks;
+    bool changed = false;
+    while (frames->ticks >= frames->frames[next_frame(frames)].delay) {
+        frames->ticks -= frames->frames[next_frame(frames)].delay;
+        changed |= show_next_frame(frames, image);
+    }
+    return changed;
+}
+
+unsigned long anim_frames_ticks_until_change(const struct anim_frames *frames) {
+    return frames->frames[next_frame(frames)].delay - frames->ticks;
+}
+
+uint64_t anim_frames_generation(const struct anim_frames *frames) {
+    return frames->generation;
+}
+
+const struct anim_change *anim_frames_change(const struct anim_frames *frames, uint64_t generation) {
+    if (generation <= frames->reset_generation || generation > frames->generation ||
+        frames->generation - generation >= ANIM_HISTORY) {
+        return NULL;
+    }
+    return &frames->changes[generation % ANIM_HISTORY];
+}
@@ -1,7 +1,13 @@
 #include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "background-image.h"
 #include "cairo_util.h"
+#include "lbm.h"
 #include "log.h"
+#include "memstats.h"
 
 enum background_mode parse_background_mode(const char *mode) {
 	if (strcmp(mode, "stretch") == 0) {
@@ -14,6 +20,8 @@ enum background_mode parse_background_mode(const char *mode) {
 		return BACKGROUND_MODE_CENTER;
 	} else if (strcmp(mode, "tile") == 0) {
 		return BACKGROUND_MODE_TILE;
+	} else if (strcmp(mode, "pan") == 0) {
+		return BACKGROUND_MODE_PAN;
 	} else if (strcmp(mode, "solid_color") == 0) {
 		return BACKGROUND_MODE_SOLID_COLOR;
 	}
@@ -21,19 +29,166 @@ enum background_mode parse_background_mode(const char *mode) {
 	return BACKGROUND_MODE_INVALID;
 }
 
-cairo_surface_t *load_background_image(const char *path) {
+#if HAVE_GDK_PIXBUF
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+/*
+ * Compute the smallest size an image of `width`x`height` can be decoded at
+ * without losing detail once it is scaled into a buffer of the given size in
+ * the given mode. Images are never decoded larger than their native size, and
+ * center and tile modes always show the image at its native size.
+ */
+static void get_decode_size(enum background_mode mode, int width, int height,
+		int buffer_width, int buffer_height,
+		int *decode_width, int *decode_height) {
+	*decode_width = width;
+	*decode_height = height;
+	if (buffer_width <= 0 || buffer_height <= 0) {
+		return;
+	}
+
+	double scale;
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+		*decode_width = MIN(width, buffer_width);
+		*decode_height = MIN(height, buffer_height);
+		return;
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_PAN:
+		scale = (double)buffer_width / width;
+		if ((double)buffer_height / height > scale) {
+			scale = (double)buffer_height / height;
+		}
+		break;
+	case BACKGROUND_MODE_FIT:
+		scale = (double)buffer_width / width;
+		if ((double)buffer_height / height < scale) {
+			scale = (double)buffer_height / height;
+		}
+		break;
+	default:
+		return;
+	}
+	if (scale >= 1.0) {
+		return;
+	}
+
+	// Round up so the scaled image still covers the buffer
+	*decode_width = (int)(width * scale);
+	if (*decode_width < width * scale) {
+		(*decode_width)++;
+	}
+	*decode_height = (int)(height * scale);
+	if (*decode_height < height * scale) {
+		(*decode_height)++;
+	}
+}
+
+struct decode_target {
+	const char *path;
+	enum background_mode mode;
+	int buffer_width, buffer_height;
+};
+
+static void handle_size_prepared(GdkPixbufLoader *loader,
+		gint width, gint height, gpointer data) {
+	const struct decode_target *target = data;
+	int decode_width, decode_height;
+	get_decode_size(target->mode, width, height,
+			target->buffer_width, target->buffer_height,
+			&decode_width, &decode_height);
+	if (decode_width != width || decode_height != height) {
+		swaybg_log(LOG_DEBUG, "Decoding %s (%dx%d) at %dx%d", target->path,
+				width, height, decode_width, decode_height);
+		gdk_pixbuf_loader_set_size(loader, decode_width, decode_height);
+	}
+}
+
+/*
+ * Feed the file to a pixbuf loader in small chunks, so that neither the
+ * encoded file nor the full-resolution image is ever held in memory when the
+ * decoder supports scaled decoding (e.g. JPEG DCT scaling).
+ */
+static GdkPixbuf *decode_pixbuf(const struct decode_target *target,
+		GError **err) {
+	FILE *f = fopen(target->path, "rb");
+	if (!f) {
+		g_set_error(err, G_FILE_ERROR, g_file_error_from_errno(errno),
+				"%s: %s", target->path, strerror(errno));
+		return NULL;
+	}
+
+	GdkPixbufLoader *loader = gdk_pixbuf_loader_new();
+	g_signal_connect(loader, "size-prepared",
+			G_CALLBACK(handle_size_prepared), (gpointer)target);
+
+	static const size_t chunk_size = 64 * 1024;
+	guchar *chunk = malloc(chunk_size);
+	bool ok = chunk != NULL;
+	size_t n;
+	while (ok && (n = fread(chunk, 1, chunk_size, f)) > 0) {
+		ok = gdk_pixbuf_loader_write(loader, chunk, n, err);
+	}
+	free(chunk);
+	fclose(f);
+
+	// Closing must happen even on failure to release the loader's state
+	if (!gdk_pixbuf_loader_close(loader, ok ? err : NULL)) {
+		ok = false;
+	}
+
+	GdkPixbuf *pixbuf = NULL;
+	if (ok) {
+		pixbuf = gdk_pixbuf_loader_get_pixbuf(loader);
+		if (pixbuf) {
+			g_object_ref(pixbuf);
+		}
+	}
+	g_object_unref(loader);
+	return pixbuf;
+}
+#endif // HAVE_GDK_PIXBUF
+
+static const cairo_user_data_key_t memstats_key;
+
+static void handle_surface_destroy(void *data) {
+	memstats_free(MEMSTATS_CAIRO, (size_t)data);
+}
+
+/*
+ * Account for the pixels of an image surface until it is destroyed.
+ */
+static void track_surface_memory(cairo_surface_t *surface) {
+	size_t size = (size_t)cairo_image_surface_get_stride(surface) *
+		cairo_image_surface_get_height(surface);
+	if (cairo_surface_set_user_data(surface, &memstats_key, (void *)size,
+			handle_surface_destroy) == CAIRO_STATUS_SUCCESS) {
+		memstats_alloc(MEMSTATS_CAIRO, size);
+	}
+}
+
+cairo_surface_t *load_background_image(const char *path,
+		enum background_mode mode, int buffer_width, int buffer_height) {
 	cairo_surface_t *image;
 #if HAVE_GDK_PIXBUF
 	GError *err = NULL;
-	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file(path, &err);
+	struct decode_target target = {
+		.path = path,
+		.mode = mode,
+		.buffer_width = buffer_width,
+		.buffer_height = buffer_height,
+	};
+	GdkPixbuf *pixbuf = decode_pixbuf(&target, &err);
 	if (!pixbuf) {
 		swaybg_log(LOG_INFO, "Failed to load background image (%s).",
-				err->message);
+				err ? err->message : "unknown error");
+		g_clear_error(&err);
 		return NULL;
 	}
 	image = gdk_cairo_image_surface_create_from_pixbuf(pixbuf);
 	g_object_unref(pixbuf);
 #else
+	// cairo cannot decode PNGs at a reduced size
 	image = cairo_image_surface_create_from_png(path);
 #endif // HAVE_GDK_PIXBUF
 	if (!image) {
@@ -49,6 +204,7 @@ cairo_surface_t *load_background_image(const char *path) {
 				, cairo_status_to_string(cairo_surface_status(image)));
 		return NULL;
 	}
+	track_surface_memory(image);
 	return image;
 }
 
@@ -66,7 +222,9 @@ void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 				(double)buffer_height / height);
 		cairo_set_source_surface(cairo, image, 0, 0);
 		break;
-	case BACKGROUND_MODE_FILL: {
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_PAN: {
+		// Only LBM images pan, static images fill the output
 		double window_ratio = (double)buffer_width / buffer_height;
 		double bg_ratio = width / height;
 
@@ -120,3 +278,127 @@ void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 }
+
+bool resample_background_image(void *data, enum pixel_format format,
+		size_t stride, cairo_surface_t *image, enum background_mode mode,
+		uint32_t color, enum resample_filter filter, int buffer_width,
+		int buffer_height) {
+	cairo_format_t image_format = cairo_image_surface_get_format(image);
+	if (image_format != CAIRO_FORMAT_ARGB32 &&
+			image_format != CAIRO_FORMAT_RGB24) {
+		return false;
+	}
+	cairo_surface_flush(image);
+	struct resample_source src = {
+		.pixels = cairo_image_surface_get_data(image),
+		.width = cairo_image_surface_get_width(image),
+		.height = cairo_image_surface_get_height(image),
+		.stride = cairo_image_surface_get_stride(image),
+		.opaque = image_format == CAIRO_FORMAT_RGB24,
+	};
+	if (!src.pixels) {
+		return false;
+	}
+
+	// The same placement as render_background_image, without the cairo
+	// transformation
+	double width = src.width, height = src.height;
+	double window_ratio = (double)buffer_width / buffer_height;
+	double bg_ratio = width / height;
+	double scale;
+	struct resample_placement placement = {0};
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+		placement.width = buffer_width;
+		placement.height = buffer_height;
+		break;
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_PAN:
+	case BACKGROUND_MODE_FIT:
+		// Fill matches the side along which the image is narrower, fit the
+		// other
+		if ((window_ratio > bg_ratio) == (mode != BACKGROUND_MODE_FIT)) {
+			scale = (double)buffer_width / width;
+		} else {
+			scale = (double)buffer_height / height;
+		}
+		placement.width = width * scale;
+		placement.height = height * scale;
+		placement.x = (buffer_width - placement.width) / 2;
+		placement.y = (buffer_height - placement.height) / 2;
+		break;
+	case BACKGROUND_MODE_CENTER:
+		// On whole pixels, so that the image is copied rather than filtered
+		placement.width = width;
+		placement.height = height;
+		placement.x = floor((buffer_width - width) / 2);
+		placement.y = floor((buffer_height - height) / 2);
+		break;
+	case BACKGROUND_MODE_TILE:
+		placement.tile = true;
+		break;
+	case BACKGROUND_MODE_SOLID_COLOR:
+	case BACKGROUND_MODE_INVALID:
+		return false;
+	}
+
+	return resample_image(data, format, buffer_width, buffer_height, stride,
+			&src, &placement, background_color_argb(color), filter);
+}
+
+uint32_t background_color_argb(uint32_t color) {
+	// cairo paints the color over a cleared buffer, whose alpha is dropped
+	uint32_t alpha = color & 0xFF;
+	uint32_t argb = 0;
+	for (int shift = 8; shift < 32; shift += 8) {
+		uint32_t channel = (color >> shift) & 0xFF;
+		argb |= (channel * alpha + 127) / 255 << (shift - 8);
+	}
+	return argb;
+}
+
+void get_lbm_image_geometry(const struct lbm_image *image,
+		enum background_mode mode, int buffer_width, int buffer_height,
+		int *origin_x, int *origin_y, unsigned int *scale) {
+	*scale = 1;
+	*origin_x = 0;
+	*origin_y = 0;
+	if (!image) {
+		return;
+	}
+	if (mode == BACKGROUND_MODE_PAN) {
+		// The buffer holds the whole scene, which must cover the output
+		while (image->width * *scale < (unsigned int)buffer_width ||
+				image->height * *scale < (unsigned int)buffer_height) {
+			(*scale)++;
+		}
+		return;
+	}
+	// Scale the image up until it matches the configured display mode
+	while (1) {
+		int image_width = image->width * *scale;
+		int image_height = image->height * *scale;
+		*origin_x = (buffer_width - image_width) / 2;
+		*origin_y = (buffer_height - image_height) / 2;
+
+		swaybg_log(LOG_DEBUG, "%s trying %d,%d at %dx", __FUNCTION__, *origin_x, *origin_y, *scale);
+
+		// Allow a small margin in case it *almost* fits at a certain scale
+		// TODO: allow providing this margin on the command line
+		const int margin = 100;
+		if (mode == BACKGROUND_MODE_CENTER) {
+			break;
+		} else if (mode == BACKGROUND_MODE_FIT) {
+			if (*origin_x <= margin || *origin_y <= margin) {
+				break;
+			}
+		} else if (mode == BACKGROUND_MODE_FILL) {
+			if (*origin_x <= margin && *origin_y <= margin) {
+				break;
+			}
+		} else {
+			break;
+		}
+		(*scale)++;
+	}
+}
@@ -29,6 +29,20 @@ cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel)
 	return CAIRO_SUBPIXEL_ORDER_DEFAULT;
 }
 
+cairo_format_t to_cairo_format(enum pixel_format format) {
+	switch (format) {
+	case PIXEL_FORMAT_XRGB8888:
+		return CAIRO_FORMAT_RGB24;
+	case PIXEL_FORMAT_RGB565:
+		return CAIRO_FORMAT_RGB16_565;
+	case PIXEL_FORMAT_XRGB2101010:
+		return CAIRO_FORMAT_RGB30;
+	case PIXEL_FORMAT_INVALID:
+		break;
+	}
+	return CAIRO_FORMAT_INVALID;
+}
+
 #if HAVE_GDK_PIXBUF
 cairo_surface_t* gdk_cairo_image_surface_create_from_pixbuf(const GdkPixbuf *gdkbuf) {
 	int chan = gdk_pixbuf_get_n_channels(gdkbuf);
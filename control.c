@@ -0,0 +1,249 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "control.h"
+#include "log.h"
+
+// Requests are read on the main loop, so a client that stalls must not stall
+// the animation for long
+#define CONTROL_TIMEOUT_MS 100
+
+struct control_server {
+	int fd;
+	char *path;
+};
+
+bool control_socket_path(char *path, size_t size) {
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	if (!runtime_dir || !runtime_dir[0]) {
+		return false;
+	}
+	const char *display = getenv("WAYLAND_DISPLAY");
+	if (!display || !display[0]) {
+		display = "wayland-0";
+	}
+	// WAYLAND_DISPLAY may be an absolute path to the compositor socket
+	const char *slash = strrchr(display, '/');
+	if (slash) {
+		display = slash + 1;
+	}
+	int len = snprintf(path, size, "%s/swaybg-%s.sock", runtime_dir, display);
+	return len > 0 && (size_t)len < size;
+}
+
+static bool get_address(const char *path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		swaybg_log(LOG_ERROR, "Control socket path is too long: %s", path);
+		return false;
+	}
+	strcpy(addr->sun_path, path);
+	return true;
+}
+
+static int open_socket(void) {
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void set_timeouts(int fd) {
+	struct timeval tv = {
+		.tv_sec = CONTROL_TIMEOUT_MS / 1000,
+		.tv_usec = (CONTROL_TIMEOUT_MS % 1000) * 1000,
+	};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/*
+ * True if something is listening on the socket at `addr`.
+ */
+static bool socket_in_use(const struct sockaddr_un *addr) {
+	int fd = open_socket();
+	if (fd < 0) {
+		return false;
+	}
+	bool in_use = connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) == 0;
+	close(fd);
+	return in_use;
+}
+
+struct control_server *control_server_create(const char *path) {
+	struct sockaddr_un addr;
+	if (!get_address(path, &addr)) {
+		return NULL;
+	}
+	if (socket_in_use(&addr)) {
+		swaybg_log(LOG_ERROR, "Control socket %s is in use by another "
+				"instance", path);
+		return NULL;
+	}
+	unlink(path);
+
+	struct control_server *server = calloc(1, sizeof(struct control_server));
+	if (!server) {
+		return NULL;
+	}
+	server->fd = open_socket();
+	if (server->fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create control socket");
+		free(server);
+		return NULL;
+	}
+	int flags = fcntl(server->fd, F_GETFL);
+	if (flags < 0 || fcntl(server->fd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+			bind(server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(server->fd, 4) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to listen on %s", path);
+		close(server->fd);
+		free(server);
+		return NULL;
+	}
+	server->path = strdup(path);
+	swaybg_log(LOG_DEBUG, "Listening for control requests on %s", path);
+	return server;
+}
+
+void control_server_destroy(struct control_server *server) {
+	if (!server) {
+		return;
+	}
+	close(server->fd);
+	if (server->path) {
+		unlink(server->path);
+	}
+	free(server->path);
+	free(server);
+}
+
+int control_server_get_fd(struct control_server *server) {
+	return server->fd;
+}
+
+/*
+ * Read a request up to the end of the stream. Returns its length, or -1 if it
+ * did not arrive in time or is too long.
+ */
+static ssize_t read_request(int fd, char *data, size_t size) {
+	size_t len = 0;
+	while (len < size - 1) {
+		ssize_t n = read(fd, data + len, size - 1 - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			return -1;
+		}
+		if (n == 0) {
+			data[len] = '\0';
+			return len;
+		}
+		len += n;
+	}
+	return -1;
+}
+
+bool control_server_accept(struct control_server *server,
+		struct control_request *request) {
+	while (true) {
+		int fd = accept(server->fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				swaybg_log_errno(LOG_ERROR, "Failed to accept control connection");
+			}
+			return false;
+		}
+		// The accepted socket does not inherit O_NONBLOCK on Linux, but
+		// may elsewhere
+		int flags = fcntl(fd, F_GETFL);
+		if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) < 0 ||
+				fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+			close(fd);
+			continue;
+		}
+		set_timeouts(fd);
+
+		request->reply = fdopen(fd, "w");
+		if (!request->reply) {
+			close(fd);
+			continue;
+		}
+		request->argc = 0;
+		ssize_t len = read_request(fd, request->data, sizeof(request->data));
+		if (len < 0) {
+			// Handled as an empty request
+			return true;
+		}
+		// The last word may lack its NUL, read_request ends the data with one
+		for (size_t i = 0; i < (size_t)len && request->argc < CONTROL_MAX_ARGS;
+				i += strlen(&request->data[i]) + 1) {
+			request->argv[request->argc++] = &request->data[i];
+		}
+		return true;
+	}
+}
+
+void control_request_finish(struct control_request *request) {
+	fclose(request->reply);
+	request->reply = NULL;
+}
+
+bool control_send(const char *path, int argc, char **argv, FILE *out) {
+	struct sockaddr_un addr;
+	if (!get_address(path, &addr)) {
+		return false;
+	}
+	int fd = open_socket();
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to connect to %s", path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return false;
+	}
+
+	FILE *f = fdopen(fd, "r+");
+	if (!f) {
+		close(fd);
+		return false;
+	}
+	for (int i = 0; i < argc; i++) {
+		fwrite(argv[i], 1, strlen(argv[i]) + 1, f);
+	}
+	fflush(f);
+	shutdown(fd, SHUT_WR);
+
+	bool ok = false;
+	char line[CONTROL_MAX_LINE];
+	if (fgets(line, sizeof(line), f)) {
+		if (strcmp(line, "ok\n") == 0) {
+			ok = true;
+		} else {
+			fputs(line, stderr);
+		}
+		while (fgets(line, sizeof(line), f)) {
+			fputs(line, out);
+		}
+	} else {
+		swaybg_log(LOG_ERROR, "No reply from %s", path);
+	}
+	fclose(f);
+	return ok;
+}
@@ -0,0 +1,517 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "export.h"
+#include "lbm.h"
+#include "log.h"
+#include "perf-counters.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// Frames are handed to the writer thread through this many slots
+#define EXPORT_SLOTS 2
+
+// Bands of the canvas are rendered on their own threads if they have at least
+// this many pixels, so that small frames are not split
+#define BAND_MIN_PIXELS (512 * 1024)
+#define MAX_BANDS 8
+
+struct export_slot {
+	uint32_t *pixels;  // XRGB8888 snapshot of the canvas
+	unsigned int frame;
+	bool full;
+};
+
+struct exporter;
+
+// Rows of the canvas kept up to date by one thread
+struct export_band {
+	struct exporter *exporter;
+	int y, height;
+	// Range pixels in this band, made again when an ANIM frame changes them
+	struct lbm_layout *layout;
+	pthread_t thread;
+	bool started;
+};
+
+struct exporter {
+	const struct export_options *options;
+	FILE *file;
+	int width, height;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct export_slot slots[EXPORT_SLOTS];
+	bool done;
+	bool failed;
+
+	// What the bands render from, set before each frame and only read while
+	// they render it
+	const struct lbm_image *image;
+	uint32_t *canvas;
+	int origin_x, origin_y;
+	unsigned int lbm_scale;
+	uint32_t old_lut[256];
+	uint64_t old_generation;
+
+	pthread_mutex_t band_lock;
+	pthread_cond_t band_cond;
+	struct export_band bands[MAX_BANDS];
+	int n_bands;
+	unsigned int band_frame;  // frames handed to the bands
+	int bands_done;  // started bands done with the last frame
+	bool bands_quit;
+
+	// Only touched by the writer thread
+	uint8_t *encoded;
+	size_t encoded_size;
+	double encode_time, write_time;
+	uint64_t bytes_written;
+};
+
+enum export_format parse_export_format(const char *name) {
+	if (strcmp(name, "raw") == 0) {
+		return EXPORT_FORMAT_RAW;
+	} else if (strcmp(name, "ppm") == 0) {
+		return EXPORT_FORMAT_PPM;
+	} else if (strcmp(name, "y4m") == 0) {
+		return EXPORT_FORMAT_Y4M;
+	}
+	swaybg_log(LOG_ERROR, "Unsupported export format: %s", name);
+	return EXPORT_FORMAT_INVALID;
+}
+
+static double get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t encode_rgb(uint8_t *dst, const uint32_t *pixels, size_t n_pixels) {
+	for (size_t i = 0; i < n_pixels; i++) {
+		uint32_t p = pixels[i];
+		*dst++ = p >> 16;
+		*dst++ = p >> 8;
+		*dst++ = p;
+	}
+	return n_pixels * 3;
+}
+
+// Full-resolution Y, Cb and Cr planes, BT.601 with limited range
+static size_t encode_yuv444(uint8_t *dst, const uint32_t *pixels, size_t n_pixels) {
+	uint8_t *y_plane = dst;
+	uint8_t *u_plane = dst + n_pixels;
+	uint8_t *v_plane = dst + 2 * n_pixels;
+	for (size_t i = 0; i < n_pixels; i++) {
+		int r = (pixels[i] >> 16) & 0xFF;
+		int g = (pixels[i] >> 8) & 0xFF;
+		int b = pixels[i] & 0xFF;
+		y_plane[i] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+		u_plane[i] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+		v_plane[i] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+	}
+	return n_pixels * 3;
+}
+
+static size_t encode_frame(struct exporter *exporter, const uint32_t *pixels) {
+	size_t n_pixels = (size_t)exporter->width * exporter->height;
+	uint8_t *dst = exporter->encoded;
+	switch (exporter->options->format) {
+	case EXPORT_FORMAT_RAW:
+		return encode_rgb(dst, pixels, n_pixels);
+	case EXPORT_FORMAT_PPM: {
+		int header = sprintf((char *)dst, "P6\n%d %d\n255\n",
+				exporter->width, exporter->height);
+		return header + encode_rgb(dst + header, pixels, n_pixels);
+	}
+	case EXPORT_FORMAT_Y4M: {
+		memcpy(dst, "FRAME\n", 6);
+		return 6 + encode_yuv444(dst + 6, pixels, n_pixels);
+	}
+	case EXPORT_FORMAT_INVALID:
+		break;
+	}
+	return 0;
+}
+
+static void *writer(void *data) {
+	struct exporter *exporter = data;
+
+	for (unsigned int i = 0; ; i++) {
+		struct export_slot *slot = &exporter->slots[i % EXPORT_SLOTS];
+		pthread_mutex_lock(&exporter->lock);
+		while (!slot->full && !exporter->done) {
+			pthread_cond_wait(&exporter->cond, &exporter->lock);
+		}
+		bool full = slot->full;
+		pthread_mutex_unlock(&exporter->lock);
+		if (!full) {
+			break;
+		}
+
+		double start = get_time();
+		size_t size = encode_frame(exporter, slot->pixels);
+		double encoded = get_time();
+		bool ok = fwrite(exporter->encoded, 1, size, exporter->file) == size;
+		exporter->encode_time += encoded - start;
+		exporter->write_time += get_time() - encoded;
+		exporter->bytes_written += size;
+
+		pthread_mutex_lock(&exporter->lock);
+		slot->full = false;
+		if (!ok) {
+			swaybg_log_errno(LOG_ERROR, "Failed to write frame %u",
+					slot->frame);
+			exporter->failed = true;
+			exporter->done = true;
+		}
+		pthread_cond_broadcast(&exporter->cond);
+		pthread_mutex_unlock(&exporter->lock);
+		if (!ok) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Wait for the slot of `frame` to be free, and fill it with the canvas. Returns
+ * false if the writer failed.
+ */
+static bool submit_frame(struct exporter *exporter, const uint32_t *canvas,
+		unsigned int frame) {
+	struct export_slot *slot = &exporter->slots[frame % EXPORT_SLOTS];
+	pthread_mutex_lock(&exporter->lock);
+	while (slot->full && !exporter->failed) {
+		pthread_cond_wait(&exporter->cond, &exporter->lock);
+	}
+	bool failed = exporter->failed;
+	pthread_mutex_unlock(&exporter->lock);
+	if (failed) {
+		return false;
+	}
+
+	memcpy(slot->pixels, canvas,
+			(size_t)exporter->width * exporter->height * sizeof(uint32_t));
+	slot->frame = frame;
+
+	pthread_mutex_lock(&exporter->lock);
+	slot->full = true;
+	pthread_cond_broadcast(&exporter->cond);
+	pthread_mutex_unlock(&exporter->lock);
+	return true;
+}
+
+static void finish_exporter(struct exporter *exporter, pthread_t thread) {
+	pthread_mutex_lock(&exporter->lock);
+	exporter->done = true;
+	pthread_cond_broadcast(&exporter->cond);
+	pthread_mutex_unlock(&exporter->lock);
+	pthread_join(thread, NULL);
+}
+
+/*
+ * Bring a band of the canvas from the frame rendered with old_lut and
+ * old_generation to the current one. Only reads the image, so that bands can be
+ * rendered at once.
+ */
+static void render_band(struct exporter *exporter, struct export_band *band) {
+	const struct lbm_image *image = exporter->image;
+	uint32_t *buffer = exporter->canvas + (size_t)band->y * exporter->width;
+	int stride = exporter->width * sizeof(uint32_t);
+	int origin_y = exporter->origin_y - band->y;
+	struct bounding_box damage;
+	render_pixel_changes(buffer, image, exporter->old_generation,
+			exporter->width, band->height, stride, exporter->origin_x,
+			origin_y, exporter->lbm_scale, &damage);
+	if (!lbm_layout_matches(band->layout, image, exporter->width,
+			band->height, stride, exporter->origin_x, origin_y,
+			exporter->lbm_scale)) {
+		lbm_layout_destroy(band->layout);
+		band->layout = lbm_layout_create(image, exporter->width,
+				band->height, stride, exporter->origin_x, origin_y,
+				exporter->lbm_scale);
+	}
+	render_ranges(buffer, image, band->layout, exporter->old_lut,
+			exporter->width, band->height, stride, exporter->origin_x,
+			origin_y, exporter->lbm_scale, &damage);
+}
+
+static void *band_worker(void *data) {
+	struct export_band *band = data;
+	struct exporter *exporter = band->exporter;
+	unsigned int frame = 0;
+	pthread_mutex_lock(&exporter->band_lock);
+	while (true) {
+		while (exporter->band_frame == frame && !exporter->bands_quit) {
+			pthread_cond_wait(&exporter->band_cond, &exporter->band_lock);
+		}
+		if (exporter->bands_quit) {
+			break;
+		}
+		frame = exporter->band_frame;
+		pthread_mutex_unlock(&exporter->band_lock);
+
+		render_band(exporter, band);
+
+		pthread_mutex_lock(&exporter->band_lock);
+		exporter->bands_done++;
+		pthread_cond_broadcast(&exporter->band_cond);
+	}
+	pthread_mutex_unlock(&exporter->band_lock);
+	return NULL;
+}
+
+/*
+ * Split the canvas into bands, one per CPU up to MAX_BANDS, and start a thread
+ * for each but the first. Stage hooks are not called from several threads at
+ * once, so the canvas is one band while they are installed.
+ */
+static void start_bands(struct exporter *exporter, bool hooks) {
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t n_pixels = (size_t)exporter->width * exporter->height;
+	int n_bands = (int)MIN(n_pixels / BAND_MIN_PIXELS,
+		(size_t)MIN((int)MAX(n_cpus, 1), MAX_BANDS));
+	n_bands = hooks ? 1 : MAX(MIN(n_bands, exporter->height), 1);
+	exporter->n_bands = n_bands;
+	pthread_mutex_init(&exporter->band_lock, NULL);
+	pthread_cond_init(&exporter->band_cond, NULL);
+	for (int t = 0; t < n_bands; t++) {
+		struct export_band *band = &exporter->bands[t];
+		int y = (int)((long)exporter->height * t / n_bands);
+		*band = (struct export_band){
+			.exporter = exporter,
+			.y = y,
+			.height = (int)((long)exporter->height * (t + 1) / n_bands) - y,
+		};
+		// The calling thread takes the first band, and any that a thread
+		// cannot be started for
+		if (t > 0) {
+			band->started = pthread_create(&band->thread, NULL,
+					band_worker, band) == 0;
+		}
+	}
+}
+
+static void render_bands(struct exporter *exporter) {
+	int n_started = 0;
+	pthread_mutex_lock(&exporter->band_lock);
+	exporter->bands_done = 0;
+	exporter->band_frame++;
+	pthread_cond_broadcast(&exporter->band_cond);
+	pthread_mutex_unlock(&exporter->band_lock);
+	for (int t = 0; t < exporter->n_bands; t++) {
+		if (exporter->bands[t].started) {
+			n_started++;
+		} else {
+			render_band(exporter, &exporter->bands[t]);
+		}
+	}
+	pthread_mutex_lock(&exporter->band_lock);
+	while (exporter->bands_done < n_started) {
+		pthread_cond_wait(&exporter->band_cond, &exporter->band_lock);
+	}
+	pthread_mutex_unlock(&exporter->band_lock);
+}
+
+static void finish_bands(struct exporter *exporter) {
+	pthread_mutex_lock(&exporter->band_lock);
+	exporter->bands_quit = true;
+	pthread_cond_broadcast(&exporter->band_cond);
+	pthread_mutex_unlock(&exporter->band_lock);
+	for (int t = 0; t < exporter->n_bands; t++) {
+		struct export_band *band = &exporter->bands[t];
+		if (band->started) {
+			pthread_join(band->thread, NULL);
+		}
+		lbm_layout_destroy(band->layout);
+	}
+	pthread_cond_destroy(&exporter->band_cond);
+	pthread_mutex_destroy(&exporter->band_lock);
+}
+
+int export_lbm_image(const char *image_path, enum background_mode mode,
+		uint32_t color, const struct export_options *options) {
+	if (mode != BACKGROUND_MODE_FIT && mode != BACKGROUND_MODE_FILL &&
+			mode != BACKGROUND_MODE_CENTER) {
+		swaybg_log(LOG_ERROR, "Only modes \"fit\", \"fill\" and \"center\" can be exported");
+		return EXIT_FAILURE;
+	}
+	struct perf_counters *counters = NULL;
+	if (options->perf_counters) {
+		counters = perf_counters_create();
+		if (counters) {
+			perf_counters_install(counters);
+		}
+	}
+	struct lbm_image *image = read_lbm_image(image_path);
+	if (!image) {
+		swaybg_log(LOG_ERROR, "Failed to load LBM image: %s", image_path);
+		lbm_set_stage_hooks(NULL);
+		perf_counters_destroy(counters);
+		return EXIT_FAILURE;
+	}
+
+	struct exporter exporter = {
+		.options = options,
+		.width = options->width ? options->width : (int)image->width,
+		.height = options->height ? options->height : (int)image->height,
+	};
+	int scale = options->scale > 0 ? options->scale : 1;
+	exporter.width *= scale;
+	exporter.height *= scale;
+	size_t n_pixels = (size_t)exporter.width * exporter.height;
+	int stride = exporter.width * sizeof(uint32_t);
+
+	int origin_x, origin_y;
+	unsigned int lbm_scale;
+	get_lbm_image_geometry(image, mode, exporter.width, exporter.height,
+			&origin_x, &origin_y, &lbm_scale);
+
+	int ret = EXIT_FAILURE;
+	// Range pixels on the canvas, made again when an ANIM frame changes them
+	struct lbm_layout *layout = NULL;
+	uint32_t *canvas = malloc(n_pixels * sizeof(uint32_t));
+	// Large enough for any header and the 3 bytes per pixel of every format
+	exporter.encoded_size = n_pixels * 3 + 64;
+	exporter.encoded = malloc(exporter.encoded_size);
+	bool ok = canvas && exporter.encoded;
+	for (int i = 0; i < EXPORT_SLOTS; i++) {
+		exporter.slots[i].pixels = malloc(n_pixels * sizeof(uint32_t));
+		ok = ok && exporter.slots[i].pixels;
+	}
+	if (!ok) {
+		swaybg_log(LOG_ERROR, "Failed to allocate %dx%d export buffers",
+				exporter.width, exporter.height);
+		goto cleanup;
+	}
+
+	if (strcmp(options->path, "-") == 0) {
+		exporter.file = stdout;
+	} else {
+		exporter.file = fopen(options->path, "wb");
+		if (!exporter.file) {
+			swaybg_log_errno(LOG_ERROR, "Failed to open %s", options->path);
+			goto cleanup;
+		}
+	}
+	if (options->format == EXPORT_FORMAT_Y4M) {
+		fprintf(exporter.file, "YUV4MPEG2 W%d H%d F60:1 Ip A1:1 C444\n",
+				exporter.width, exporter.height);
+	}
+
+	// Margins around the image show the background color
+	uint32_t background = pixel_format_convert(PIXEL_FORMAT_XRGB8888,
+			color >> 8);
+	fill_lbm_margins(canvas, image, background, exporter.width,
+			exporter.height, stride, origin_x, origin_y, lbm_scale);
+
+	pthread_mutex_init(&exporter.lock, NULL);
+	pthread_cond_init(&exporter.cond, NULL);
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, writer, &exporter) != 0) {
+		swaybg_log(LOG_ERROR, "Failed to create export thread");
+		goto cleanup_sync;
+	}
+
+	exporter.image = image;
+	exporter.canvas = canvas;
+	exporter.origin_x = origin_x;
+	exporter.origin_y = origin_y;
+	exporter.lbm_scale = lbm_scale;
+	start_bands(&exporter, counters != NULL);
+
+	swaybg_log(LOG_INFO, "Exporting %u frames of %s at %dx%d (image scale %u) "
+			"on %d threads", options->n_frames, image_path, exporter.width,
+			exporter.height, lbm_scale, exporter.n_bands);
+
+	double start = get_time();
+	double render_time = 0;
+	// Frame of an ANIM the canvas shows
+	uint64_t generation = 0;
+	unsigned int frame;
+	for (frame = 0; frame < options->n_frames; frame++) {
+		double render_start = get_time();
+		if (frame == 0) {
+			render_lbm_image(canvas, image, exporter.width, exporter.height,
+					stride, origin_x, origin_y, lbm_scale);
+		} else if (exporter.n_bands > 1) {
+			memcpy(exporter.old_lut, image->lut, sizeof(image->lut));
+			exporter.old_generation = generation;
+			if (cycle_palette(image)) {
+				render_bands(&exporter);
+			}
+		} else if (cycle_palette(image)) {
+			struct bounding_box damage;
+			render_pixel_changes(canvas, image, generation, exporter.width,
+					exporter.height, stride, origin_x, origin_y, lbm_scale,
+					&damage);
+			if (!lbm_layout_matches(layout, image, exporter.width,
+					exporter.height, stride, origin_x, origin_y, lbm_scale)) {
+				lbm_layout_destroy(layout);
+				layout = lbm_layout_create(image, exporter.width,
+						exporter.height, stride, origin_x, origin_y, lbm_scale);
+			}
+			render_delta(canvas, image, layout, exporter.width,
+					exporter.height, stride, origin_x, origin_y, lbm_scale,
+					&damage, true);
+		}
+		generation = lbm_pixels_generation(image);
+		render_time += get_time() - render_start;
+		if (!submit_frame(&exporter, canvas, frame)) {
+			break;
+		}
+	}
+	finish_bands(&exporter);
+	finish_exporter(&exporter, thread);
+	double elapsed = get_time() - start;
+
+	if (exporter.file != stdout && fclose(exporter.file) != 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to write %s", options->path);
+		exporter.failed = true;
+	} else if (exporter.file == stdout) {
+		fflush(stdout);
+	}
+	exporter.file = NULL;
+
+	if (!exporter.failed) {
+		ret = EXIT_SUCCESS;
+		double n = frame ? frame : 1;
+		swaybg_log(LOG_INFO, "Exported %u frames in %.3f s: %.1f fps, "
+				"%.1f MiB/s; per frame: render %.3f ms, encode %.3f ms, "
+				"write %.3f ms", frame, elapsed, frame / elapsed,
+				exporter.bytes_written / elapsed / (1024 * 1024),
+				render_time / n * 1000, exporter.encode_time / n * 1000,
+				exporter.write_time / n * 1000);
+		if (counters) {
+			perf_counters_report(counters);
+		}
+	}
+
+cleanup_sync:
+	pthread_cond_destroy(&exporter.cond);
+	pthread_mutex_destroy(&exporter.lock);
+cleanup:
+	if (exporter.file && exporter.file != stdout) {
+		fclose(exporter.file);
+	}
+	for (int i = 0; i < EXPORT_SLOTS; i++) {
+		free(exporter.slots[i].pixels);
+	}
+	free(exporter.encoded);
+	free(canvas);
+	lbm_layout_destroy(layout);
+	free_lbm_image(image);
+	if (counters) {
+		lbm_set_stage_hooks(NULL);
+		perf_counters_destroy(counters);
+	}
+	return ret;
+}
@@ -0,0 +1,333 @@
+#define _POSIX_C_SOURCE 200809L
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "frame-ring.h"
+#include "log.h"
+
+// Longest period that is simulated, about 19 hours of animation at 60Hz
+#define MAX_PERIOD ((uint64_t)1 << 22)
+
+struct range_state {
+	uint16_t cycle_idx;
+	uint16_t offset;
+	bool damaged;
+};
+
+/*
+ * Only the fields lbm_advance changes are saved, so that the count of frames
+ * can rewind the ring's copy of the image before rendering them.
+ */
+struct palette_state {
+	color_register palette[256];
+	uint32_t lut[256];
+	struct range_state *ranges;
+	unsigned long frame_count;
+	unsigned long tick_count;
+};
+
+static bool save_palette_state(struct palette_state *state,
+		const struct lbm_image *image) {
+	memcpy(state->palette, image->palette, sizeof(state->palette));
+	memcpy(state->lut, image->lut, sizeof(state->lut));
+	state->ranges = calloc(image->n_ranges, sizeof(struct range_state));
+	if (!state->ranges) {
+		return false;
+	}
+	for (unsigned int i = 0; i < image->n_ranges; i++) {
+		state->ranges[i].cycle_idx = image->range_pixels[i].cycle_idx;
+		state->ranges[i].offset = image->range_pixels[i].offset;
+		state->ranges[i].damaged = image->range_pixels[i].damaged;
+	}
+	state->frame_count = image->frame_count;
+	state->tick_count = image->tick_count;
+	return true;
+}
+
+static void restore_palette_state(struct palette_state *state,
+		struct lbm_image *image) {
+	memcpy(image->palette, state->palette, sizeof(state->palette));
+	memcpy(image->lut, state->lut, sizeof(state->lut));
+	for (unsigned int i = 0; i < image->n_ranges; i++) {
+		image->range_pixels[i].cycle_idx = state->ranges[i].cycle_idx;
+		image->range_pixels[i].offset = state->ranges[i].offset;
+		image->range_pixels[i].damaged = state->ranges[i].damaged;
+	}
+	image->frame_count = state->frame_count;
+	image->tick_count = state->tick_count;
+	free(state->ranges);
+}
+
+/*
+ * Ticks to advance by to reach the next change of the palette, without going
+ * past the end of the period. Ticks in between leave the palette as it is.
+ */
+static unsigned long ticks_to_next_change(const struct lbm_image *image,
+		uint64_t remaining) {
+	unsigned long ticks = lbm_ticks_until_change(image);
+	if (ticks == 0 || ticks > remaining) {
+		return remaining;
+	}
+	return ticks;
+}
+
+static void clear_damage(struct lbm_image *image) {
+	for (unsigned int i = 0; i < image->n_ranges; i++) {
+		image->range_pixels[i].damaged = false;
+	}
+}
+
+/*
+ * Rings destroyed while the compositor still holds some of their frames. Their
+ * block is freed once the last of them is released.
+ */
+static struct wl_list orphans = { &orphans, &orphans };
+
+static bool ring_busy(const struct frame_ring *ring) {
+	for (unsigned int i = 0; i < ring->n_frames; i++) {
+		if (ring->frames[i].buffer && !ring->frames[i].available) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void free_ring(struct frame_ring *ring) {
+	for (unsigned int i = 0; i < ring->n_frames; i++) {
+		if (ring->frames[i].buffer) {
+			wl_buffer_destroy(ring->frames[i].buffer);
+		}
+	}
+	if (ring->block.size) {
+		free_shm_block(&ring->block);
+	}
+	free(ring->image.range_pixels);
+	free(ring->frames);
+	free(ring);
+}
+
+static void handle_frame_release(void *data, struct wl_buffer *buffer) {
+	struct frame_ring_frame *frame = data;
+	struct frame_ring *ring = frame->ring;
+	frame->available = true;
+	if (ring->orphaned && !ring_busy(ring)) {
+		wl_list_remove(&ring->link);
+		free_ring(ring);
+	}
+}
+
+static const struct wl_buffer_listener frame_buffer_listener = {
+	.release = handle_frame_release,
+};
+
+struct frame_ring *frame_ring_create(const struct lbm_image *image,
+		const struct lbm_layout *layout, int32_t width, int32_t height,
+		int32_t stride, enum pixel_format format, int origin_x, int origin_y,
+		int scale, size_t budget) {
+	struct frame_ring *ring = calloc(1, sizeof(struct frame_ring));
+	if (!ring) {
+		return NULL;
+	}
+	ring->image = *image;
+	if (image->n_ranges) {
+		ring->image.range_pixels = calloc(image->n_ranges,
+				sizeof(struct pixel_list));
+		if (!ring->image.range_pixels) {
+			free(ring);
+			return NULL;
+		}
+		memcpy(ring->image.range_pixels, image->range_pixels,
+				image->n_ranges * sizeof(struct pixel_list));
+	}
+	ring->start_tick = image->tick_count;
+	ring->layout = layout;
+	ring->origin_x = origin_x;
+	ring->origin_y = origin_y;
+	ring->scale = scale;
+	ring->budget = budget;
+	ring->width = width;
+	ring->height = height;
+	ring->stride = stride;
+	ring->format = format;
+
+	// Each frame starts on a page boundary so that the pool can be mapped
+	// as a whole while frames are written independently
+	long page_size = sysconf(_SC_PAGESIZE);
+	ring->frame_size = (size_t)stride * height;
+	ring->frame_stride = (ring->frame_size + page_size - 1) / page_size * page_size;
+	return ring;
+}
+
+void frame_ring_plan(struct frame_ring *ring) {
+	struct lbm_image *image = &ring->image;
+	uint64_t period = lbm_cycle_period(image, MAX_PERIOD);
+	if (period == 0) {
+		swaybg_log(LOG_DEBUG, "Not pre-rendering frames: period is too long "
+				"or the image does not animate");
+		return;
+	}
+
+	struct palette_state saved;
+	if (!save_palette_state(&saved, image)) {
+		return;
+	}
+	unsigned int n_frames = 0;
+	for (uint64_t tick = 0; tick < period;) {
+		unsigned long ticks = ticks_to_next_change(image, period - tick);
+		tick += ticks;
+		if (lbm_advance(image, ticks)) {
+			n_frames++;
+		}
+	}
+	// The last frame is drawn over frame 0, which only works if the period
+	// really returns to it
+	bool repeats = memcmp(image->palette, saved.palette,
+			sizeof(saved.palette)) == 0 &&
+		memcmp(image->lut, saved.lut, sizeof(saved.lut)) == 0;
+	restore_palette_state(&saved, image);
+	if (!repeats) {
+		swaybg_log(LOG_ERROR, "Not pre-rendering frames: the palette does not "
+				"repeat after %lu ticks", (unsigned long)period);
+		return;
+	}
+
+	size_t size = n_frames * ring->frame_stride;
+	if (n_frames < 2 || size > ring->budget || size > INT32_MAX) {
+		swaybg_log(LOG_INFO, "Not pre-rendering %u frames of %zu bytes: "
+				"budget is %zu bytes", n_frames, ring->frame_stride,
+				ring->budget);
+		return;
+	}
+	ring->frames = calloc(n_frames, sizeof(struct frame_ring_frame));
+	if (!ring->frames) {
+		return;
+	}
+	ring->n_frames = n_frames;
+	ring->current = n_frames;
+	ring->period = period;
+}
+
+bool frame_ring_alloc(struct frame_ring *ring, struct wl_shm *shm) {
+	return alloc_shm_block(shm, ring->n_frames * ring->frame_stride,
+			&ring->block);
+}
+
+void frame_ring_render(struct frame_ring *ring, const void *base,
+		const uint32_t *old_lut) {
+	struct lbm_image *image = &ring->image;
+	uint8_t *frames = ring->block.data;
+
+	// The palette may have moved on since the base was rendered
+	struct bounding_box damage;
+	memcpy(frames, base, ring->frame_size);
+	render_ranges(frames, image, ring->layout, old_lut, ring->width,
+			ring->height, ring->stride, ring->origin_x, ring->origin_y,
+			ring->scale, &damage);
+
+	// Render each frame as a delta of the previous one
+	clear_damage(image);
+	unsigned int frame_idx = 0;
+	for (uint64_t tick = 0; tick < ring->period;) {
+		unsigned long ticks = ticks_to_next_change(image, ring->period - tick);
+		tick += ticks;
+		if (!lbm_advance(image, ticks)) {
+			continue;
+		}
+		// The last change of the period returns to frame 0. Redrawing it
+		// rewrites identical pixels, but yields the damage into frame 0.
+		frame_idx = (frame_idx + 1) % ring->n_frames;
+		struct frame_ring_frame *frame = &ring->frames[frame_idx];
+		uint8_t *data = frames + frame_idx * ring->frame_stride;
+		if (frame_idx != 0) {
+			memcpy(data, data - ring->frame_stride, ring->frame_size);
+			frame->tick = tick;
+		}
+		render_delta(data, image, ring->layout, ring->width, ring->height,
+				ring->stride, ring->origin_x, ring->origin_y, ring->scale,
+				&frame->damage, true);
+	}
+}
+
+void frame_ring_finish(struct frame_ring *ring) {
+	for (unsigned int i = 0; i < ring->n_frames; i++) {
+		struct frame_ring_frame *frame = &ring->frames[i];
+		frame->buffer = wl_shm_pool_create_buffer(ring->block.pool,
+				ring->block.offset + i * ring->frame_stride,
+				ring->width, ring->height, ring->stride,
+				pixel_format_to_wl_shm(ring->format));
+		frame->ring = ring;
+		frame->available = true;
+		wl_buffer_add_listener(frame->buffer, &frame_buffer_listener, frame);
+	}
+
+	swaybg_log(LOG_INFO, "Pre-rendered %u frames over a period of %lu ticks "
+			"(%zu bytes)", ring->n_frames, (unsigned long)ring->period,
+			ring->block.size);
+}
+
+void frame_ring_destroy(struct frame_ring *ring) {
+	if (!ring) {
+		return;
+	}
+	if (!ring_busy(ring)) {
+		free_ring(ring);
+		return;
+	}
+	// The compositor may still read attached frames, keep the block until
+	// they are released. Released frames are not attached again.
+	for (unsigned int i = 0; i < ring->n_frames; i++) {
+		struct frame_ring_frame *frame = &ring->frames[i];
+		if (frame->available) {
+			wl_buffer_destroy(frame->buffer);
+			frame->buffer = NULL;
+		}
+	}
+	ring->orphaned = true;
+	wl_list_insert(&orphans, &ring->link);
+}
+
+void frame_ring_destroy_orphans(void) {
+	struct frame_ring *ring, *tmp;
+	wl_list_for_each_safe(ring, tmp, &orphans, link) {
+		wl_list_remove(&ring->link);
+		free_ring(ring);
+	}
+}
+
+struct frame_ring_frame *frame_ring_update(struct frame_ring *ring,
+		const struct lbm_image *image, struct bounding_box *damage) {
+	uint64_t offset = (image->tick_count - ring->start_tick) % ring->period;
+
+	// Find the last frame shown at or before this tick
+	unsigned int lo = 0, hi = ring->n_frames - 1;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi + 1) / 2;
+		if (ring->frames[mid].tick <= offset) {
+			lo = mid;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (lo == ring->current) {
+		return NULL;
+	}
+
+	struct frame_ring_frame *frame = &ring->frames[lo];
+	if (!frame->available) {
+		return NULL;
+	}
+	if (ring->current < ring->n_frames &&
+			lo == (ring->current + 1) % ring->n_frames) {
+		*damage = frame->damage;
+	} else {
+		// Skipped frames, the changes since the current one are unknown
+		damage->min_x = 0;
+		damage->min_y = 0;
+		damage->max_x = ring->width;
+		damage->max_y = ring->height;
+	}
+	ring->current = lo;
+	frame->available = false;
+	return frame;
+}
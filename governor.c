@@ -0,0 +1,227 @@
+#define _POSIX_C_SOURCE 200809L
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "governor.h"
+#include "log.h"
+
+// Power supplies report changes within seconds, so this is soon enough
+#define GOVERNOR_INTERVAL_MS 5000
+
+struct governor {
+	char *root;
+	struct governor_policy battery;
+	struct governor_policy busy;
+	double busy_load;
+
+	bool on_battery;
+	bool is_busy;
+	struct governor_policy policy;
+	uint64_t next_check;  // ms, 0 before the first check
+};
+
+bool parse_governor_policy(const char *str, struct governor_policy *policy) {
+	*policy = GOVERNOR_POLICY_FULL;
+	if (strcmp(str, "full") == 0) {
+		return true;
+	} else if (strcmp(str, "half") == 0) {
+		policy->slowdown = 2;
+		return true;
+	} else if (strcmp(str, "pause") == 0) {
+		policy->paused = true;
+		return true;
+	}
+	char *end;
+	unsigned long fps = strtoul(str, &end, 10);
+	if (*end != '\0' || end == str || fps == 0 || fps > 1000) {
+		return false;
+	}
+	policy->max_fps = fps;
+	return true;
+}
+
+bool governor_policy_equal(const struct governor_policy *a,
+		const struct governor_policy *b) {
+	return a->paused == b->paused && a->max_fps == b->max_fps &&
+		a->slowdown == b->slowdown;
+}
+
+void governor_policy_merge(struct governor_policy *policy,
+		const struct governor_policy *other) {
+	policy->paused = policy->paused || other->paused;
+	if (other->max_fps && (!policy->max_fps || other->max_fps < policy->max_fps)) {
+		policy->max_fps = other->max_fps;
+	}
+	if (other->slowdown > policy->slowdown) {
+		policy->slowdown = other->slowdown;
+	}
+}
+
+static bool policy_is_full(const struct governor_policy *policy) {
+	struct governor_policy full = GOVERNOR_POLICY_FULL;
+	return governor_policy_equal(policy, &full);
+}
+
+/*
+ * Read the first line of a file into `buf`, without the newline.
+ */
+static bool read_line(const char *path, char *buf, size_t size) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return false;
+	}
+	bool ok = fgets(buf, size, f) != NULL;
+	fclose(f);
+	if (ok) {
+		buf[strcspn(buf, "\n")] = '\0';
+	}
+	return ok;
+}
+
+static bool read_supply_attr(const char *dir, const char *name,
+		const char *attr, char *buf, size_t size) {
+	char path[PATH_MAX];
+	int len = snprintf(path, sizeof(path), "%s/%s/%s", dir, name, attr);
+	return len > 0 && (size_t)len < sizeof(path) && read_line(path, buf, size);
+}
+
+/*
+ * The machine runs on battery if no mains or USB supply is online, and one of
+ * its own batteries is discharging or there is a supply that could be online.
+ * Batteries of peripherals, whose scope is "Device", do not count. Machines
+ * without power supplies are taken to be on mains.
+ */
+static bool read_on_battery(const char *root) {
+	char dir[PATH_MAX];
+	snprintf(dir, sizeof(dir), "%s/sys/class/power_supply", root);
+	DIR *d = opendir(dir);
+	if (!d) {
+		return false;
+	}
+	bool mains_online = false, has_mains = false;
+	bool has_battery = false, discharging = false;
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		char type[32], value[32];
+		if (!read_supply_attr(dir, entry->d_name, "type", type, sizeof(type))) {
+			continue;
+		}
+		if (strcmp(type, "Mains") == 0 || strncmp(type, "USB", 3) == 0) {
+			has_mains = true;
+			if (read_supply_attr(dir, entry->d_name, "online", value, sizeof(value)) &&
+					strcmp(value, "1") == 0) {
+				mains_online = true;
+			}
+		} else if (strcmp(type, "Battery") == 0) {
+			if (read_supply_attr(dir, entry->d_name, "scope", value, sizeof(value)) &&
+					strcmp(value, "Device") == 0) {
+				continue;
+			}
+			has_battery = true;
+			if (read_supply_attr(dir, entry->d_name, "status", value, sizeof(value)) &&
+					strcmp(value, "Discharging") == 0) {
+				discharging = true;
+			}
+		}
+	}
+	closedir(d);
+	return !mains_online && has_battery && (discharging || has_mains);
+}
+
+/*
+ * 1-minute load average per online CPU, or 0 if it cannot be read.
+ */
+static double read_load(const char *root) {
+	char path[PATH_MAX], line[128];
+	snprintf(path, sizeof(path), "%s/proc/loadavg", root);
+	double load;
+	if (!read_line(path, line, sizeof(line)) || sscanf(line, "%lf", &load) != 1) {
+		return 0;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return cpus > 0 ? load / cpus : load;
+}
+
+struct governor *governor_create(const struct governor_config *config) {
+	if (policy_is_full(&config->battery) &&
+			(policy_is_full(&config->busy) || config->busy_load <= 0)) {
+		return NULL;
+	}
+	struct governor *governor = calloc(1, sizeof(struct governor));
+	if (!governor) {
+		return NULL;
+	}
+	governor->root = strdup(config->root ? config->root : "");
+	governor->battery = config->battery;
+	governor->busy = config->busy;
+	governor->busy_load = config->busy_load;
+	governor->policy = GOVERNOR_POLICY_FULL;
+	return governor;
+}
+
+void governor_destroy(struct governor *governor) {
+	if (!governor) {
+		return;
+	}
+	free(governor->root);
+	free(governor);
+}
+
+bool governor_update(struct governor *governor, uint64_t now_ms) {
+	if (governor->next_check && now_ms < governor->next_check) {
+		return false;
+	}
+	governor->next_check = now_ms + GOVERNOR_INTERVAL_MS;
+
+	struct governor_policy policy = GOVERNOR_POLICY_FULL;
+	bool on_battery = false, is_busy = false;
+	if (!policy_is_full(&governor->battery)) {
+		on_battery = read_on_battery(governor->root);
+		if (on_battery) {
+			governor_policy_merge(&policy, &governor->battery);
+		}
+	}
+	if (!policy_is_full(&governor->busy) && governor->busy_load > 0) {
+		is_busy = read_load(governor->root) >= governor->busy_load;
+		if (is_busy) {
+			governor_policy_merge(&policy, &governor->busy);
+		}
+	}
+
+	if (on_battery != governor->on_battery || is_busy != governor->is_busy) {
+		swaybg_log(LOG_INFO, "Running on %s%s", on_battery ? "battery" : "mains",
+				is_busy ? ", system is busy" : "");
+	}
+	governor->on_battery = on_battery;
+	governor->is_busy = is_busy;
+	if (governor_policy_equal(&policy, &governor->policy)) {
+		return false;
+	}
+	governor->policy = policy;
+	return true;
+}
+
+int governor_get_timeout(const struct governor *governor, uint64_t now_ms) {
+	if (!governor->next_check || governor->next_check <= now_ms) {
+		return 0;
+	}
+	return governor->next_check - now_ms;
+}
+
+const struct governor_policy *governor_get_policy(const struct governor *governor) {
+	return &governor->policy;
+}
+
+bool governor_on_battery(const struct governor *governor) {
+	return governor->on_battery;
+}
+
+bool governor_busy(const struct governor *governor) {
+	return governor->is_busy;
+}
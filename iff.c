@@ -2,7 +2,6 @@
 
 #include "iff.h"
 
-#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
@@ -12,7 +11,9 @@
 #include <sys/stat.h>
 #include <unistd.h>
 
-#define HDR_SIZE ID_SIZE + sizeof(int32_t)
+#include "memstats.h"
+
+#define HDR_SIZE (ID_SIZE + sizeof(int32_t))
 #ifdef DEBUG_LBM
 static int depth = 0;
 #define PRINT_DEPTH()                 \
@@ -22,22 +23,27 @@ static int depth = 0;
 #endif
 
 #ifdef DEBUG_LBM
-const char *chunk_name[N_CHUNKS] = {"FORM", "BMHD", "CMAP", "CRNG", "BODY", "UNKNOWN"};
+const char *chunk_name[N_CHUNKS] = {"FORM", "BMHD", "CMAP", "CRNG", "BODY", "ANHD", "DLTA", "UNKNOWN"};
 #endif
 
 struct chunk *parse(const void *data, size_t size);
 
+// Chunk ids are not terminated, the size of the chunk follows them
 chunk_id get_id(const char *id) {
-    if (strcmp(id, "FORM") == 0) {
+    if (memcmp(id, "FORM", ID_SIZE) == 0) {
         return FORM;
-    } else if (strcmp(id, "BMHD") == 0) {
+    } else if (memcmp(id, "BMHD", ID_SIZE) == 0) {
         return BMHD;
-    } else if (strcmp(id, "CMAP") == 0) {
+    } else if (memcmp(id, "CMAP", ID_SIZE) == 0) {
         return CMAP;
-    } else if (strcmp(id, "CRNG") == 0) {
+    } else if (memcmp(id, "CRNG", ID_SIZE) == 0) {
         return CRNG;
-    } else if (strcmp(id, "BODY") == 0) {
+    } else if (memcmp(id, "BODY", ID_SIZE) == 0) {
         return BODY;
+    } else if (memcmp(id, "ANHD", ID_SIZE) == 0) {
+        return ANHD;
+    } else if (memcmp(id, "DLTA", ID_SIZE) == 0) {
+        return DLTA;
     } else {
         return UNKNOWN;
     }
@@ -45,6 +51,38 @@ chunk_id get_id(const char *id) {
 
 void free_BODY(struct ck_BODY *c) { free(c->body); }
 
+void free_DLTA(struct ck_DLTA *c) { free(c->data); }
+
+// Bytes allocated for a single chunk, not counting its children
+static size_t chunk_alloc_size(const struct chunk *c) {
+    switch (c->id) {
+        case FORM:
+            return sizeof(struct ck_FORM);
+        case BMHD:
+            return sizeof(struct ck_BMHD);
+        case CMAP:
+            return sizeof(struct ck_CMAP);
+        case CRNG:
+            return sizeof(struct ck_CRNG);
+        case BODY:
+            return sizeof(struct ck_BODY) + c->size + BODY_PADDING;
+        case ANHD:
+            return sizeof(struct ck_ANHD);
+        case DLTA:
+            return sizeof(struct ck_DLTA) + c->size;
+        default:
+            return sizeof(struct chunk);
+    }
+}
+
+size_t chunk_tree_size(const struct chunk *c) {
+    size_t size = 0;
+    for (; c != NULL; c = c->next) {
+        size += chunk_alloc_size(c) + chunk_tree_size(c->child);
+    }
+    return size;
+}
+
 void free_chunk(struct chunk *c) {
     if (!c) {
         return;
@@ -59,9 +97,14 @@ void free_chunk(struct chunk *c) {
 #ifdef DEBUG_LBM
     printf("Freeing chunk %s\n", chunk_name[c->id]);
 #endif
+    memstats_free(MEMSTATS_IFF, chunk_alloc_size(c));
     switch (c->id) {
         case BODY:
             free_BODY((struct ck_BODY *)c);
+            free(c);
+            break;
+        case DLTA:
+            free_DLTA((struct ck_DLTA *)c);
             // fall-through
         default:
             free(c);
@@ -89,6 +132,11 @@ void list_add(struct chunk **head, struct chunk *new) {
     (src) += sizeof(var);                \
     (rem) -= sizeof(var);
 
+#define ULONG(var, src, rem)              \
+    (var) = be32toh(*(uint32_t *)(data)); \
+    (src) += sizeof(var);                 \
+    (rem) -= sizeof(var);
+
 #define UBYTE(var, src, rem)    \
     (var) = *(uint8_t *)(data); \
     (src) += sizeof(var);       \
@@ -100,13 +148,14 @@ void list_add(struct chunk **head, struct chunk *new) {
     (rem) -= sizeof(var);
 
 struct chunk *parseCMAP(const void *data, size_t size) {
-    assert(size == 768);  // Only support 256 color palettes
     struct ck_CMAP *ck = calloc(1, sizeof(struct ck_CMAP));
     ck->base.id = CMAP;
     ck->base.size = size;
 
+    // Images with fewer planes have fewer colors, the rest are left black
     const int map_length = sizeof(ck->ColorMap) / sizeof(ck->ColorMap[0]);
-    for (int i = 0; i < map_length; i++) {
+    const int n_colors = size / 3 < (size_t)map_length ? (int)(size / 3) : map_length;
+    for (int i = 0; i < n_colors; i++) {
         struct ck_CMAP_ColorRegister creg;
         UBYTE(creg.r, data, size);
         UBYTE(creg.g, data, size);
@@ -132,7 +181,7 @@ struct chunk *parseBODY(const void *data, size_t size) {
     ck->base.size = size;
 
     size_t alloc_size = size;
-    ck->body = calloc(1, alloc_size);
+    ck->body = calloc(1, alloc_size + BODY_PADDING);
     memcpy(ck->body, data, alloc_size);
 
 #ifdef DEBUG_LBM
@@ -150,10 +199,66 @@ struct chunk *parseBODY(const void *data, size_t size) {
     return &ck->base;
 }
 
+struct chunk *parseDLTA(const void *data, size_t size) {
+    struct ck_DLTA *ck = calloc(1, sizeof(struct ck_DLTA));
+    ck->base.id = DLTA;
+    ck->base.size = size;
+
+    // Deltas are applied as frames are shown, after the file is closed
+    ck->data = calloc(1, size);
+    memcpy(ck->data, data, size);
+
+#ifdef DEBUG_LBM
+    PRINT_DEPTH() printf("Delta: %ld bytes\n", size);
+#endif
+    return &ck->base;
+}
+
+// Bytes of each chunk that are read, the rest is padding
+#define ANHD_SIZE 24
+#define BMHD_SIZE 20
+#define CRNG_SIZE 8
+
+struct chunk *parseANHD(const void *data, size_t size) {
+    struct ck_ANHD *ck = calloc(1, sizeof(struct ck_ANHD));
+    ck->base.id = ANHD;
+    ck->base.size = size;
+    if (size < ANHD_SIZE) {
+        // Left zeroed, which no delta operation takes
+        return &ck->base;
+    }
+
+    UBYTE(ck->operation, data, size);
+    UBYTE(ck->mask, data, size);
+    UWORD(ck->w, data, size);
+    UWORD(ck->h, data, size);
+    WORD(ck->x, data, size);
+    WORD(ck->y, data, size);
+    ULONG(ck->abstime, data, size);
+    ULONG(ck->reltime, data, size);
+    UBYTE(ck->interleave, data, size);
+    UBYTE(ck->pad0, data, size);
+    ULONG(ck->bits, data, size);
+
+#ifdef DEBUG_LBM
+    PRINT_PROP(ck, operation);
+    PRINT_PROP(ck, w);
+    PRINT_PROP(ck, h);
+    PRINT_PROP(ck, reltime);
+    PRINT_PROP(ck, interleave);
+    PRINT_PROP(ck, bits);
+#endif
+    return &ck->base;
+}
+
 struct chunk *parseCRNG(const void *data, size_t size) {
     struct ck_CRNG *ck = calloc(1, sizeof(struct ck_CRNG));
     ck->base.id = CRNG;
     ck->base.size = size;
+    if (size < CRNG_SIZE) {
+        // Left zeroed, which is a range that does not cycle
+        return &ck->base;
+    }
 
     WORD(ck->pad1, data, size);
     WORD(ck->rate, data, size);
@@ -175,6 +280,10 @@ struct chunk *parse_BMHD(const void *data, size_t size) {
     struct ck_BMHD *ck = calloc(1, sizeof(struct ck_BMHD));
     ck->base.id = BMHD;
     ck->base.size = size;
+    if (size < BMHD_SIZE) {
+        // Left zeroed, which is an empty image
+        return &ck->base;
+    }
 
     UWORD(ck->w, data, size);
     UWORD(ck->h, data, size);
@@ -214,6 +323,9 @@ struct chunk *parse_FORM(const void *data, size_t size) {
     struct ck_FORM *ck = calloc(1, sizeof(struct ck_FORM));
     ck->base.id = FORM;
     ck->base.size = size;
+    if (size < ID_SIZE) {
+        return &ck->base;
+    }
 
     ID(ck->formType, data, size);
 
@@ -222,8 +334,11 @@ struct chunk *parse_FORM(const void *data, size_t size) {
     printf("FormType: %.4s\n", ck->formType);
 #endif
 
-    while (size > 1) {  // Acount for odd number of bytes, in which case there is a 0 padding byte at the end
+    while (size >= HDR_SIZE) {  // Acount for odd number of bytes, in which case there is a 0 padding byte at the end
         struct chunk *next = parse(data, size);
+        if (!next) {
+            break;
+        }
         size -= next->size + HDR_SIZE;
         data += next->size + HDR_SIZE;
         list_add(&ck->base.child, next);
@@ -237,9 +352,16 @@ struct chunk *parse_FORM(const void *data, size_t size) {
 
 // data is set to the beginning of a chunk, before chunk id and size
 struct chunk *parse(const void *const data, const size_t size) {
+    if (size < HDR_SIZE) {
+        return NULL;
+    }
     const char *ckId = data;
     int32_t ckSize = be32toh(*(uint32_t *)(data + ID_SIZE));
     ckSize = ckSize % 2 ? ckSize + 1 : ckSize;  // All chunks are 2-byte aligned
+    if (ckSize < 0 || (size_t)ckSize > size - HDR_SIZE) {
+        // Truncated or malformed, take what there is
+        ckSize = size - HDR_SIZE;
+    }
     const void *chunkStart = data + ID_SIZE + sizeof(ckSize);
 
 #ifdef DEBUG_LBM
@@ -267,6 +389,12 @@ struct chunk *parse(const void *const data, const size_t size) {
         case BODY:
             c = parseBODY(chunkStart, ckSize);
             break;
+        case ANHD:
+            c = parseANHD(chunkStart, ckSize);
+            break;
+        case DLTA:
+            c = parseDLTA(chunkStart, ckSize);
+            break;
         case UNKNOWN:
 #ifdef DEBUG_LBM
             PRINT_DEPTH()
@@ -282,6 +410,9 @@ struct chunk *parse(const void *const data, const size_t size) {
 #ifdef DEBUG_LBM
     depth--;
 #endif
+    if (c) {
+        memstats_alloc(MEMSTATS_IFF, chunk_alloc_size(c));
+    }
     return c;
 }
 
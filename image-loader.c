@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "image-loader.h"
+#include "lbm.h"
+#include "log.h"
+#include "thumbnail-cache.h"
+
+#define MAX_LOADER_THREADS 8
+
+struct image_loader {
+	pthread_t threads[MAX_LOADER_THREADS];
+	int n_threads;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct wl_list pending;   // struct image_load_job::link
+	struct wl_list completed; // struct image_load_job::link
+	bool stop;
+
+	// Written to by workers when a job completes, polled by the main loop
+	int notify_fds[2];
+};
+
+static void run_job(struct image_load_job *job) {
+	const char *path = job->image->path;
+	struct thumbnail thumb;
+	job->anim = read_lbm_image(path);
+	if (job->anim) {
+		thumbnail_from_lbm(job->anim, &thumb);
+		thumbnail_cache_write(path, &thumb);
+		return;
+	}
+	job->surface = load_background_image(path, job->mode,
+			job->decode_width, job->decode_height);
+	if (!job->surface) {
+		swaybg_log(LOG_ERROR, "Failed to load image: %s", path);
+		return;
+	}
+	// For the placeholder shown while the image loads next time
+	thumbnail_from_surface(job->surface, &thumb);
+	thumbnail_cache_write(path, &thumb);
+}
+
+static void *worker(void *data) {
+	struct image_loader *loader = data;
+
+	pthread_mutex_lock(&loader->lock);
+	while (true) {
+		while (!loader->stop && wl_list_empty(&loader->pending)) {
+			pthread_cond_wait(&loader->cond, &loader->lock);
+		}
+		if (loader->stop) {
+			break;
+		}
+		struct image_load_job *job =
+			wl_container_of(loader->pending.prev, job, link);
+		wl_list_remove(&job->link);
+		pthread_mutex_unlock(&loader->lock);
+
+		run_job(job);
+
+		pthread_mutex_lock(&loader->lock);
+		wl_list_insert(loader->completed.prev, &job->link);
+		char c = 0;
+		if (write(loader->notify_fds[1], &c, 1) < 0 && errno != EAGAIN) {
+			swaybg_log_errno(LOG_ERROR, "Failed to signal image completion");
+		}
+	}
+	pthread_mutex_unlock(&loader->lock);
+	return NULL;
+}
+
+static bool set_nonblock_cloexec(int fd) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+		return false;
+	}
+	flags = fcntl(fd, F_GETFD);
+	return flags >= 0 && fcntl(fd, F_SETFD, flags | FD_CLOEXEC) >= 0;
+}
+
+struct image_loader *image_loader_create(void) {
+	struct image_loader *loader = calloc(1, sizeof(struct image_loader));
+	if (!loader) {
+		return NULL;
+	}
+	wl_list_init(&loader->pending);
+	wl_list_init(&loader->completed);
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->cond, NULL);
+
+	if (pipe(loader->notify_fds) < 0 ||
+			!set_nonblock_cloexec(loader->notify_fds[0]) ||
+			!set_nonblock_cloexec(loader->notify_fds[1])) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create image loader pipe");
+		free(loader);
+		return NULL;
+	}
+
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n_threads = n_cpus > 0 ? n_cpus : 1;
+	if (n_threads > MAX_LOADER_THREADS) {
+		n_threads = MAX_LOADER_THREADS;
+	}
+	for (int i = 0; i < n_threads; i++) {
+		if (pthread_create(&loader->threads[i], NULL, worker, loader) != 0) {
+			swaybg_log(LOG_ERROR, "Failed to create image loader thread");
+			break;
+		}
+		loader->n_threads++;
+	}
+	if (loader->n_threads == 0) {
+		image_loader_destroy(loader);
+		return NULL;
+	}
+	swaybg_log(LOG_DEBUG, "Image loader running %d threads", loader->n_threads);
+	return loader;
+}
+
+static void free_job(struct image_load_job *job) {
+	wl_list_remove(&job->link);
+	if (job->anim) {
+		free_lbm_image(job->anim);
+	}
+	if (job->surface) {
+		cairo_surface_destroy(job->surface);
+	}
+	free(job);
+}
+
+void image_loader_destroy(struct image_loader *loader) {
+	if (!loader) {
+		return;
+	}
+	pthread_mutex_lock(&loader->lock);
+	loader->stop = true;
+	pthread_cond_broadcast(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+	for (int i = 0; i < loader->n_threads; i++) {
+		pthread_join(loader->threads[i], NULL);
+	}
+
+	struct image_load_job *job, *tmp;
+	wl_list_for_each_safe(job, tmp, &loader->pending, link) {
+		free_job(job);
+	}
+	wl_list_for_each_safe(job, tmp, &loader->completed, link) {
+		free_job(job);
+	}
+	close(loader->notify_fds[0]);
+	close(loader->notify_fds[1]);
+	pthread_cond_destroy(&loader->cond);
+	pthread_mutex_destroy(&loader->lock);
+	free(loader);
+}
+
+bool image_loader_submit(struct image_loader *loader, struct swaybg_image *image,
+		enum background_mode mode, int decode_width, int decode_height) {
+	struct image_load_job *job = calloc(1, sizeof(struct image_load_job));
+	if (!job) {
+		return false;
+	}
+	job->image = image;
+	job->mode = mode;
+	job->decode_width = decode_width;
+	job->decode_height = decode_height;
+
+	pthread_mutex_lock(&loader->lock);
+	wl_list_insert(&loader->pending, &job->link);
+	pthread_cond_signal(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+	return true;
+}
+
+int image_loader_get_fd(struct image_loader *loader) {
+	return loader->notify_fds[0];
+}
+
+struct image_load_job *image_loader_pop_completed(struct image_loader *loader) {
+	struct image_load_job *job = NULL;
+	pthread_mutex_lock(&loader->lock);
+	if (!wl_list_empty(&loader->completed)) {
+		job = wl_container_of(loader->completed.next, job, link);
+		wl_list_remove(&job->link);
+		wl_list_init(&job->link);
+	} else {
+		// Drain notifications, the queue is empty until the next write
+		char buf[64];
+		while (read(loader->notify_fds[0], buf, sizeof(buf)) > 0) {
+			// nothing to do
+		}
+	}
+	pthread_mutex_unlock(&loader->lock);
+	return job;
+}
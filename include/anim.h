@@ -0,0 +1,49 @@
+#ifndef _ANIM_H_
+#define _ANIM_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "iff.h"
+#include "lbm.h"
+
+// Frames whose changed pixels are kept, for buffers that are more than one frame behind
+#define ANIM_HISTORY 4
+
+// Pixels changed by a frame of an animation
+struct anim_change {
+    // Listed like the pixels of a range group, sorted and without duplicates, so they are drawn by the same kernels.
+    // Only pixels and n_pixels are used.
+    struct range_group list;
+    size_t capacity;
+    // Bounding box of the pixels, in source image coordinates
+    struct bounding_box bbox;
+};
+
+struct anim_frames;
+
+/*
+ * Set up playback of the frames of a FORM ANIM whose first frame has been decoded into `image`. `planes` are the
+ * bitplanes of the first frame, plane-major, each ((width + 15) / 16) * 2 bytes per row; ownership passes to the
+ * animation. Only byte vertical (op 5) deltas are played. Returns NULL, freeing planes, if there is nothing to play.
+ */
+struct anim_frames *anim_frames_create(struct lbm_image *image, const struct ck_FORM *anim, uint8_t *planes,
+                                       unsigned int n_planes);
+void anim_frames_destroy(struct anim_frames *frames);
+// Bytes allocated for the deltas, bitplanes and change lists
+size_t anim_frames_memory(const struct anim_frames *frames);
+
+// Show the frames due in the next `ticks` ticks, updating image->pixels. Returns true if any pixel changed.
+bool anim_frames_advance(struct anim_frames *frames, struct lbm_image *image, unsigned long ticks);
+// Ticks until the next frame is shown
+unsigned long anim_frames_ticks_until_change(const struct anim_frames *frames);
+
+// Counts the frames shown, including each return to the first frame
+uint64_t anim_frames_generation(const struct anim_frames *frames);
+// The pixels changed by the frame that brought the animation to `generation`, or NULL if that frame is no longer
+// kept, or replaced the whole image
+const struct anim_change *anim_frames_change(const struct anim_frames *frames, uint64_t generation);
+
+// Convert plane-major bitplanes, laid out as for anim_frames_create, into one byte per pixel
+void planes_to_chunky(const uint8_t *planes, unsigned int n_planes, unsigned int width, unsigned int height,
+                      uint8_t *pixels);
+#endif
@@ -2,6 +2,8 @@
 #define _SWAY_BACKGROUND_IMAGE_H
 #include <stdbool.h>
 #include "cairo_util.h"
+#include "pixel-format.h"
+#include "resample.h"
 
 enum background_mode {
 	BACKGROUND_MODE_STRETCH,
@@ -9,21 +11,69 @@ enum background_mode {
 	BACKGROUND_MODE_FIT,
 	BACKGROUND_MODE_CENTER,
 	BACKGROUND_MODE_TILE,
+	BACKGROUND_MODE_PAN,
 	BACKGROUND_MODE_SOLID_COLOR,
 	BACKGROUND_MODE_INVALID,
 };
 
 struct swaybg_image {
 	struct wl_list link;
-	const char *path;
+	char *path;
 	bool load_required;
+	bool loading;
+	// The last load failed or was rejected, it is not retried until the
+	// image is set again or an output showing it changes size
+	bool load_failed;
 	struct lbm_image *anim;
+	// Time of the last cycle tick, in ms of frame callback time plus a
+	// fraction in us, as ticks do not fall on whole milliseconds
 	uint32_t last_cycle_time;
+	uint32_t last_cycle_us;
 	uint32_t last_update_time;
+	// When the last tick taken was due, in ns of the presentation clock
+	int64_t cycle_due_ns;
+	// False until the first frame callback of the animation, which the
+	// cycle times start from
+	bool cycle_started;
+	// Dominant color of the cached thumbnail, shown while the image loads
+	uint32_t placeholder_color;
+	bool has_placeholder_color;
 };
 
 enum background_mode parse_background_mode(const char *mode);
-cairo_surface_t *load_background_image(const char *path);
+/*
+ * Load the image at `path`, decoding it at the smallest size that still
+ * covers a buffer_width x buffer_height buffer in the given mode. Pass a zero
+ * buffer size to decode at full resolution.
+ */
+cairo_surface_t *load_background_image(const char *path,
+		enum background_mode mode, int buffer_width, int buffer_height);
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height);
+/*
+ * Draw the image into a buffer as render_background_image() places it, over
+ * `color` (RGBA, transparent for none), scaling it with the given filter on
+ * several threads. The whole buffer is written. Returns false if the image is
+ * in a format the resampler does not read or memory runs out, in which case
+ * it must be drawn with cairo.
+ */
+bool resample_background_image(void *data, enum pixel_format format,
+		size_t stride, cairo_surface_t *image, enum background_mode mode,
+		uint32_t color, enum resample_filter filter, int buffer_width,
+		int buffer_height);
+/*
+ * The color that painting `color` (RGBA) over a cleared buffer leaves, as
+ * opaque ARGB8888. Margins around images show it.
+ */
+uint32_t background_color_argb(uint32_t color);
+/*
+ * Place an LBM image in a buffer: it is centered, and scaled up by the largest
+ * integer factor that suits the mode. In pan mode, the image is scaled by the
+ * smallest factor that covers the buffer, and placed at the origin of a scene
+ * of its own size. Only fit, fill, center and pan are supported; other modes
+ * show the image unscaled.
+ */
+void get_lbm_image_geometry(const struct lbm_image *image,
+		enum background_mode mode, int buffer_width, int buffer_height,
+		int *origin_x, int *origin_y, unsigned int *scale);
 #endif
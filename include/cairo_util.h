@@ -4,12 +4,14 @@
 #include <stdint.h>
 #include <cairo.h>
 #include <wayland-client.h>
+#include "pixel-format.h"
 #if HAVE_GDK_PIXBUF
 #include <gdk-pixbuf/gdk-pixbuf.h>
 #endif
 
 void cairo_set_source_u32(cairo_t *cairo, uint32_t color);
 cairo_subpixel_order_t to_cairo_subpixel_order(enum wl_output_subpixel subpixel);
+cairo_format_t to_cairo_format(enum pixel_format format);
 
 cairo_surface_t *cairo_image_surface_scale(cairo_surface_t *image,
 		int width, int height);
@@ -0,0 +1,59 @@
+#ifndef _SWAYBG_CONTROL_H
+#define _SWAYBG_CONTROL_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define CONTROL_MAX_ARGS 8
+// Longest request, and longest line of a reply
+#define CONTROL_MAX_LINE 4096
+
+/*
+ * Requests are the words of a command, each followed by a NUL byte so that
+ * they may hold spaces, sent by a client over a Unix domain socket that then
+ * shuts down its side. The reply is written back as text and the connection is
+ * closed. The first line of the reply is "ok" or "error: ..."
+ * and may be followed by output of the command.
+ */
+struct control_request {
+	int argc;
+	char *argv[CONTROL_MAX_ARGS];
+	char data[CONTROL_MAX_LINE];
+	FILE *reply;
+};
+
+struct control_server;
+
+/*
+ * Default path of the control socket of the swaybg instance running on the
+ * current Wayland display, under $XDG_RUNTIME_DIR. Returns false if it cannot
+ * be determined.
+ */
+bool control_socket_path(char *path, size_t size);
+
+/*
+ * Listen on a socket at `path`. A stale socket left by an instance that is no
+ * longer running is replaced; a live one is not.
+ */
+struct control_server *control_server_create(const char *path);
+void control_server_destroy(struct control_server *server);
+// Readable when a client connects
+int control_server_get_fd(struct control_server *server);
+
+/*
+ * Accept a pending connection and read its request. Returns false if there is
+ * none left. Once handled, the request must be passed to
+ * control_request_finish, which sends the reply.
+ */
+bool control_server_accept(struct control_server *server,
+		struct control_request *request);
+void control_request_finish(struct control_request *request);
+
+/*
+ * Send a request made of `argc` words to the server at `path` and copy its
+ * reply to `out`. Returns false if the request could not be sent, or the
+ * server replied with an error.
+ */
+bool control_send(const char *path, int argc, char **argv, FILE *out);
+
+#endif
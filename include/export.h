@@ -0,0 +1,37 @@
+#ifndef _SWAYBG_EXPORT_H
+#define _SWAYBG_EXPORT_H
+#include <stdbool.h>
+#include <stdint.h>
+#include "background-image.h"
+
+enum export_format {
+	EXPORT_FORMAT_RAW,  // packed 8-bit RGB, no headers
+	EXPORT_FORMAT_PPM,  // a stream of binary PPM images
+	EXPORT_FORMAT_Y4M,  // YUV4MPEG2, 4:4:4 BT.601
+	EXPORT_FORMAT_INVALID,
+};
+
+struct export_options {
+	const char *path;  // "-" for stdout, NULL if not exporting
+	enum export_format format;
+	unsigned int n_frames;
+	// Logical size and scale of the virtual output, 0 for the image size
+	int width, height;
+	int scale;
+	// Measure decoding and rendering stages with hardware counters
+	bool perf_counters;
+};
+
+enum export_format parse_export_format(const char *name);
+
+/*
+ * Render frames of an LBM image without a compositor, advancing the animation
+ * at a virtual 60Hz, and write them to options->path. The image is placed as it
+ * would be on an output of the given size. Large frames are rendered in bands
+ * on several threads, and frames are encoded and written on a separate thread
+ * while the next one renders. Returns the exit status.
+ */
+int export_lbm_image(const char *image_path, enum background_mode mode,
+		uint32_t color, const struct export_options *options);
+
+#endif
@@ -0,0 +1,101 @@
+#ifndef _SWAYBG_FRAME_RING_H
+#define _SWAYBG_FRAME_RING_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <wayland-client.h>
+#include "lbm.h"
+#include "pool-buffer.h"
+
+struct frame_ring;
+
+struct frame_ring_frame {
+	struct frame_ring *ring;
+	struct wl_buffer *buffer;
+	// Ticks after the start of the period at which this frame is shown
+	uint64_t tick;
+	// Area which changed since the previous frame, in buffer coordinates
+	struct bounding_box damage;
+	// False from attaching the buffer until the compositor releases it
+	bool available;
+};
+
+/*
+ * Every distinct frame of one cycle period of an LBM image, pre-rendered into
+ * buffers of a single shm block. Animating then only requires attaching the
+ * buffer for the current tick.
+ *
+ * Rings are made in steps, so that the long ones run on the render thread:
+ * frame_ring_create and frame_ring_alloc on the main thread, frame_ring_plan
+ * and frame_ring_render on any, then frame_ring_finish on the main thread.
+ */
+struct frame_ring {
+	struct frame_ring_frame *frames;
+	unsigned int n_frames;
+	unsigned int current;  // n_frames until a frame is selected
+	uint64_t period;
+	// Value of lbm_image::tick_count at which frame 0 is shown
+	unsigned long start_tick;
+
+	/*
+	 * Copy of the image, advanced through the period while planning and
+	 * rendering. Its range states are its own; pixels, range lists and the
+	 * layout are shared and must stay alive until the ring is rendered.
+	 */
+	struct lbm_image image;
+	const struct lbm_layout *layout;
+	int origin_x, origin_y, scale;
+	size_t budget;
+
+	struct shm_block block;
+	int32_t width, height, stride;
+	enum pixel_format format;
+	size_t frame_size, frame_stride;
+
+	// Destroyed, waiting for the compositor to release its frames
+	bool orphaned;
+	struct wl_list link;
+};
+
+/*
+ * Start a ring for the current palette state of the image, rendered as with
+ * render_delta, with the layout if it matches, into buffers of the given size
+ * and format. Frames taking more than `budget` bytes in total are not made.
+ */
+struct frame_ring *frame_ring_create(const struct lbm_image *image,
+		const struct lbm_layout *layout, int32_t width, int32_t height,
+		int32_t stride, enum pixel_format format, int origin_x, int origin_y,
+		int scale, size_t budget);
+/*
+ * Count the distinct frames of the period. Leaves n_frames at 0 if the image
+ * does not animate, its period is too long or the frames exceed the budget.
+ */
+void frame_ring_plan(struct frame_ring *ring);
+// Allocate the block for the planned frames
+bool frame_ring_alloc(struct frame_ring *ring, struct wl_shm *shm);
+/*
+ * Render the frames on top of `base`, a buffer of the ring's size rendered
+ * with the colors in `old_lut`.
+ */
+void frame_ring_render(struct frame_ring *ring, const void *base,
+		const uint32_t *old_lut);
+// Create the buffers of the rendered frames
+void frame_ring_finish(struct frame_ring *ring);
+
+/*
+ * Destroy the ring, at any step. Its block is only freed once the compositor
+ * has released every frame it holds.
+ */
+void frame_ring_destroy(struct frame_ring *ring);
+// Free the rings still waiting for releases, when disconnecting
+void frame_ring_destroy_orphans(void);
+
+/*
+ * Select the frame for the current tick of the image. Returns the frame, with
+ * *damage set to the area that changed since the last selected frame, or NULL
+ * if the frame did not change or its buffer is still held by the compositor.
+ */
+struct frame_ring_frame *frame_ring_update(struct frame_ring *ring,
+		const struct lbm_image *image, struct bounding_box *damage);
+
+#endif
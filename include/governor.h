@@ -0,0 +1,65 @@
+#ifndef _SWAYBG_GOVERNOR_H
+#define _SWAYBG_GOVERNOR_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * How animations are paced. Policies from several sources are merged into the
+ * most restrictive of each.
+ */
+struct governor_policy {
+	// Stop cycling once the current frame is committed
+	bool paused;
+	// Update animations at most this often, 0 if uncapped
+	unsigned int max_fps;
+	// Ticks take this many times longer, 1 at full rate
+	unsigned int slowdown;
+};
+
+#define GOVERNOR_POLICY_FULL ((struct governor_policy){ .slowdown = 1 })
+
+struct governor_config {
+	// Prefix of /sys and /proc, so that tests can use a fake tree. Empty for
+	// the real ones.
+	const char *root;
+	// Applied while running on battery
+	struct governor_policy battery;
+	// Applied while the 1-minute load average per CPU is at least busy_load,
+	// if that is not 0
+	struct governor_policy busy;
+	double busy_load;
+};
+
+/*
+ * Parse "full", "half", "pause", or a number of frames per second to cap
+ * animations to.
+ */
+bool parse_governor_policy(const char *str, struct governor_policy *policy);
+bool governor_policy_equal(const struct governor_policy *a,
+		const struct governor_policy *b);
+// Restrict `policy` by `other`
+void governor_policy_merge(struct governor_policy *policy,
+		const struct governor_policy *other);
+
+struct governor;
+
+/*
+ * Watch the power source of the machine, and optionally its load, to pick the
+ * policy of animations. Returns NULL if the configuration never restricts
+ * them.
+ */
+struct governor *governor_create(const struct governor_config *config);
+void governor_destroy(struct governor *governor);
+
+/*
+ * Check the power source and load again if they are due, which they are every
+ * few seconds. Returns true if the policy changed.
+ */
+bool governor_update(struct governor *governor, uint64_t now_ms);
+// Time until the next check is due, for poll()
+int governor_get_timeout(const struct governor *governor, uint64_t now_ms);
+const struct governor_policy *governor_get_policy(const struct governor *governor);
+bool governor_on_battery(const struct governor *governor);
+bool governor_busy(const struct governor *governor);
+
+#endif
@@ -6,8 +6,10 @@
 
 struct chunk *read_iff_file(const char *path);
 void free_chunk(struct chunk *c);
+// Total bytes allocated for a chunk, its children and its siblings
+size_t chunk_tree_size(const struct chunk *c);
 
-typedef enum { FORM, BMHD, CMAP, CRNG, BODY, UNKNOWN, N_CHUNKS } chunk_id;
+typedef enum { FORM, BMHD, CMAP, CRNG, BODY, ANHD, DLTA, UNKNOWN, N_CHUNKS } chunk_id;
 
 struct chunk {
     chunk_id id;
@@ -58,8 +60,32 @@ struct ck_CRNG {
     uint8_t high;
 };
 
+// BODY data is followed by this many zero bytes, so decoders can read ahead of it in wide loads
+#define BODY_PADDING 16
+
 struct ck_BODY {
     struct chunk base;
     void *body;
 };
+
+// Header of a frame of an ANIM, telling how its DLTA applies to the frames before it
+struct ck_ANHD {
+    struct chunk base;
+    uint8_t operation;
+    uint8_t mask;
+    uint16_t w;
+    uint16_t h;
+    int16_t x;
+    int16_t y;
+    uint32_t abstime;
+    uint32_t reltime;
+    uint8_t interleave;
+    uint8_t pad0;
+    uint32_t bits;
+};
+
+struct ck_DLTA {
+    struct chunk base;
+    void *data;
+};
 #endif
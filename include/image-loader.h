@@ -0,0 +1,41 @@
+#ifndef _SWAYBG_IMAGE_LOADER_H
+#define _SWAYBG_IMAGE_LOADER_H
+#include <stdbool.h>
+#include <wayland-client.h>
+#include "background-image.h"
+
+struct image_loader;
+
+struct image_load_job {
+	struct swaybg_image *image;
+
+	// Inputs, see load_background_image
+	enum background_mode mode;
+	int decode_width, decode_height;
+
+	// Results. At most one of these is set; both are NULL on failure.
+	struct lbm_image *anim;
+	cairo_surface_t *surface;
+
+	struct wl_list link;
+};
+
+/*
+ * Create a pool of worker threads which decode images off the main thread.
+ * Finished jobs are put on a completion queue, and the file descriptor
+ * returned by image_loader_get_fd becomes readable.
+ */
+struct image_loader *image_loader_create(void);
+void image_loader_destroy(struct image_loader *loader);
+
+bool image_loader_submit(struct image_loader *loader, struct swaybg_image *image,
+		enum background_mode mode, int decode_width, int decode_height);
+int image_loader_get_fd(struct image_loader *loader);
+
+/*
+ * Pop the next finished job, or return NULL if there is none. The caller takes
+ * ownership of the job and of its results, and frees the job with free().
+ */
+struct image_load_job *image_loader_pop_completed(struct image_loader *loader);
+
+#endif
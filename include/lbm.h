@@ -3,6 +3,7 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include "pixel-format.h"
 
 struct color_range {
     int low;
@@ -13,6 +14,8 @@ struct color_range {
 // ARGB8888 in native byte order
 typedef uint32_t color_register;
 
+struct anim_frames;
+
 struct lbm_image {
     // Fields parsed from ILBM file
     unsigned int width;
@@ -22,10 +25,33 @@ struct lbm_image {
     unsigned int n_ranges;
     uint8_t *pixels;
 
+    // The palette converted to the pixel format of the destination buffers,
+    // kept in step with palette by cycle_palette
+    uint32_t lut[256];
+    enum pixel_format format;
+    // The palette and look up table as loaded, which the rotated ranges of palette and lut are taken from
+    color_register base_palette[256];
+    uint32_t base_lut[256];
+    // True if two ranges that step share palette entries, so that the order of their rotations matters
+    bool ranges_overlap;
+    // Blend the colors of ranges between steps, see lbm_set_smooth
+    bool smooth;
+
     // Look up table for the pixels in a given range
     struct pixel_list *range_pixels;
+    // Ranges grouped by rate, holding the merged pixel lists that are drawn
+    struct range_group *groups;
+    unsigned int n_groups;
+
+    // Frames of an IFF ANIM, which lbm_advance shows by changing pixels, or NULL for still images
+    struct anim_frames *frames;
 
+    // Number of calls to lbm_advance that changed the palette
     unsigned long frame_count;
+    // Number of ticks the animation has been advanced by
+    unsigned long tick_count;
+    // Size of the IFF chunk tree the image was decoded from
+    size_t iff_size;
     void *userdata;
 };
 
@@ -39,23 +65,116 @@ struct bounding_box {
 struct pixel_list {
     // Number of pixels in this range
     size_t n_pixels;
-    // A list of indices into the image data buffer in bytes
-    unsigned int *pixels;
     // Bounding box of pixel range
     struct bounding_box bbox;
     // Progress through current step in the cycle
     uint16_t cycle_idx;
+    // Number of steps the range has been rotated by, modulo its length
+    uint16_t offset;
     // True if this range was affected by a call to cycle_palette.
     // Users should clear this after reading the updated values.
     bool damaged;
 };
 
+// Ranges with the same rate step on the same ticks. Their pixels are merged into a single list in row-major order,
+// so pixels shared by overlapping ranges are drawn once, and destination rows are visited in order.
+struct range_group {
+    int rate;
+    // Indices of the ranges in this group
+    unsigned int *ranges;
+    unsigned int n_ranges;
+    // Union of the pixels of the ranges, as indices into the image data buffer, sorted and without duplicates
+    unsigned int *pixels;
+    size_t n_pixels;
+};
+
+// Stages of decoding and rendering that can be measured, see lbm_set_stage_hooks
+enum lbm_stage {
+    LBM_STAGE_UNPACK,       // decompressing the BODY into pixels
+    LBM_STAGE_PIXEL_LISTS,  // listing the pixels of the color ranges
+    LBM_STAGE_RENDER,       // render_lbm_image
+    LBM_STAGE_DELTA,        // render_delta
+    LBM_STAGE_COUNT,
+};
+
+// Called before and after each stage. `end` is passed the number of pixels the stage processed: source pixels when
+// decoding, destination pixels when rendering.
+struct lbm_stage_hooks {
+    void (*begin)(enum lbm_stage stage, void *data);
+    void (*end)(enum lbm_stage stage, size_t n_pixels, void *data);
+    void *data;
+};
+
+// Set the hooks for all images, or remove them if NULL. They are called on the thread running the stage, and must
+// not be changed while other threads decode or render. While they are set, bodies are decoded on that thread alone,
+// so that counters it opened see all the work of the stage.
+void lbm_set_stage_hooks(const struct lbm_stage_hooks *hooks);
+
 struct lbm_image *read_lbm_image(const char *path);
 void free_lbm_image(struct lbm_image *image);
+// Bytes allocated for the pixels of the image, and for its color ranges and their pixel lists
+void lbm_image_memory(const struct lbm_image *image, size_t *pixels, size_t *ranges);
+
+void lbm_set_pixel_format(struct lbm_image *image, enum pixel_format format);
 
 bool cycle_palette(struct lbm_image *anim);
-void render_lbm_image(void *buffer, struct lbm_image *image, unsigned int width,
-                      unsigned int height, int origin_x, int origin_y, int scale);
-void render_delta(void *buffer, struct lbm_image *image, unsigned int dst_width,
-                  unsigned int dst_height, int origin_x, int origin_y, int scale, struct bounding_box *damage, bool clear);
+// Advance the animation by the given number of ticks at once, as if cycle_palette had been called that many times.
+// Takes constant time per range, or when ranges overlap, no longer than stepping them through 2^15 ticks however
+// many are due. Returns true if any range stepped.
+bool lbm_advance(struct lbm_image *image, unsigned long ticks);
+void lbm_set_smooth(struct lbm_image *image, bool smooth);
+uint64_t lbm_cycle_period(const struct lbm_image *image, uint64_t max_period);
+// Return the number of calls to cycle_palette up to and including the next one that changes the palette, or 0 if
+// the palette never changes. May be less than the exact count, never more.
+unsigned long lbm_ticks_until_change(const struct lbm_image *image);
+void render_lbm_image(void *buffer, const struct lbm_image *image, unsigned int width,
+                      unsigned int height, unsigned int stride, int origin_x, int origin_y, int scale);
+// Fill the parts of the buffer that render_lbm_image leaves alone at this placement with background, a pixel value in
+// the format of the image. Together they write each pixel of the buffer once.
+void fill_lbm_margins(void *buffer, const struct lbm_image *image, uint32_t background, unsigned int width,
+                      unsigned int height, unsigned int stride, int origin_x, int origin_y, int scale);
+
+// The pixels of the range groups of an image that are visible at one placement in a destination, joined into spans
+// with their destination offsets computed, so that drawing them does no work for the parts of the image that are cut
+// off. Made once per output geometry, and again when the pixels of an ANIM change.
+struct lbm_layout;
+// Returns NULL if allocation fails or the destination is too large to index, in which case rendering clips each
+// pixel instead
+struct lbm_layout *lbm_layout_create(const struct lbm_image *image, unsigned int dst_width,
+                                     unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y,
+                                     int scale);
+void lbm_layout_destroy(struct lbm_layout *layout);
+// Whether a layout, which may be NULL, was made for this placement of the image as its pixels are now
+bool lbm_layout_matches(const struct lbm_layout *layout, const struct lbm_image *image, unsigned int dst_width,
+                        unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y, int scale);
+size_t lbm_layout_memory(const struct lbm_layout *layout);
+
+// Draw the ranges damaged by cycle_palette. The layout is used if it matches the placement, else it may be NULL.
+void render_delta(void *buffer, struct lbm_image *image, const struct lbm_layout *layout, unsigned int dst_width,
+                  unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y, int scale,
+                  struct bounding_box *damage, bool clear);
+// Update the pixels of every range whose colors in image->lut differ from old_lut, which holds the colors the
+// buffer was last rendered with. Arguments and damage are as for render_delta. The image is not modified.
+void render_ranges(void *buffer, const struct lbm_image *image, const struct lbm_layout *layout,
+                   const uint32_t *old_lut, unsigned int dst_width, unsigned int dst_height,
+                   unsigned int dst_stride, int origin_x, int origin_y, int scale, struct bounding_box *damage);
+// Compute the damage render_ranges would report for a buffer rendered with old_lut to reach new_lut
+void lut_damage(const struct lbm_image *image, const uint32_t *old_lut, const uint32_t *new_lut,
+                unsigned int dst_width, unsigned int dst_height, int origin_x, int origin_y, int scale,
+                struct bounding_box *damage);
+
+// Counts the changes of pixels made by the frames of an ANIM, 0 for still images. A buffer rendered at one
+// generation is brought up to date by render_pixel_changes.
+uint64_t lbm_pixels_generation(const struct lbm_image *image);
+// Update the pixels of a buffer rendered at generation `from` that have changed since, with the colors in image->lut.
+// If the changes are no longer known, the whole image is rendered. Arguments and damage are as for render_delta.
+void render_pixel_changes(void *buffer, const struct lbm_image *image, uint64_t from,
+                          unsigned int dst_width, unsigned int dst_height, unsigned int dst_stride,
+                          int origin_x, int origin_y, int scale, struct bounding_box *damage);
+// Compute the damage between buffers rendered at two generations, without rendering
+void pixel_changes_damage(const struct lbm_image *image, uint64_t from, uint64_t to,
+                          unsigned int dst_width, unsigned int dst_height, int origin_x, int origin_y, int scale,
+                          struct bounding_box *damage);
+// Grow damage, in destination coordinates, to cover other. Either may be empty.
+void merge_damage(struct bounding_box *damage, const struct bounding_box *other);
 #endif
@@ -0,0 +1,32 @@
+#ifndef _SWAYBG_MEMSTATS_H
+#define _SWAYBG_MEMSTATS_H
+#include <stddef.h>
+#include <stdio.h>
+
+// Classes of memory that swaybg allocates in bulk
+enum memstats_class {
+	MEMSTATS_IFF,     // parsed IFF chunk trees, freed once an image is decoded
+	MEMSTATS_PIXELS,  // decoded LBM pixel indices
+	MEMSTATS_RANGES,  // LBM color ranges and their pixel lists
+	MEMSTATS_SHM,     // shared memory of wl_buffers, including frame rings
+	MEMSTATS_CAIRO,   // decoded static images
+	MEMSTATS_CLASS_COUNT,
+};
+
+/*
+ * Record that `bytes` of a class were allocated or freed. Safe to call from any
+ * thread.
+ */
+void memstats_alloc(enum memstats_class class, size_t bytes);
+void memstats_free(enum memstats_class class, size_t bytes);
+
+size_t memstats_current(enum memstats_class class);
+size_t memstats_peak(enum memstats_class class);
+const char *memstats_class_name(enum memstats_class class);
+
+/*
+ * Print the current and peak size of every class.
+ */
+void memstats_print(FILE *f);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _SWAYBG_PERF_COUNTERS_H
+#define _SWAYBG_PERF_COUNTERS_H
+#include <stdbool.h>
+
+struct perf_counters;
+
+/*
+ * Open hardware counters of cycles, instructions, L1 data, last level cache
+ * and dTLB misses, and branch misses for the calling thread. Counters that
+ * cannot be opened, as in most containers and virtual machines, are left out,
+ * and if none can, stages are only timed. Returns NULL on allocation failure.
+ */
+struct perf_counters *perf_counters_create(void);
+void perf_counters_destroy(struct perf_counters *counters);
+// Whether any hardware counter could be opened
+bool perf_counters_available(const struct perf_counters *counters);
+
+/*
+ * Measure each stage of decoding and rendering LBM images with these counters,
+ * until lbm_set_stage_hooks(NULL). Stages must run on the thread that created
+ * the counters; the threads unpack starts for large images are not counted.
+ */
+void perf_counters_install(struct perf_counters *counters);
+
+// Log the time and counts of each stage that ran, per pixel processed
+void perf_counters_report(const struct perf_counters *counters);
+
+#endif
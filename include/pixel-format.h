@@ -0,0 +1,25 @@
+#ifndef _SWAYBG_PIXEL_FORMAT_H
+#define _SWAYBG_PIXEL_FORMAT_H
+#include <stdint.h>
+
+// Opaque formats which buffers can be rendered in
+enum pixel_format {
+	PIXEL_FORMAT_XRGB8888,
+	PIXEL_FORMAT_RGB565,
+	PIXEL_FORMAT_XRGB2101010,
+	PIXEL_FORMAT_INVALID,
+};
+
+enum pixel_format parse_pixel_format(const char *name);
+const char *pixel_format_name(enum pixel_format format);
+uint32_t pixel_format_to_wl_shm(enum pixel_format format);
+enum pixel_format pixel_format_from_wl_shm(uint32_t wl_format);
+int pixel_format_bytes_per_pixel(enum pixel_format format);
+
+/*
+ * Convert a color in ARGB8888 (as in struct lbm_image::palette) to a pixel
+ * value in the given format. The alpha channel is dropped.
+ */
+uint32_t pixel_format_convert(enum pixel_format format, uint32_t argb);
+
+#endif
@@ -4,20 +4,62 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <wayland-client.h>
+#include "pixel-format.h"
 
 struct pool_buffer {
 	struct wl_buffer *buffer;
+	// NULL until get_buffer_cairo
 	cairo_surface_t *surface;
 	cairo_t *cairo;
 	void *data;
 	size_t size;
+	uint32_t stride;
+	enum pixel_format format;
 	bool available;
+	struct shm_slot *slot;
 };
 
 struct swaybg_output;
 
+/*
+ * A page aligned block of shm, carved out of the pool shared by all buffers of
+ * the process, or mapped into a pool of its own when that one is full.
+ */
+struct shm_block {
+	struct wl_shm_pool *pool;
+	void *data;
+	int32_t offset;  // in the pool
+	size_t size;
+	bool standalone;  // the pool and its mapping belong to the block
+};
+
+/*
+ * Allocate and prefault a block of at least `size` bytes. Returns false if
+ * there is no room for it in the shared pool nor memory for a pool of its own.
+ */
+bool alloc_shm_block(struct wl_shm *shm, size_t size, struct shm_block *block);
+void free_shm_block(struct shm_block *block);
+
+/*
+ * Buffers come from the shared pool. Destroyed buffers are kept and handed out
+ * again for the next buffer of the same size, without new shm allocations or
+ * pool objects. The compositor's releases of the buffer are passed to
+ * release_buffer(output, wl_buffer), which the caller must define.
+ */
 bool create_buffer(struct pool_buffer *buffer, struct wl_shm *shm,
-		int32_t width, int32_t height, uint32_t format, struct swaybg_output *output);
+		int32_t width, int32_t height, enum pixel_format format,
+		struct swaybg_output *output);
 void destroy_buffer(struct pool_buffer *buffer);
 
+/*
+ * A cairo context drawing into the buffer, made on first use. Animations and
+ * scaled images are written to the buffer's data directly and never need one.
+ */
+cairo_t *get_buffer_cairo(struct pool_buffer *buffer);
+
+/*
+ * Free the shared pool. Every buffer must have been destroyed.
+ */
+void destroy_shm_arena(void);
+
 #endif
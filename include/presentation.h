@@ -0,0 +1,41 @@
+#ifndef _SWAYBG_PRESENTATION_H
+#define _SWAYBG_PRESENTATION_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * What wp_presentation feedback says about the commits of an output. Times are
+ * in ns of the clock the compositor presents with.
+ */
+struct presentation_stats {
+	uint64_t presented, discarded;
+	uint64_t latency_sum_ns, latency_max_ns;
+	// Moving average of the commit to present latency, 0 until known
+	int64_t latency_avg_ns;
+	// Refresh period last reported, 0 if unknown or variable
+	uint32_t refresh_ns;
+	// Shortest latency seen in whole refresh periods, taken to be the depth of
+	// the compositor's pipeline. Frames that take longer missed a vblank.
+	int64_t min_vblanks;
+	uint64_t missed_vblanks;
+	// Time from when the cycle tick a frame shows was due to when the frame
+	// was presented, over frames that show animation ticks
+	uint64_t n_drift;
+	int64_t drift_sum_ns, drift_min_ns, drift_max_ns, drift_last_ns;
+};
+
+/*
+ * Record a presented commit. `refresh_ns` is the refresh period the compositor
+ * reported, or an estimate if it reported 0. `due_ns` is when the tick shown
+ * was due, or 0 if the commit does not show an animation tick.
+ */
+void presentation_stats_presented(struct presentation_stats *stats,
+		int64_t commit_ns, int64_t present_ns, uint32_t refresh_ns,
+		int64_t due_ns);
+void presentation_stats_discarded(struct presentation_stats *stats);
+
+// Print one line of statistics, indented for write_animation_stats
+void presentation_stats_print(const struct presentation_stats *stats, FILE *f);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _SWAYBG_RENDER_THREAD_H
+#define _SWAYBG_RENDER_THREAD_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "lbm.h"
+
+enum render_job_type {
+	// Render the whole image into every target, and fill the rest of them
+	// with `background`
+	RENDER_JOB_FULL,
+	// Update the ranges of targets[0] whose colors differ from old_lut, and
+	// the pixels that changed since old_generation
+	RENDER_JOB_DELTA,
+	// Count the frames of `ring`, see frame_ring_plan
+	RENDER_JOB_RING_PLAN,
+	// Render the frames of `ring` on top of targets[0], whose colors are
+	// old_lut, see frame_ring_render
+	RENDER_JOB_RING_RENDER,
+};
+
+#define RENDER_JOB_MAX_TARGETS 2
+
+struct frame_ring;
+
+struct render_job {
+	enum render_job_type type;
+	void *owner;  // opaque to the render thread
+
+	/*
+	 * Snapshot of the image at submission. The palette and look up table are
+	 * copies; pixels and range lists are shared and must stay alive until the
+	 * job completes.
+	 */
+	struct lbm_image image;
+	uint32_t old_lut[256];
+	// Pixel generations of the image and of targets[0], see
+	// lbm_pixels_generation. The pixels of an image with frames must not
+	// change while a job renders it.
+	uint64_t generation;
+	uint64_t old_generation;
+	// Culled range lists for this placement of the image, or NULL. Shared
+	// like the pixels.
+	const struct lbm_layout *layout;
+
+	void *targets[RENDER_JOB_MAX_TARGETS];
+	int n_targets;
+	uint32_t background;  // pixel value in the format of the image
+	unsigned int width, height, stride;
+	int origin_x, origin_y, scale;
+	// Of ring jobs, which hold their own copy of the image
+	struct frame_ring *ring;
+
+	// Result
+	struct bounding_box damage;
+};
+
+struct render_thread;
+
+/*
+ * Start a thread that renders LBM frames off the main thread. Jobs are passed
+ * to it, and back once completed, through lock-free single-producer,
+ * single-consumer rings; only one thread may submit and pop jobs. The file
+ * descriptor returned by render_thread_get_fd becomes readable when jobs
+ * complete.
+ */
+struct render_thread *render_thread_create(void);
+void render_thread_destroy(struct render_thread *thread);
+
+/*
+ * Queue a job. Returns false if the queue is full. The job must not be touched
+ * until it is returned by render_thread_pop_completed.
+ */
+bool render_thread_submit(struct render_thread *thread, struct render_job *job);
+int render_thread_get_fd(struct render_thread *thread);
+struct render_job *render_thread_pop_completed(struct render_thread *thread);
+
+/*
+ * Block until every submitted job has completed. They still need to be popped.
+ */
+void render_thread_wait(struct render_thread *thread);
+
+/*
+ * Run a job on the calling thread.
+ */
+void render_job_run(struct render_job *job);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef _SWAYBG_RESAMPLE_H
+#define _SWAYBG_RESAMPLE_H
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pixel-format.h"
+
+// Filters that static images are scaled with
+enum resample_filter {
+	RESAMPLE_FILTER_BOX,
+	RESAMPLE_FILTER_BILINEAR,
+	RESAMPLE_FILTER_LANCZOS,
+	RESAMPLE_FILTER_INVALID,
+};
+
+enum resample_filter parse_resample_filter(const char *name);
+const char *resample_filter_name(enum resample_filter filter);
+
+// Pixels with premultiplied alpha, as in CAIRO_FORMAT_ARGB32
+struct resample_source {
+	const void *pixels;
+	int width, height;
+	size_t stride;  // bytes
+	bool opaque;    // the alpha byte is undefined, as in CAIRO_FORMAT_RGB24
+};
+
+/*
+ * Where the source goes: its top left corner and its size, in destination
+ * pixels. Edges are rounded to whole pixels. Tiled sources are repeated from
+ * the corner at their own size, and the size is ignored.
+ */
+struct resample_placement {
+	double x, y;
+	double width, height;
+	bool tile;
+};
+
+/*
+ * Scale the source with a separable filter into a buffer of the given format,
+ * over `background` (opaque ARGB8888), which also fills the rest of the
+ * buffer. Bands of rows are scaled on several threads. Returns false if memory
+ * for the filters cannot be allocated, and the buffer must then be drawn again.
+ */
+bool resample_image(void *buffer, enum pixel_format format, int width,
+		int height, size_t stride, const struct resample_source *src,
+		const struct resample_placement *placement, uint32_t background,
+		enum resample_filter filter);
+
+#endif
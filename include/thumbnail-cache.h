@@ -0,0 +1,37 @@
+#ifndef _SWAYBG_THUMBNAIL_CACHE_H
+#define _SWAYBG_THUMBNAIL_CACHE_H
+#include <cairo.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "lbm.h"
+
+#define THUMBNAIL_SIZE 8
+
+/*
+ * A tiny downscaled copy of a background image, cached on disk under
+ * $XDG_CACHE_HOME/swaybg so that outputs can show a placeholder in the
+ * image's dominant color before the image itself is decoded.
+ */
+struct thumbnail {
+	uint32_t pixels[THUMBNAIL_SIZE * THUMBNAIL_SIZE];  // XRGB8888
+};
+
+void thumbnail_from_surface(cairo_surface_t *surface, struct thumbnail *thumb);
+void thumbnail_from_lbm(const struct lbm_image *image, struct thumbnail *thumb);
+
+/*
+ * Read the cached thumbnail of the image at `path`. Entries are keyed by the
+ * path, size and modification time of the image, so stale ones never match.
+ */
+bool thumbnail_cache_read(const char *path, struct thumbnail *thumb);
+/*
+ * Store the thumbnail of the image at `path`, unless it is already cached.
+ */
+void thumbnail_cache_write(const char *path, const struct thumbnail *thumb);
+
+/*
+ * The most common color of the thumbnail, as 0xRRGGBBAA.
+ */
+uint32_t thumbnail_dominant_color(const struct thumbnail *thumb);
+
+#endif
@@ -7,50 +7,57 @@
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "anim.h"
 #include "iff.h"
+#include "memstats.h"
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 
-static void prepare_pixel_lists(struct lbm_image *image) {
-    image->range_pixels = calloc(image->n_ranges, sizeof(struct pixel_list));
+static struct lbm_stage_hooks stage_hooks;
 
-    // For each range, track the pixels that are affected
-    // count pixels in each range
-    // allocate pixel lists
-    // loop over all pixels again
-    // fill pixel lists with offset
-    // while we're at it, store the bounding box of the pixels in this range
+void lbm_set_stage_hooks(const struct lbm_stage_hooks *hooks) {
+    if (hooks) {
+        stage_hooks = *hooks;
+    } else {
+        memset(&stage_hooks, 0, sizeof(stage_hooks));
+    }
+}
+
+static inline void stage_begin(enum lbm_stage stage) {
+    if (stage_hooks.begin) {
+        stage_hooks.begin(stage, stage_hooks.data);
+    }
+}
 
+static inline void stage_end(enum lbm_stage stage, size_t n_pixels) {
+    if (stage_hooks.end) {
+        stage_hooks.end(stage, n_pixels, stage_hooks.data);
+    }
+}
+
+// For each range, count the pixels that are affected and store their bounding box.
+// The pixels themselves are listed per group, see prepare_range_groups
+static void count_range_pixels(struct lbm_image *image) {
     for (unsigned int i = 0; i < image->n_ranges; i++) {
         struct color_range *range = &image->ranges[i];
-        unsigned int pixels_in_range = 0;
-        for (unsigned int row = 0; row < image->height; row++) {
-            for (unsigned int col = 0; col < image->width; col++) {
-                unsigned int p_index = row * image->width + col;
-                unsigned char p = image->pixels[p_index];
-                if (p >= range->low && p <= range->high) {
-                    pixels_in_range++;
-                }
-            }
-        }
         struct pixel_list *this_range = &image->range_pixels[i];
+        this_range->n_pixels = 0;
         this_range->bbox.min_x = INT_MAX;
         this_range->bbox.min_y = INT_MAX;
-        this_range->n_pixels = pixels_in_range;
-        this_range->pixels = calloc(pixels_in_range, sizeof(unsigned int));
-
-        unsigned int range_idx = 0;
-        unsigned int *pixels = this_range->pixels;
+        this_range->bbox.max_x = 0;
+        this_range->bbox.max_y = 0;
         for (int row = 0; row < (int)image->height; row++) {
             for (int col = 0; col < (int)image->width; col++) {
                 unsigned int p_index = row * image->width + col;
                 uint8_t p = image->pixels[p_index];
                 if (p >= range->low && p <= range->high) {
-                    pixels[range_idx++] = p_index;
+                    this_range->n_pixels++;
                     this_range->bbox.min_x = MIN(this_range->bbox.min_x, col);
                     this_range->bbox.min_y = MIN(this_range->bbox.min_y, row);
                     this_range->bbox.max_x = MAX(this_range->bbox.max_x, col);
@@ -58,7 +65,6 @@ static void prepare_pixel_lists(struct lbm_image *image) {
                 }
             }
         }
-        assert(range_idx == pixels_in_range);
 #ifdef DEBUG_LBM
         printf("%s Range %d: %ld pixels, {%04d,%04d} to {%04d,%04d}", __FUNCTION__, i,
                this_range->n_pixels, this_range->bbox.min_x, this_range->bbox.min_y, this_range->bbox.max_x,
@@ -67,41 +73,392 @@ static void prepare_pixel_lists(struct lbm_image *image) {
     }
 }
 
-static void unpack(uint8_t *dest, const int8_t *src, const size_t size, const int compression) {
+static void prepare_pixel_lists(struct lbm_image *image) {
+    image->range_pixels = calloc(image->n_ranges, sizeof(struct pixel_list));
+    count_range_pixels(image);
+}
+
+// Group the ranges by rate, and list the union of the pixels of each group in row-major order
+static void prepare_range_groups(struct lbm_image *image) {
+    image->groups = calloc(image->n_ranges, sizeof(struct range_group));
+    image->n_groups = 0;
+
+    for (unsigned int i = 0; i < image->n_ranges; i++) {
+        struct range_group *group = NULL;
+        for (unsigned int g = 0; g < image->n_groups; g++) {
+            if (image->groups[g].rate == image->ranges[i].rate) {
+                group = &image->groups[g];
+                break;
+            }
+        }
+        if (!group) {
+            group = &image->groups[image->n_groups++];
+            group->rate = image->ranges[i].rate;
+            group->ranges = calloc(image->n_ranges, sizeof(unsigned int));
+        }
+        group->ranges[group->n_ranges++] = i;
+    }
+
+    for (unsigned int g = 0; g < image->n_groups; g++) {
+        struct range_group *group = &image->groups[g];
+        // Palette indices covered by the group
+        bool in_group[256] = {false};
+        for (unsigned int j = 0; j < group->n_ranges; j++) {
+            const struct color_range *range = &image->ranges[group->ranges[j]];
+            for (int c = range->low; c <= range->high; c++) {
+                in_group[c] = true;
+            }
+        }
+
+        size_t n_pixels = (size_t)image->width * image->height;
+        for (size_t p = 0; p < n_pixels; p++) {
+            if (in_group[image->pixels[p]]) {
+                group->n_pixels++;
+            }
+        }
+        group->pixels = calloc(group->n_pixels, sizeof(unsigned int));
+        size_t list_idx = 0;
+        for (size_t p = 0; p < n_pixels; p++) {
+            if (in_group[image->pixels[p]]) {
+                group->pixels[list_idx++] = p;
+            }
+        }
+        assert(list_idx == group->n_pixels);
+    }
+}
+
+static void free_range_groups(struct lbm_image *image) {
+    for (unsigned int g = 0; g < image->n_groups; g++) {
+        free(image->groups[g].ranges);
+        free(image->groups[g].pixels);
+    }
+    free(image->groups);
+    image->groups = NULL;
+    image->n_groups = 0;
+}
+
+// True if the range moves its colors at all
+static bool range_steps(const struct color_range *range) {
+    return range->rate % (1 << 14) != 0 && range->high > range->low;
+}
+
+// Ranges that step and share palette entries rotate each other's colors, which lbm_advance cannot do by offsets
+static bool find_overlapping_ranges(const struct lbm_image *image) {
+    for (unsigned int i = 0; i < image->n_ranges; i++) {
+        const struct color_range *a = &image->ranges[i];
+        for (unsigned int j = i + 1; j < image->n_ranges; j++) {
+            const struct color_range *b = &image->ranges[j];
+            if (range_steps(a) && range_steps(b) && a->low <= b->high && b->low <= a->high) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Bodies this large are decoded by several threads, each taking at least this many bytes
+#define UNPACK_THREAD_BYTES (64 * 1024)
+#define UNPACK_MAX_THREADS 8
+
+// Where a row of the output starts in ByteRun1 data: at the run whose control byte is at `src`, after `skip` bytes
+// of it that belong to the rows before
+struct row_start {
+    size_t src;
+    size_t skip;
+};
+
+// Rows of the output decoded by one thread
+struct unpack_span {
+    uint8_t *dest;
+    const int8_t *src;
+    const struct row_start *start;
+    size_t write, end;
+};
+
+// Scan the control bytes of ByteRun1 data for the start of each row of the output, checking that every run lies
+// within the source. Runs may carry on from one row into the next. Returns false if the source ends early.
+static bool index_rows(const int8_t *src, size_t src_size, size_t size, size_t row_size, struct row_start *rows) {
+    size_t read = 0;
+    size_t write = 0;
+    size_t row = 0;
+    while (write < size) {
+        if (read >= src_size) {
+            return false;
+        }
+        const int8_t n = src[read];
+        if (n == -128) {
+            // No operation
+            read++;
+            continue;
+        }
+        const size_t len = n >= 0 ? (size_t)n + 1 : (size_t)-n + 1;
+        const size_t data_len = n >= 0 ? len : 1;
+        if (data_len > src_size - read - 1) {
+            return false;
+        }
+        for (; row * row_size < write + len && row * row_size < size; row++) {
+            rows[row].src = read;
+            rows[row].skip = row * row_size - write;
+        }
+        read += 1 + data_len;
+        write += len;
+    }
+    return true;
+}
+
+// Decode the runs of a span. index_rows has checked them, and the source is followed by BODY_PADDING readable
+// bytes, so short runs are copied and filled 16 bytes at a time, in single wide stores, as long as they stay within
+// the span; the runs after them overwrite the excess.
+static void *unpack_span(void *data) {
+    const struct unpack_span *span = data;
+    uint8_t *dest = span->dest;
+    const int8_t *src = span->src;
+    size_t read = span->start->src;
+    size_t skip = span->start->skip;
+    size_t write = span->write;
+    while (write < span->end) {
+        const int8_t n = src[read];
+        if (n == -128) {
+            read++;
+            continue;
+        }
+        size_t len;
+        if (n >= 0) {
+            len = MIN((size_t)n + 1 - skip, span->end - write);
+            const int8_t *from = &src[read + 1 + skip];
+            if (len <= 16 && span->end - write >= 16) {
+                memcpy(&dest[write], from, 16);
+            } else {
+                memcpy(&dest[write], from, len);
+            }
+            read += (size_t)n + 2;
+        } else {
+            len = MIN((size_t)-n + 1 - skip, span->end - write);
+            const uint8_t value = src[read + 1];
+            if (len <= 16 && span->end - write >= 16) {
+                memset(&dest[write], value, 16);
+            } else {
+                memset(&dest[write], value, len);
+            }
+            read += 2;
+        }
+        write += len;
+        skip = 0;
+    }
+    return NULL;
+}
+
+// Decode `size` bytes of a BODY into dest, which holds rows of row_size bytes, from src_size bytes of data followed
+// by BODY_PADDING readable bytes. Returns false if the data is malformed or too short, or the compression unknown.
+static bool unpack(uint8_t *dest, const int8_t *src, const size_t src_size, const size_t size, const size_t row_size,
+                   const int compression) {
+    if (size == 0) {
+        return true;
+    }
     if (compression == 0) {
         // compression value of 0 in the header means no compression.
-        memcpy(dest, src, size);
-    } else if (compression == 1) {
-        // compression value of 1 means ByteRun1 Encoding from the ILBM specification
-        size_t read = 0;
-        size_t write = 0;
-        while (write < size) {
-            const int8_t n = src[read++];
-            assert(n != -128);
-            if (0 <= n) {
-                memcpy(&dest[write], &src[read], n + 1);
-                read += n + 1;
-                write += n + 1;
-            } else if (-127 <= n) {
-                memset(&dest[write], src[read], -n + 1);
-                read++;
-                write += (-n + 1);
-            }
+        memcpy(dest, src, MIN(size, src_size));
+        return src_size >= size;
+    } else if (compression != 1) {
+        return false;
+    }
+
+    // compression value of 1 means ByteRun1 Encoding from the ILBM specification
+    const size_t n_rows = (size + row_size - 1) / row_size;
+    struct row_start *rows = calloc(n_rows, sizeof(struct row_start));
+    if (!rows || !index_rows(src, src_size, size, row_size, rows)) {
+        free(rows);
+        return false;
+    }
+
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_threads = MIN(size / UNPACK_THREAD_BYTES, MIN((size_t)MAX(n_cpus, 1), UNPACK_MAX_THREADS));
+    n_threads = MAX(MIN(n_threads, n_rows), 1);
+    // Hardware counters count the thread that opened them, so measured decodes run on that one alone
+    if (stage_hooks.begin || stage_hooks.end) {
+        n_threads = 1;
+    }
+    struct unpack_span spans[UNPACK_MAX_THREADS];
+    pthread_t threads[UNPACK_MAX_THREADS];
+    bool started[UNPACK_MAX_THREADS] = {false};
+    for (size_t t = 0; t < n_threads; t++) {
+        const size_t first_row = n_rows * t / n_threads;
+        const size_t end_row = n_rows * (t + 1) / n_threads;
+        spans[t] = (struct unpack_span){
+            .dest = dest,
+            .src = src,
+            .start = &rows[first_row],
+            .write = first_row * row_size,
+            .end = MIN(end_row * row_size, size),
+        };
+        // The calling thread takes the first span, and any that a thread cannot be started for
+        if (t > 0) {
+            started[t] = pthread_create(&threads[t], NULL, unpack_span, &spans[t]) == 0;
         }
     }
+    for (size_t t = 0; t < n_threads; t++) {
+        if (!started[t]) {
+            unpack_span(&spans[t]);
+        }
+    }
+    for (size_t t = 1; t < n_threads; t++) {
+        if (started[t]) {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    free(rows);
+    return true;
+}
+
+void lbm_image_memory(const struct lbm_image *image, size_t *pixels, size_t *ranges) {
+    *pixels = (size_t)image->width * image->height;
+    if (image->frames) {
+        *pixels += anim_frames_memory(image->frames);
+    }
+    *ranges = image->n_ranges * (sizeof(struct color_range) + sizeof(struct pixel_list) +
+                                 sizeof(struct range_group));
+    for (unsigned int g = 0; g < image->n_groups; g++) {
+        *ranges += image->n_ranges * sizeof(unsigned int) + image->groups[g].n_pixels * sizeof(unsigned int);
+    }
 }
 
 void free_lbm_image(struct lbm_image *image) {
     if (image) {
-        for (unsigned int i = 0; i < image->n_ranges; i++) {
-            free(image->range_pixels[i].pixels);
-        }
+        size_t pixels, ranges;
+        lbm_image_memory(image, &pixels, &ranges);
+        memstats_free(MEMSTATS_PIXELS, pixels);
+        memstats_free(MEMSTATS_RANGES, ranges);
+        free_range_groups(image);
+        anim_frames_destroy(image->frames);
         free(image->ranges);
         free(image->range_pixels);
         free(image->pixels);
         free(image);
     }
 }
+// Split the rows of an ILBM body, which hold a row of each plane in turn and then one of the mask if there is one,
+// into whole planes one after another. The mask is dropped.
+static uint8_t *decode_planes(const struct ck_BMHD *bmhd, const struct ck_BODY *body) {
+    const size_t row_bytes = ((bmhd->w + 15) / 16) * 2;
+    const size_t plane_size = row_bytes * bmhd->h;
+    const unsigned int rows_per_line = bmhd->nPlanes + (bmhd->masking == 1);
+    const size_t line_size = rows_per_line * row_bytes;
+    uint8_t *lines = calloc(bmhd->h, line_size);
+    uint8_t *planes = calloc(bmhd->nPlanes, plane_size);
+    if (!lines || !planes) {
+        free(lines);
+        free(planes);
+        return NULL;
+    }
+    if (!unpack(lines, body->body, body->base.size, line_size * bmhd->h, line_size, bmhd->compression)) {
+        free(lines);
+        free(planes);
+        return NULL;
+    }
+    for (unsigned int row = 0; row < bmhd->h; row++) {
+        for (unsigned int p = 0; p < bmhd->nPlanes; p++) {
+            memcpy(&planes[p * plane_size + row * row_bytes], &lines[row * line_size + p * row_bytes], row_bytes);
+        }
+    }
+    free(lines);
+    return planes;
+}
+
+// Decode the image held by a FORM ILBM or PBM. The bitplanes of an ILBM are passed back through `planes` if it is
+// not NULL, and are freed otherwise.
+static struct lbm_image *decode_image(const struct ck_FORM *form, uint8_t **planes, unsigned int *n_planes) {
+    struct lbm_image *ret = calloc(1, sizeof(struct lbm_image));
+    const struct chunk *child = form->base.child;
+
+    const struct ck_BMHD *bmhd = NULL;
+    const struct ck_BODY *body = NULL;
+
+    // loop through once to count the CRNGs
+    while (child != NULL) {
+        if (child->id == CRNG) {
+            if (((struct ck_CRNG *)child)->rate > 0) {
+                ret->n_ranges++;
+            }
+        }
+        child = child->next;
+    }
+
+    child = form->base.child;
+
+    ret->ranges = calloc(ret->n_ranges, sizeof(struct color_range));
+    unsigned int range_idx = 0;
+
+    while (child != NULL) {
+        if (child->id == BMHD) {
+            bmhd = (const struct ck_BMHD *)child;
+            ret->width = bmhd->w;
+            ret->height = bmhd->h;
+
+        } else if (child->id == CMAP) {
+            static const int cmap_size = 256;
+            color_register *palette = ret->palette;
+            for (int i = 0; i < cmap_size; i++) {
+                struct ck_CMAP *cmap = (struct ck_CMAP *)child;
+                static const uint8_t a = 0xff;
+                color_register creg = a << 24 |
+                    cmap->ColorMap[i].r << 16 |
+                    cmap->ColorMap[i].g << 8  |
+                    cmap->ColorMap[i].b;
+                palette[i] = creg;
+            }
+        } else if (child->id == CRNG) {
+            struct ck_CRNG *crng = (struct ck_CRNG *)child;
+            struct color_range *range = &ret->ranges[range_idx];
+            if (crng->rate > 0) {
+                range->low = crng->low;
+                range->high = crng->high;
+                range->rate = crng->rate;
+                range_idx++;
+            }
+        } else if (child->id == BODY) {
+            body = (const struct ck_BODY *)child;
+        }
+        child = child->next;
+    }
+
+    if (!bmhd || !body || bmhd->w == 0 || bmhd->h == 0) {
+        free(ret->ranges);
+        free(ret);
+        return NULL;
+    }
+    size_t n_pixels = ret->width * ret->height;
+    ret->pixels = calloc(n_pixels, sizeof(uint8_t));
+    stage_begin(LBM_STAGE_UNPACK);
+    if (memcmp(form->formType, "ILBM", ID_SIZE) == 0) {
+        // Planar, with up to 8 planes for 256 colors
+        uint8_t *ilbm_planes = bmhd->nPlanes <= 8 ? decode_planes(bmhd, body) : NULL;
+        if (!ilbm_planes) {
+            stage_end(LBM_STAGE_UNPACK, 0);
+            free(ret->pixels);
+            free(ret->ranges);
+            free(ret);
+            return NULL;
+        }
+        planes_to_chunky(ilbm_planes, bmhd->nPlanes, ret->width, ret->height, ret->pixels);
+        if (planes) {
+            *planes = ilbm_planes;
+            *n_planes = bmhd->nPlanes;
+        } else {
+            free(ilbm_planes);
+        }
+    } else {
+        if (!unpack(ret->pixels, body->body, body->base.size, n_pixels, ret->width, bmhd->compression)) {
+            stage_end(LBM_STAGE_UNPACK, 0);
+            free(ret->pixels);
+            free(ret->ranges);
+            free(ret);
+            return NULL;
+        }
+    }
+    stage_end(LBM_STAGE_UNPACK, n_pixels);
+    return ret;
+}
+
 struct lbm_image *read_lbm_image(const char *path) {
     struct lbm_image *ret = NULL;
     struct chunk *c = read_iff_file(path);
@@ -110,196 +467,908 @@ struct lbm_image *read_lbm_image(const char *path) {
         goto exit;
     }
 
-    ret = calloc(1, sizeof(struct lbm_image));
-    if (c->id == FORM) {
-        struct ck_FORM *form = (struct ck_FORM *)c;
-        struct chunk *child = form->base.child;
-
-        void *body = NULL;
-        int compression = 0;
-
-        // loop through once to count the CRNGs
-        while (child != NULL) {
-            if (child->id == CRNG) {
-                if (((struct ck_CRNG *)child)->rate > 0) {
-                    ret->n_ranges++;
-                }
-            }
-            child = child->next;
-        }
-
-        child = form->base.child;
-
-        ret->ranges = calloc(ret->n_ranges, sizeof(struct color_range));
-        unsigned int range_idx = 0;
-
-        while (child != NULL) {
-            if (child->id == BMHD) {
-                struct ck_BMHD *bmhd = (struct ck_BMHD *)child;
-                ret->width = bmhd->w;
-                ret->height = bmhd->h;
-                compression = bmhd->compression;
-
-            } else if (child->id == CMAP) {
-                static const int cmap_size = 256;
-                color_register *palette = ret->palette;
-                for (int i = 0; i < cmap_size; i++) {
-                    struct ck_CMAP *cmap = (struct ck_CMAP *)child;
-                    static const uint8_t a = 0xff;
-                    color_register creg = a << 24 |
-                        cmap->ColorMap[i].r << 16 |
-                        cmap->ColorMap[i].g << 8  |
-                        cmap->ColorMap[i].b;
-                    palette[i] = creg;
-                }
-            } else if (child->id == CRNG) {
-                struct ck_CRNG *crng = (struct ck_CRNG *)child;
-                struct color_range *range = &ret->ranges[range_idx];
-                if (crng->rate > 0) {
-                    range->low = crng->low;
-                    range->high = crng->high;
-                    range->rate = crng->rate;
-                    range_idx++;
-                }
-            } else if (child->id == BODY) {
-                struct ck_BODY *body_chunk = (struct ck_BODY *)child;
-                body = body_chunk->body;
-            }
-            child = child->next;
+    struct ck_FORM *form = (struct ck_FORM *)c;
+    if (memcmp(form->formType, "ANIM", ID_SIZE) == 0) {
+        // The first frame is a whole image, the frames after it are deltas
+        struct chunk *first = form->base.child;
+        while (first != NULL && first->id != FORM) {
+            first = first->next;
+        }
+        if (!first) {
+            goto exit;
         }
+        uint8_t *planes = NULL;
+        unsigned int n_planes = 0;
+        ret = decode_image((struct ck_FORM *)first, &planes, &n_planes);
+        if (ret && planes) {
+            ret->frames = anim_frames_create(ret, form, planes, n_planes);
+        }
+    } else {
+        ret = decode_image(form, NULL, NULL);
+    }
 
-        size_t n_pixels = ret->width * ret->height;
-        ret->pixels = calloc(n_pixels, sizeof(uint8_t));
-        unpack(ret->pixels, body, n_pixels, compression);
+    if (ret) {
+        stage_begin(LBM_STAGE_PIXEL_LISTS);
         prepare_pixel_lists(ret);
+        prepare_range_groups(ret);
+        stage_end(LBM_STAGE_PIXEL_LISTS, (size_t)ret->width * ret->height);
+        memcpy(ret->base_palette, ret->palette, sizeof(ret->palette));
+        ret->ranges_overlap = find_overlapping_ranges(ret);
+        lbm_set_pixel_format(ret, PIXEL_FORMAT_XRGB8888);
+
+        size_t pixels, ranges;
+        lbm_image_memory(ret, &pixels, &ranges);
+        memstats_alloc(MEMSTATS_PIXELS, pixels);
+        memstats_alloc(MEMSTATS_RANGES, ranges);
+        ret->iff_size = chunk_tree_size(c);
     }
 exit:
     free_chunk(c);
     return ret;
 }
 
-// Advance the animation of the color ranges in the image.
+// Convert the palette to the pixel format that the image will be rendered in.
+// Renderers then copy entries of image->lut straight into the destination buffer.
+void lbm_set_pixel_format(struct lbm_image *image, enum pixel_format format) {
+    image->format = format;
+    for (int i = 0; i < 256; i++) {
+        image->lut[i] = pixel_format_convert(format, image->palette[i]);
+        image->base_lut[i] = pixel_format_convert(format, image->base_palette[i]);
+    }
+}
+
+// Rotate the slice of a range in a map of palette entries by one, moving the last entry to the front.
+static void rotate_order(uint8_t *order, const struct color_range *range) {
+    uint8_t last = order[range->high];
+    memmove(&order[range->low + 1], &order[range->low], range->high - range->low);
+    order[range->low] = last;
+}
+
+// Write the colors of a range rotated by its offset into the palette and look up table.
+// Entry low + j of the base palette ends up at low + (j + offset) % length.
+static void apply_range_offset(struct lbm_image *image, const struct color_range *range, unsigned int offset) {
+    const unsigned int length = range->high - range->low + 1;
+    const unsigned int head = length - offset;
+    memcpy(&image->palette[range->low + offset], &image->base_palette[range->low], head * sizeof(color_register));
+    memcpy(&image->palette[range->low], &image->base_palette[range->low + head], offset * sizeof(color_register));
+    memcpy(&image->lut[range->low + offset], &image->base_lut[range->low], head * sizeof(uint32_t));
+    memcpy(&image->lut[range->low], &image->base_lut[range->low + head], offset * sizeof(uint32_t));
+}
+
+// Mix two colors, taking `weight` 2^14ths of the second
+static color_register blend_colors(color_register a, color_register b, uint32_t weight) {
+    color_register ret = 0;
+    for (int shift = 0; shift < 32; shift += 8) {
+        uint32_t ca = (a >> shift) & 0xff;
+        uint32_t cb = (b >> shift) & 0xff;
+        ret |= ((ca * ((1 << 14) - weight) + cb * weight) >> 14) << shift;
+    }
+    return ret;
+}
+
+// Write the colors of a range part way between its current step and the next into the palette and look up table,
+// by the progress of the range through the step. Returns true if any color changed.
+static bool apply_range_blend(struct lbm_image *image, const struct color_range *range,
+                              const struct pixel_list *list) {
+    const unsigned int length = range->high - range->low + 1;
+    bool changed = false;
+    for (unsigned int j = 0; j < length; j++) {
+        // The next step moves the color before this one into its place
+        color_register from = image->base_palette[range->low + j];
+        color_register to = image->base_palette[range->low + (j + length - 1) % length];
+        color_register color = blend_colors(from, to, list->cycle_idx);
+        unsigned int p = range->low + (j + list->offset) % length;
+        if (image->palette[p] != color) {
+            image->palette[p] = color;
+            image->lut[p] = pixel_format_convert(image->format, color);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// Switch between moving the colors of ranges a whole step at a time, and blending them into the next step as the
+// range progresses through the current one. Images with overlapping ranges are always stepped.
+void lbm_set_smooth(struct lbm_image *image, bool smooth) {
+    image->smooth = smooth;
+    if (image->ranges_overlap) {
+        return;
+    }
+    for (unsigned int i = 0; i < image->n_ranges; i++) {
+        const struct color_range *range = &image->ranges[i];
+        struct pixel_list *list = &image->range_pixels[i];
+        if (!range_steps(range)) {
+            continue;
+        }
+        if (smooth) {
+            apply_range_blend(image, range, list);
+        } else {
+            apply_range_offset(image, range, list->offset);
+        }
+        list->damaged = true;
+    }
+}
+
+// Advance the animation of the color ranges in the image by one tick.
 // This function should be called at rate of 60Hz for the rate of the animation to agree with the specification.
 // Return true if the contents of any pixels changed, and thus whether a new frame needs to be drawn.
 // This modifies the contents of struct lbm_image::palette
 bool cycle_palette(struct lbm_image *image) {
-    static const uint16_t mod = 1 << 14;
+    return lbm_advance(image, 1);
+}
+
+// Show the frames of an ANIM that are due. Pixels move between ranges, so their lists are made again, which costs a
+// pass over the image per range. Returns true if any pixel changed.
+static bool advance_frames(struct lbm_image *image, unsigned long ticks) {
+    size_t pixels_before, ranges_before, pixels_after, ranges_after;
+    lbm_image_memory(image, &pixels_before, &ranges_before);
+    if (!anim_frames_advance(image->frames, image, ticks)) {
+        return false;
+    }
+    if (image->n_ranges > 0) {
+        free_range_groups(image);
+        count_range_pixels(image);
+        prepare_range_groups(image);
+    }
+    // Lists of changed pixels grow with the frames that change the most
+    lbm_image_memory(image, &pixels_after, &ranges_after);
+    memstats_free(MEMSTATS_PIXELS, pixels_before);
+    memstats_alloc(MEMSTATS_PIXELS, pixels_after);
+    memstats_free(MEMSTATS_RANGES, ranges_before);
+    memstats_alloc(MEMSTATS_RANGES, ranges_after);
+    return true;
+}
+
+static uint64_t gcd(uint64_t a, uint64_t b) {
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Step overlapping ranges tick by tick, rotating their slices of `order`, which maps each palette entry to the one
+// its color comes from. Returns true if any range stepped.
+static bool step_overlapping(struct lbm_image *image, unsigned long ticks, uint8_t *order) {
+    static const unsigned int mod = 1 << 14;
 
     bool ret = false;
+    for (unsigned long t = 0; t < ticks; t++) {
+        for (unsigned int i = 0; i < image->n_ranges; i++) {
+            struct color_range *range = &image->ranges[i];
+            struct pixel_list *list = &image->range_pixels[i];
+            // Increment each color range by its rate mod 2^14. If it overflows, perform the cycle
+            uint16_t newidx = (list->cycle_idx + range->rate) % mod;
+            if (newidx < list->cycle_idx) {
+                rotate_order(order, range);
+                list->damaged = true;
+                ret = true;
+            }
+            list->cycle_idx = newidx;
+        }
+    }
+    return ret;
+}
+
+// Replace `order` by the map of applying it `n` times, following each of its cycles n steps.
+static void power_order(uint8_t *order, unsigned long n) {
+    uint8_t power[256];
+    uint8_t cycle[256];
+    bool seen[256] = {false};
+    for (unsigned int p = 0; p < 256; p++) {
+        unsigned int length = 0;
+        for (unsigned int q = p; !seen[q]; q = order[q]) {
+            seen[q] = true;
+            cycle[length++] = q;
+        }
+        for (unsigned int k = 0; k < length; k++) {
+            power[cycle[k]] = cycle[(k + n % length) % length];
+        }
+    }
+    memcpy(order, power, sizeof(power));
+}
+
+// Overlapping ranges feed each other's rotations, so they are stepped one tick at a time. Their indices all wrap
+// around together every `window` ticks, a power of two up to 2^14, and the steps they take in each window permute
+// the palette in the same way. A long catch-up steps through one window to find that permutation, then applies it
+// as many times as there are whole windows by following its cycles, so it costs at most two windows of steps
+// however many ticks are due.
+// Ticks after which every range is back at the same progress through its step. Each range's is a power of two.
+static unsigned long overlap_window(const struct lbm_image *image) {
+    static const unsigned long mod = 1 << 14;
+
+    unsigned long window = 1;
     for (unsigned int i = 0; i < image->n_ranges; i++) {
-        struct color_range *range = &image->ranges[i];
-        // Increment each color range by its rate mod 2^14. If it overflows, perform the cycle
-        uint16_t newidx = (image->range_pixels[i].cycle_idx + range->rate) % mod;
-        if (newidx < image->range_pixels[i].cycle_idx) {
-            color_register last = image->palette[range->high];
-            memmove(&image->palette[range->low + 1], &image->palette[range->low],
-                    (range->high - range->low) * sizeof(color_register));
-            image->palette[range->low] = last;
-            image->range_pixels[i].damaged = true;
+        const unsigned long rate = image->ranges[i].rate % mod;
+        if (rate != 0) {
+            window = MAX(window, mod / gcd(rate, mod));
+        }
+    }
+    return window;
+}
+
+static bool advance_overlapping(struct lbm_image *image, unsigned long ticks) {
+    const unsigned long window = overlap_window(image);
+    uint8_t order[256];
+    for (unsigned int p = 0; p < 256; p++) {
+        order[p] = p;
+    }
+    bool ret = false;
+    if (ticks > window) {
+        ret = step_overlapping(image, window, order);
+        power_order(order, ticks / window);
+        ticks %= window;
+    }
+    ret = step_overlapping(image, ticks, order) || ret;
+    if (!ret) {
+        return false;
+    }
+    color_register palette[256];
+    uint32_t lut[256];
+    memcpy(palette, image->palette, sizeof(palette));
+    memcpy(lut, image->lut, sizeof(lut));
+    for (unsigned int p = 0; p < 256; p++) {
+        image->palette[p] = palette[order[p]];
+        image->lut[p] = lut[order[p]];
+    }
+    return true;
+}
+
+// Each range keeps its progress towards the next step in cycle_idx, and the number of steps taken as an offset
+// into its slice of the base palette. Advancing by any number of ticks is one multiply and divide per range, after
+// which only the slices of the ranges that stepped are rewritten, so catching up after a stall costs as much as a
+// single tick. Overlapping ranges are advanced by advance_overlapping instead.
+bool lbm_advance(struct lbm_image *image, unsigned long ticks) {
+    static const uint64_t mod = 1 << 14;
+
+    bool ret = false;
+    if (image->ranges_overlap) {
+        ret = advance_overlapping(image, ticks);
+    } else {
+        for (unsigned int i = 0; i < image->n_ranges; i++) {
+            struct color_range *range = &image->ranges[i];
+            struct pixel_list *list = &image->range_pixels[i];
+            const uint64_t total = list->cycle_idx + (uint64_t)ticks * (range->rate % mod);
+            const uint64_t steps = total / mod;
+            list->cycle_idx = total % mod;
+            if (steps > 0 && range->high > range->low) {
+                const unsigned int length = range->high - range->low + 1;
+                list->offset = (list->offset + steps % length) % length;
+            }
+            if (image->smooth && range_steps(range)) {
+                if (apply_range_blend(image, range, list)) {
+                    list->damaged = true;
+                    ret = true;
+                }
+                continue;
+            }
+            if (steps == 0) {
+                continue;
+            }
+            if (range->high > range->low) {
+                apply_range_offset(image, range, list->offset);
+            }
+            list->damaged = true;
             ret = true;
         }
-        image->range_pixels[i].cycle_idx = newidx;
+    }
+    if (image->frames && advance_frames(image, ticks)) {
+        ret = true;
     }
     if (ret) {
         image->frame_count++;
     }
+    image->tick_count += ticks;
     return ret;
 }
 
-// Render the image into a buffer at a given origin and (integer) scale factor.
-// The visible area of the buffer is defined by dst_width and dst_height
-// The resulting image after translating and scaling is clipped to the visible area of the buffer
-void render_lbm_image(void *buffer, struct lbm_image *image, unsigned int dst_width,
-                      unsigned int dst_height, int origin_x, int origin_y, int scale) {
-    const int dst_stride = dst_width;
-    uint32_t *row_start = buffer + (origin_y * dst_stride * sizeof(uint32_t));
-    for (int row = origin_y; row < (int)dst_height; row++) {
-        if ((row-origin_y) / scale >= (int)image->height) break;
-
-        if ( row >= 0 ) {
-            for (int col = origin_x; col < (int)dst_width; col++) {
-                if ((col-origin_x) / scale >= (int)image->width) break;
-
-                if( col >= 0 ) {
-                    unsigned char pixel = image->pixels[(((row-origin_y) / scale) * image->width) + (col-origin_x) / scale];
-                    uint32_t color = *(uint32_t *)(&image->palette[pixel]);
-                    row_start[col] = color;
-                }
+// Overlapping ranges do not commute, so their periods do not combine. Over each window the ranges apply the same
+// permutation of the palette, up to where in the window they start, so the palette repeats after as many windows as
+// the order of that permutation: the LCM of the lengths of its cycles.
+static uint64_t overlapping_period(const struct lbm_image *image, uint64_t max_period) {
+    static const unsigned int mod = 1 << 14;
+
+    const unsigned long window = overlap_window(image);
+    uint16_t *cycle_idx = calloc(image->n_ranges, sizeof(uint16_t));
+    if (!cycle_idx) {
+        return 0;
+    }
+    for (unsigned int i = 0; i < image->n_ranges; i++) {
+        cycle_idx[i] = image->range_pixels[i].cycle_idx;
+    }
+    uint8_t order[256];
+    for (unsigned int p = 0; p < 256; p++) {
+        order[p] = p;
+    }
+    for (unsigned long t = 0; t < window; t++) {
+        for (unsigned int i = 0; i < image->n_ranges; i++) {
+            const struct color_range *range = &image->ranges[i];
+            uint16_t newidx = (cycle_idx[i] + range->rate) % mod;
+            if (newidx < cycle_idx[i]) {
+                rotate_order(order, range);
             }
+            cycle_idx[i] = newidx;
         }
-        row_start += dst_stride;
     }
+    free(cycle_idx);
+
+    uint64_t windows = 1;
+    bool seen[256] = {false};
+    for (unsigned int p = 0; p < 256; p++) {
+        uint64_t length = 0;
+        for (unsigned int q = p; !seen[q]; q = order[q]) {
+            seen[q] = true;
+            length++;
+        }
+        if (length > 1) {
+            const uint64_t factor = length / gcd(windows, length);
+            if (windows > max_period / factor) {
+                return 0;
+            }
+            windows *= factor;
+        }
+    }
+    if (windows > max_period / window) {
+        return 0;
+    }
+    return windows * window;
 }
 
-// Update the pixels in a buffer that have been damaged as a result of cycle_palette.
-// Interpretation of the arguments is the same as render_lbm_image.
-// Extent of damage (in dest. buffer coordinates) is returned through the damage out parameter.
-// If no pixels were damaged, then damage->min_x is set to be greater than damage->max_x (and likewise for min_y, max_y)
-// This clears the damaged flag of any affected pixel ranges
-void render_delta(void *buffer, struct lbm_image *image, unsigned int dst_width,
-                  unsigned int dst_height, int origin_x, int origin_y,
-                  int scale, struct bounding_box *damage, bool clear) {
+// Return the number of calls to cycle_palette after which the palette of the image returns to the same state,
+// or 0 if the image has no color ranges or the period would exceed max_period. Images with frames do not repeat
+// with their palette, so their period is 0 too.
+// A range with rate r steps r/g times every 2^14/g ticks (g = gcd(r, 2^14)), so its palette slice of length n
+// repeats every 2^14/g * n/gcd(r/g, n) ticks. The period of the image is the LCM of its ranges' periods, unless
+// they overlap, see overlapping_period.
+uint64_t lbm_cycle_period(const struct lbm_image *image, uint64_t max_period) {
+    static const uint64_t mod = 1 << 14;
 
-    damage->min_x = INT_MAX;
-    damage->min_y = INT_MAX;
-    damage->max_x = 0;
-    damage->max_y = 0;
+    if (image->frames) {
+        return 0;
+    }
+    if (image->ranges_overlap) {
+        return overlapping_period(image, max_period);
+    }
+    uint64_t period = 0;
+    for (unsigned int i = 0; i < image->n_ranges; i++) {
+        const struct color_range *range = &image->ranges[i];
+        const uint64_t length = range->high - range->low + 1;
+        const uint64_t g = gcd(range->rate % mod, mod);
+        if (range->rate % mod == 0 || length < 2) {
+            // This range never changes the palette
+            continue;
+        }
+        const uint64_t ticks_per_cycle = mod / g;
+        const uint64_t steps_per_cycle = (range->rate % mod) / g;
+        const uint64_t range_period = ticks_per_cycle * (length / gcd(steps_per_cycle, length));
 
-    const unsigned int dst_stride = dst_width;
-    uint32_t *dst_buf = buffer;
+        if (period == 0) {
+            period = range_period;
+        } else {
+            const uint64_t factor = range_period / gcd(period, range_period);
+            if (period > max_period / factor) {
+                return 0;
+            }
+            period *= factor;
+        }
+        if (period > max_period) {
+            return 0;
+        }
+    }
+    return period;
+}
 
+unsigned long lbm_ticks_until_change(const struct lbm_image *image) {
+    static const unsigned long mod = 1 << 14;
+
+    unsigned long ticks = image->frames ? anim_frames_ticks_until_change(image->frames) : 0;
     for (unsigned int i = 0; i < image->n_ranges; i++) {
-        const struct pixel_list *range_pixels = &image->range_pixels[i];
-        if (clear) {
-            if (!range_pixels->damaged) {
-                continue;
-            } else {
-                image->range_pixels[i].damaged = false;
+        const struct color_range *range = &image->ranges[i];
+        if (image->smooth && !image->ranges_overlap && range_steps(range)) {
+            // Blended colors move on every tick
+            return 1;
+        }
+        if (range->rate % mod == 0 || range->high <= range->low) {
+            // This range never changes the palette
+            continue;
+        }
+        // cycle_palette steps the range when its index wraps around
+        unsigned long range_ticks = 1;
+        if ((unsigned long)range->rate < mod) {
+            range_ticks = (mod - image->range_pixels[i].cycle_idx + range->rate - 1) / range->rate;
+        }
+        if (ticks == 0 || range_ticks < ticks) {
+            ticks = range_ticks;
+        }
+    }
+    return ticks;
+}
+
+// The part of the destination that the scaled image covers, max exclusive. Returns false if none.
+static bool image_area(const struct lbm_image *image, unsigned int dst_width, unsigned int dst_height, int origin_x,
+                       int origin_y, int scale, struct bounding_box *area) {
+    area->min_x = MAX(origin_x, 0);
+    area->min_y = MAX(origin_y, 0);
+    area->max_x = MIN((long)dst_width, origin_x + (long)image->width * scale);
+    area->max_y = MIN((long)dst_height, origin_y + (long)image->height * scale);
+    return area->min_x < area->max_x && area->min_y < area->max_y;
+}
+
+// Write the visible pixels of one source row into a destination row. TYPE is the size of a pixel in the destination
+// format.
+#define RENDER_LBM_ROW(TYPE)                                                                        \
+    do {                                                                                            \
+        TYPE *dst_row = (TYPE *)row_start;                                                          \
+        const uint8_t *src = src_row + (area.min_x - origin_x) / scale;                             \
+        int phase = (area.min_x - origin_x) % scale;                                                \
+        for (int col = area.min_x; col < area.max_x; col++) {                                       \
+            dst_row[col] = image->lut[*src];                                                        \
+            if (++phase == scale) {                                                                 \
+                phase = 0;                                                                          \
+                src++;                                                                              \
+            }                                                                                       \
+        }                                                                                           \
+    } while (0)
+
+// Render the image into a buffer at a given origin and (integer) scale factor.
+// The visible area of the buffer is defined by dst_width and dst_height, and rows are dst_stride bytes apart.
+// Pixels are written in the format set with lbm_set_pixel_format.
+// The resulting image after translating and scaling is clipped to the visible area of the buffer. Each source row
+// is drawn into the first destination row that shows it, and copied to the others.
+void render_lbm_image(void *buffer, const struct lbm_image *image, unsigned int dst_width,
+                      unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y, int scale) {
+    stage_begin(LBM_STAGE_RENDER);
+    const int bpp = pixel_format_bytes_per_pixel(image->format);
+    struct bounding_box area;
+    if (!image_area(image, dst_width, dst_height, origin_x, origin_y, scale, &area)) {
+        stage_end(LBM_STAGE_RENDER, 0);
+        return;
+    }
+    const size_t row_bytes = (size_t)(area.max_x - area.min_x) * bpp;
+    int row = area.min_y;
+    while (row < area.max_y) {
+        const int src_y = (row - origin_y) / scale;
+        const int rows_end = MIN(origin_y + (src_y + 1) * scale, area.max_y);
+        const uint8_t *src_row = &image->pixels[(size_t)src_y * image->width];
+        uint8_t *row_start = (uint8_t *)buffer + (size_t)row * dst_stride;
+        if (bpp == 2) {
+            RENDER_LBM_ROW(uint16_t);
+        } else {
+            RENDER_LBM_ROW(uint32_t);
+        }
+        const uint8_t *drawn = row_start + (size_t)area.min_x * bpp;
+        for (row++; row < rows_end; row++) {
+            memcpy((uint8_t *)buffer + (size_t)row * dst_stride + (size_t)area.min_x * bpp, drawn, row_bytes);
+        }
+    }
+    stage_end(LBM_STAGE_RENDER, (size_t)(area.max_x - area.min_x) * (area.max_y - area.min_y));
+}
+
+// 32 bytes of pixels, which the compiler stores with the widest vectors the target has
+typedef uint32_t fill_vector __attribute__((vector_size(32)));
+
+// Set n pixels of bpp bytes to a value
+static void fill_pixels(uint8_t *dst, uint32_t pixel, int bpp, size_t n) {
+    if (bpp == 2) {
+        pixel = (pixel & 0xFFFF) * 0x10001u;
+    }
+    const fill_vector pixels = (fill_vector){0} + pixel;
+    size_t bytes = n * bpp;
+    for (; bytes >= sizeof(pixels); bytes -= sizeof(pixels), dst += sizeof(pixels)) {
+        memcpy(dst, &pixels, sizeof(pixels));
+    }
+    for (; bytes >= sizeof(pixel); bytes -= sizeof(pixel), dst += sizeof(pixel)) {
+        memcpy(dst, &pixel, sizeof(pixel));
+    }
+    // What is left is one 16 bit pixel, which both halves of `pixel` hold
+    memcpy(dst, &pixel, bytes);
+}
+
+void fill_lbm_margins(void *buffer, const struct lbm_image *image, uint32_t background, unsigned int dst_width,
+                      unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y, int scale) {
+    const int bpp = pixel_format_bytes_per_pixel(image->format);
+    struct bounding_box area;
+    if (!image_area(image, dst_width, dst_height, origin_x, origin_y, scale, &area)) {
+        area = (struct bounding_box){0};
+    }
+    for (unsigned int y = 0; y < dst_height; y++) {
+        uint8_t *row = (uint8_t *)buffer + (size_t)y * dst_stride;
+        if ((int)y < area.min_y || (int)y >= area.max_y) {
+            fill_pixels(row, background, bpp, dst_width);
+            continue;
+        }
+        fill_pixels(row, background, bpp, area.min_x);
+        fill_pixels(row + (size_t)area.max_x * bpp, background, bpp, dst_width - area.max_x);
+    }
+}
+
+// Groups merged in one pass. More active groups are drawn in several passes.
+#define MAX_MERGED_GROUPS 16
+
+// Groups whose pixels are drawn together, and where to draw them
+struct merged_render {
+    void *buffer;
+    const struct lbm_image *image;
+    const uint32_t *lut;
+    unsigned int dst_width, dst_height, dst_stride;  // dst_stride is in pixels
+    int origin_x, origin_y, scale;
+    const struct range_group *groups[MAX_MERGED_GROUPS];
+    size_t pos[MAX_MERGED_GROUPS];
+    unsigned int n_groups;
+    // Culled spans of the image's groups at this placement, or NULL to clip each pixel
+    const struct lbm_layout *layout;
+};
+
+// Pop the next pixel of the union of the pixel lists of the groups. Lists are sorted, so this is a k-way merge
+// where pixels present in several lists are returned once.
+static inline bool next_merged_pixel(struct merged_render *r, unsigned int *pixel_idx) {
+    bool found = false;
+    unsigned int next = 0;
+    for (unsigned int k = 0; k < r->n_groups; k++) {
+        if (r->pos[k] < r->groups[k]->n_pixels) {
+            unsigned int p = r->groups[k]->pixels[r->pos[k]];
+            if (!found || p < next) {
+                next = p;
+                found = true;
             }
         }
+    }
+    if (!found) {
+        return false;
+    }
+    for (unsigned int k = 0; k < r->n_groups; k++) {
+        if (r->pos[k] < r->groups[k]->n_pixels && r->groups[k]->pixels[r->pos[k]] == next) {
+            r->pos[k]++;
+        }
+    }
+    *pixel_idx = next;
+    return true;
+}
 
-        for (unsigned int list_idx = 0; list_idx < range_pixels->n_pixels; list_idx++) {
-            const uint32_t pixel_idx = range_pixels->pixels[list_idx];
-            const unsigned char pixel = image->pixels[pixel_idx];
-            const uint32_t newcolor = *(uint32_t *)&image->palette[pixel];
+// Draw each pixel of the merged groups from the source image scale^2 times, with colors from lut, clipped to the
+// destination. TYPE is the size of a pixel in the destination format. Kernels with a constant SCALE fill a span
+// once per source pixel and copy it to each row, which compiles to wide stores; SCALE 0 handles any scale.
+#define DEFINE_MERGED_KERNEL(NAME, TYPE, SCALE)                                                     \
+    static void NAME(struct merged_render *r) {                                                     \
+        const struct lbm_image *image = r->image;                                                   \
+        TYPE *dst_buf = r->buffer;                                                                  \
+        const int scale = (SCALE) ? (SCALE) : r->scale;                                             \
+        const int dst_width = r->dst_width;                                                         \
+        const int dst_height = r->dst_height;                                                       \
+        TYPE span[(SCALE) ? (SCALE) : 1];                                                           \
+        unsigned int pixel_idx;                                                                     \
+        while (next_merged_pixel(r, &pixel_idx)) {                                                  \
+            const TYPE color = r->lut[image->pixels[pixel_idx]];                                    \
+            const int x0 = (int)(pixel_idx % image->width) * scale + r->origin_x;                   \
+            const int y0 = (int)(pixel_idx / image->width) * scale + r->origin_y;                   \
+            if (y0 >= dst_height) {                                                                 \
+                /* Pixels come in row-major order, the rest are below the buffer too */             \
+                break;                                                                              \
+            }                                                                                       \
+            if ((SCALE) && x0 >= 0 && y0 >= 0 && x0 + scale <= dst_width && y0 + scale <= dst_height) { \
+                for (int i = 0; i < scale; i++) {                                                   \
+                    span[i] = color;                                                                \
+                }                                                                                   \
+                TYPE *dst = dst_buf + (size_t)y0 * r->dst_stride + x0;                              \
+                for (int y = 0; y < scale; y++) {                                                   \
+                    memcpy(dst, span, sizeof(span));                                                \
+                    dst += r->dst_stride;                                                           \
+                }                                                                                   \
+                continue;                                                                           \
+            }                                                                                       \
+            const int x_start = MAX(x0, 0);                                                         \
+            const int x_end = MIN(x0 + scale, dst_width);                                           \
+            const int y_start = MAX(y0, 0);                                                         \
+            const int y_end = MIN(y0 + scale, dst_height);                                          \
+            for (int y = y_start; y < y_end; y++) {                                                 \
+                TYPE *dst = dst_buf + (size_t)y * r->dst_stride;                                    \
+                for (int x = x_start; x < x_end; x++) {                                             \
+                    dst[x] = color;                                                                 \
+                }                                                                                   \
+            }                                                                                       \
+        }                                                                                           \
+    }
 
-            const unsigned int src_row = pixel_idx / image->width;
-            const unsigned int src_col = pixel_idx % image->width;
+typedef void (*merged_kernel)(struct merged_render *r);
 
-            // Draw each pixel from the source image scale^2 times
-            for (int square_y = 0; square_y < scale; square_y++) {
-                unsigned int dst_idx =
-                    (((src_row * scale) + (square_y + origin_y)) * dst_stride) +
-                    ((src_col * scale) + origin_x);
+// Scales with a specialized kernel
+#define MAX_KERNEL_SCALE 16
+#define FOR_EACH_KERNEL_SCALE(X)                                                                    \
+    X(1) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16)
 
-                if (dst_idx >= dst_width * dst_height) {
-                    continue;
-                }
+#define DEFINE_SCALE_KERNELS(S)                                                                     \
+    DEFINE_MERGED_KERNEL(render_merged_16_x##S, uint16_t, S)                                        \
+    DEFINE_MERGED_KERNEL(render_merged_32_x##S, uint32_t, S)
+
+FOR_EACH_KERNEL_SCALE(DEFINE_SCALE_KERNELS)
+DEFINE_MERGED_KERNEL(render_merged_16, uint16_t, 0)
+DEFINE_MERGED_KERNEL(render_merged_32, uint32_t, 0)
+
+// Indexed by scale, or 0 for scales without a kernel of their own
+#define KERNEL_16_ENTRY(S) [S] = render_merged_16_x##S,
+#define KERNEL_32_ENTRY(S) [S] = render_merged_32_x##S,
+static const merged_kernel merged_kernels_16[MAX_KERNEL_SCALE + 1] = {
+    [0] = render_merged_16,
+    FOR_EACH_KERNEL_SCALE(KERNEL_16_ENTRY)
+};
+static const merged_kernel merged_kernels_32[MAX_KERNEL_SCALE + 1] = {
+    [0] = render_merged_32,
+    FOR_EACH_KERNEL_SCALE(KERNEL_32_ENTRY)
+};
+
+static void flush_merged(struct merged_render *r) {
+    if (r->n_groups == 0) {
+        return;
+    }
+    memset(r->pos, 0, sizeof(r->pos));
+    const merged_kernel *kernels =
+        pixel_format_bytes_per_pixel(r->image->format) == 2 ? merged_kernels_16 : merged_kernels_32;
+    kernels[r->scale >= 1 && r->scale <= MAX_KERNEL_SCALE ? r->scale : 0](r);
+    r->n_groups = 0;
+}
 
-                dst_buf[dst_idx] = newcolor;
-                if (scale < 2) continue;
-                dst_buf[dst_idx + 1] = newcolor;
-                if (scale < 3) continue;
-                dst_buf[dst_idx + 2] = newcolor;
-                if (scale < 4) continue;
-                dst_buf[dst_idx + 3] = newcolor;
-                if (scale < 5) continue;
-                dst_buf[dst_idx + 4] = newcolor;
-                if (scale < 6) continue;
-                dst_buf[dst_idx + 5] = newcolor;
-                if (scale < 7) continue;
-                dst_buf[dst_idx + 6] = newcolor;
-                if (scale < 8) continue;
-                dst_buf[dst_idx + 7] = newcolor;
+static void merge_group(struct merged_render *r, const struct range_group *group) {
+    r->groups[r->n_groups++] = group;
+    if (r->n_groups == MAX_MERGED_GROUPS) {
+        flush_merged(r);
+    }
+}
+
+// Consecutive pixels of a source row that are visible, and where they go. The first and last pixels may be cut by the
+// edges of the destination, the others cover scale columns each. Every row drawn is a copy of the first.
+struct pixel_span {
+    uint32_t src;      // index of the first pixel in image->pixels
+    uint32_t dst;      // offset of the first destination pixel, in pixels
+    uint16_t n;        // source pixels
+    uint16_t first_w;  // destination columns of the first pixel
+    uint16_t last_w;   // and of the last, if n > 1
+    uint16_t rows;     // destination rows
+};
+
+// The visible pixels of a range group
+struct span_list {
+    struct pixel_span *spans;
+    size_t n_spans;
+    size_t n_dst_pixels;
+};
+
+struct lbm_layout {
+    unsigned int dst_width, dst_height, dst_stride;
+    int origin_x, origin_y, scale;
+    // The image the lists were culled from, and its pixel generation at the time
+    const struct range_group *groups;
+    unsigned int n_groups;
+    uint64_t generation;
+    // Visible source pixels, max exclusive
+    struct bounding_box visible;
+    struct span_list *lists;  // one per group
+    size_t memory;
+};
+
+static int floor_div(long a, int b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+// Destination columns of source column x, clipped to the destination
+static int visible_columns(const struct lbm_layout *layout, int x, int *dst_x) {
+    long x0 = (long)x * layout->scale + layout->origin_x;
+    long x1 = x0 + layout->scale;
+    *dst_x = MAX(x0, 0);
+    return MIN(x1, (long)layout->dst_width) - *dst_x;
+}
+
+// Cull the pixels of a group to the visible ones, and join consecutive ones into spans. Returns false on allocation
+// failure.
+static bool cull_group(struct lbm_layout *layout, const struct lbm_image *image, const struct range_group *group,
+                       struct span_list *list) {
+    size_t capacity = 0;
+    struct pixel_span *span = NULL;
+    unsigned int span_end = 0;  // pixel after the last of the current span
+    for (size_t i = 0; i < group->n_pixels; i++) {
+        const unsigned int p = group->pixels[i];
+        const int x = p % image->width;
+        const int y = p / image->width;
+        if (y < layout->visible.min_y) {
+            continue;
+        }
+        if (y >= layout->visible.max_y) {
+            break;  // the rest are below too
+        }
+        if (x < layout->visible.min_x || x >= layout->visible.max_x) {
+            continue;
+        }
+        int dst_x;
+        const int w = visible_columns(layout, x, &dst_x);
+        // Spans do not wrap to the next row, even where whole rows are visible
+        if (span && p == span_end && x > 0 && span->n < UINT16_MAX) {
+            span->last_w = w;
+            span->n++;
+            span_end++;
+            list->n_dst_pixels += (size_t)w * span->rows;
+            continue;
+        }
+        if (list->n_spans == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct pixel_span *spans = realloc(list->spans, capacity * sizeof(struct pixel_span));
+            if (!spans) {
+                return false;
             }
+            list->spans = spans;
+        }
+        const long y0 = (long)y * layout->scale + layout->origin_y;
+        const int dst_y = MAX(y0, 0);
+        span = &list->spans[list->n_spans++];
+        span->src = p;
+        span->dst = (uint32_t)((size_t)dst_y * layout->dst_stride + dst_x);
+        span->n = 1;
+        span->first_w = w;
+        span->last_w = w;
+        span->rows = MIN(y0 + layout->scale, (long)layout->dst_height) - dst_y;
+        span_end = p + 1;
+        list->n_dst_pixels += (size_t)w * span->rows;
+    }
+    if (list->n_spans && list->n_spans < capacity) {
+        // Give back what was over-allocated, the lists live as long as the placement
+        struct pixel_span *spans = realloc(list->spans, list->n_spans * sizeof(struct pixel_span));
+        list->spans = spans ? spans : list->spans;
+    }
+    layout->memory += list->n_spans * sizeof(struct pixel_span);
+    return true;
+}
+
+struct lbm_layout *lbm_layout_create(const struct lbm_image *image, unsigned int dst_width,
+                                     unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y,
+                                     int scale) {
+    const int bpp = pixel_format_bytes_per_pixel(image->format);
+    // Spans hold offsets as 32 bits, and their widths and heights as 16
+    if (scale < 1 || scale > UINT16_MAX || dst_stride % bpp != 0 ||
+            (uint64_t)dst_height * (dst_stride / bpp) > UINT32_MAX) {
+        return NULL;
+    }
+    struct lbm_layout *layout = calloc(1, sizeof(struct lbm_layout));
+    if (!layout) {
+        return NULL;
+    }
+    layout->dst_width = dst_width;
+    layout->dst_height = dst_height;
+    layout->dst_stride = dst_stride / bpp;
+    layout->origin_x = origin_x;
+    layout->origin_y = origin_y;
+    layout->scale = scale;
+    layout->groups = image->groups;
+    layout->n_groups = image->n_groups;
+    layout->generation = lbm_pixels_generation(image);
+
+    layout->visible.min_x = MAX(floor_div(-(long)origin_x, scale), 0);
+    layout->visible.min_y = MAX(floor_div(-(long)origin_y, scale), 0);
+    layout->visible.max_x = MIN(floor_div((long)dst_width - origin_x + scale - 1, scale), (int)image->width);
+    layout->visible.max_y = MIN(floor_div((long)dst_height - origin_y + scale - 1, scale), (int)image->height);
+
+    layout->lists = calloc(image->n_groups ? image->n_groups : 1, sizeof(struct span_list));
+    layout->memory = sizeof(struct lbm_layout) + image->n_groups * sizeof(struct span_list);
+    bool ok = layout->lists != NULL;
+    for (unsigned int g = 0; ok && g < image->n_groups; g++) {
+        ok = cull_group(layout, image, &image->groups[g], &layout->lists[g]);
+    }
+    if (!ok) {
+        layout->memory = 0;
+        lbm_layout_destroy(layout);
+        return NULL;
+    }
+    memstats_alloc(MEMSTATS_RANGES, layout->memory);
+    return layout;
+}
+
+void lbm_layout_destroy(struct lbm_layout *layout) {
+    if (!layout) {
+        return;
+    }
+    if (layout->lists) {
+        for (unsigned int g = 0; g < layout->n_groups; g++) {
+            free(layout->lists[g].spans);
         }
-        damage->max_x = MAX(damage->max_x, range_pixels->bbox.max_x);
-        damage->max_y = MAX(damage->max_y, range_pixels->bbox.max_y);
-        damage->min_x = MIN(damage->min_x, range_pixels->bbox.min_x);
-        damage->min_y = MIN(damage->min_y, range_pixels->bbox.min_y);
     }
+    memstats_free(MEMSTATS_RANGES, layout->memory);
+    free(layout->lists);
+    free(layout);
+}
+
+bool lbm_layout_matches(const struct lbm_layout *layout, const struct lbm_image *image, unsigned int dst_width,
+                        unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y, int scale) {
+    return layout && layout->groups == image->groups && layout->n_groups == image->n_groups &&
+        layout->generation == lbm_pixels_generation(image) && layout->dst_width == dst_width &&
+        layout->dst_height == dst_height &&
+        layout->dst_stride * pixel_format_bytes_per_pixel(image->format) == dst_stride &&
+        layout->origin_x == origin_x && layout->origin_y == origin_y && layout->scale == scale;
+}
+
+size_t lbm_layout_memory(const struct lbm_layout *layout) {
+    return layout ? layout->memory : 0;
+}
+
+// Draw the spans of a list with colors from lut. TYPE is the size of a pixel in the destination format. Kernels with
+// a constant SCALE fill the middle pixels of spans with fixed-size stores; SCALE 0 handles any scale.
+#define DEFINE_SPAN_KERNEL(NAME, TYPE, SCALE)                                                       \
+    static void NAME(void *buffer, const uint8_t *pixels, const uint32_t *lut, const struct span_list *list, \
+                     int scale_arg, size_t dst_stride) {                                            \
+        const int scale = (SCALE) ? (SCALE) : scale_arg;                                            \
+        for (size_t i = 0; i < list->n_spans; i++) {                                                \
+            const struct pixel_span *span = &list->spans[i];                                        \
+            const uint8_t *src = pixels + span->src;                                                \
+            TYPE *const row = (TYPE *)buffer + span->dst;                                           \
+            TYPE *dst = row;                                                                        \
+            TYPE color = lut[src[0]];                                                               \
+            for (int x = 0; x < span->first_w; x++) {                                               \
+                *dst++ = color;                                                                     \
+            }                                                                                       \
+            if (span->n > 1) {                                                                      \
+                for (unsigned int s = 1; s < span->n - 1u; s++) {                                   \
+                    color = lut[src[s]];                                                            \
+                    for (int x = 0; x < scale; x++) {                                               \
+                        dst[x] = color;                                                             \
+                    }                                                                               \
+                    dst += scale;                                                                   \
+                }                                                                                   \
+                color = lut[src[span->n - 1]];                                                      \
+                for (int x = 0; x < span->last_w; x++) {                                            \
+                    *dst++ = color;                                                                 \
+                }                                                                                   \
+            }                                                                                       \
+            const size_t width = (dst - row) * sizeof(TYPE);                                        \
+            for (int y = 1; y < span->rows; y++) {                                                  \
+                memcpy(row + y * dst_stride, row, width);                                           \
+            }                                                                                       \
+        }                                                                                           \
+    }
+
+typedef void (*span_kernel)(void *buffer, const uint8_t *pixels, const uint32_t *lut, const struct span_list *list,
+                            int scale, size_t dst_stride);
+
+#define DEFINE_SPAN_SCALE_KERNELS(S)                                                                \
+    DEFINE_SPAN_KERNEL(render_spans_16_x##S, uint16_t, S)                                           \
+    DEFINE_SPAN_KERNEL(render_spans_32_x##S, uint32_t, S)
 
-    // Damage bounding box is in source image coordinates. Transform it once at the end
+FOR_EACH_KERNEL_SCALE(DEFINE_SPAN_SCALE_KERNELS)
+DEFINE_SPAN_KERNEL(render_spans_16, uint16_t, 0)
+DEFINE_SPAN_KERNEL(render_spans_32, uint32_t, 0)
+
+#define SPAN_16_ENTRY(S) [S] = render_spans_16_x##S,
+#define SPAN_32_ENTRY(S) [S] = render_spans_32_x##S,
+static const span_kernel span_kernels_16[MAX_KERNEL_SCALE + 1] = {
+    [0] = render_spans_16,
+    FOR_EACH_KERNEL_SCALE(SPAN_16_ENTRY)
+};
+static const span_kernel span_kernels_32[MAX_KERNEL_SCALE + 1] = {
+    [0] = render_spans_32,
+    FOR_EACH_KERNEL_SCALE(SPAN_32_ENTRY)
+};
+
+// Draw group g of the image: its culled spans if the render has a layout, else its whole pixel list, clipped pixel by
+// pixel. Returns the number of destination pixels drawn, at most.
+static size_t render_group(struct merged_render *r, unsigned int g) {
+    if (!r->layout) {
+        merge_group(r, &r->image->groups[g]);
+        return r->image->groups[g].n_pixels * r->scale * r->scale;
+    }
+    const struct span_list *list = &r->layout->lists[g];
+    const span_kernel *kernels =
+        pixel_format_bytes_per_pixel(r->image->format) == 2 ? span_kernels_16 : span_kernels_32;
+    kernels[r->scale <= MAX_KERNEL_SCALE ? r->scale : 0](r->buffer, r->image->pixels, r->lut, list, r->scale,
+                                                         r->dst_stride);
+    return list->n_dst_pixels;
+}
+
+static void add_range_damage(struct bounding_box *damage, const struct pixel_list *range_pixels) {
+    damage->max_x = MAX(damage->max_x, range_pixels->bbox.max_x);
+    damage->max_y = MAX(damage->max_y, range_pixels->bbox.max_y);
+    damage->min_x = MIN(damage->min_x, range_pixels->bbox.min_x);
+    damage->min_y = MIN(damage->min_y, range_pixels->bbox.min_y);
+}
+
+// Damage bounding boxes are accumulated in source image coordinates. Transform them once at the end
+static void transform_damage(struct bounding_box *damage, unsigned int dst_width, unsigned int dst_height,
+                             int origin_x, int origin_y, int scale) {
     if (damage->min_y != INT_MAX) {
         damage->max_x *= scale;
         damage->max_y *= scale;
@@ -322,3 +1391,219 @@ void render_delta(void *buffer, struct lbm_image *image, unsigned int dst_width,
         damage->min_y = MAX(damage->min_y, 0);
     }
 }
+
+// Update the pixels in a buffer that have been damaged as a result of cycle_palette.
+// Interpretation of the arguments is the same as render_lbm_image.
+// Extent of damage (in dest. buffer coordinates) is returned through the damage out parameter.
+// If no pixels were damaged, then damage->min_x is set to be greater than damage->max_x (and likewise for min_y, max_y)
+// This clears the damaged flag of any affected pixel ranges
+void render_delta(void *buffer, struct lbm_image *image, const struct lbm_layout *layout, unsigned int dst_width,
+                  unsigned int dst_height, unsigned int dst_stride, int origin_x, int origin_y,
+                  int scale, struct bounding_box *damage, bool clear) {
+
+    stage_begin(LBM_STAGE_DELTA);
+    // Destination pixels drawn
+    size_t n_drawn = 0;
+    damage->min_x = INT_MAX;
+    damage->min_y = INT_MAX;
+    damage->max_x = 0;
+    damage->max_y = 0;
+
+    struct merged_render r = {
+        .buffer = buffer,
+        .image = image,
+        .lut = image->lut,
+        .dst_width = dst_width,
+        .dst_height = dst_height,
+        .dst_stride = dst_stride / pixel_format_bytes_per_pixel(image->format),
+        .origin_x = origin_x,
+        .origin_y = origin_y,
+        .scale = scale,
+        .layout = lbm_layout_matches(layout, image, dst_width, dst_height, dst_stride, origin_x, origin_y, scale) ?
+            layout : NULL,
+    };
+
+    for (unsigned int g = 0; g < image->n_groups; g++) {
+        const struct range_group *group = &image->groups[g];
+        bool active = false;
+        for (unsigned int j = 0; j < group->n_ranges; j++) {
+            struct pixel_list *range_pixels = &image->range_pixels[group->ranges[j]];
+            if (clear) {
+                if (!range_pixels->damaged) {
+                    continue;
+                } else {
+                    range_pixels->damaged = false;
+                }
+            }
+            add_range_damage(damage, range_pixels);
+            active = true;
+        }
+        if (active) {
+            n_drawn += render_group(&r, g);
+        }
+    }
+    flush_merged(&r);
+    transform_damage(damage, dst_width, dst_height, origin_x, origin_y, scale);
+    stage_end(LBM_STAGE_DELTA, n_drawn);
+}
+
+// Whether the colors of a range differ between two look up tables
+static bool range_changed(const struct color_range *range, const uint32_t *old_lut, const uint32_t *new_lut) {
+    return memcmp(&old_lut[range->low], &new_lut[range->low],
+                  (range->high - range->low + 1) * sizeof(uint32_t)) != 0;
+}
+
+void render_ranges(void *buffer, const struct lbm_image *image, const struct lbm_layout *layout,
+                   const uint32_t *old_lut, unsigned int dst_width, unsigned int dst_height, unsigned int dst_stride,
+                   int origin_x, int origin_y, int scale, struct bounding_box *damage) {
+    damage->min_x = INT_MAX;
+    damage->min_y = INT_MAX;
+    damage->max_x = 0;
+    damage->max_y = 0;
+
+    struct merged_render r = {
+        .buffer = buffer,
+        .image = image,
+        .lut = image->lut,
+        .dst_width = dst_width,
+        .dst_height = dst_height,
+        .dst_stride = dst_stride / pixel_format_bytes_per_pixel(image->format),
+        .origin_x = origin_x,
+        .origin_y = origin_y,
+        .scale = scale,
+        .layout = lbm_layout_matches(layout, image, dst_width, dst_height, dst_stride, origin_x, origin_y, scale) ?
+            layout : NULL,
+    };
+
+    for (unsigned int g = 0; g < image->n_groups; g++) {
+        const struct range_group *group = &image->groups[g];
+        bool active = false;
+        for (unsigned int j = 0; j < group->n_ranges; j++) {
+            unsigned int i = group->ranges[j];
+            if (range_changed(&image->ranges[i], old_lut, image->lut)) {
+                add_range_damage(damage, &image->range_pixels[i]);
+                active = true;
+            }
+        }
+        if (active) {
+            render_group(&r, g);
+        }
+    }
+    flush_merged(&r);
+    transform_damage(damage, dst_width, dst_height, origin_x, origin_y, scale);
+}
+
+void lut_damage(const struct lbm_image *image, const uint32_t *old_lut, const uint32_t *new_lut,
+                unsigned int dst_width, unsigned int dst_height, int origin_x, int origin_y, int scale,
+                struct bounding_box *damage) {
+    damage->min_x = INT_MAX;
+    damage->min_y = INT_MAX;
+    damage->max_x = 0;
+    damage->max_y = 0;
+
+    for (unsigned int i = 0; i < image->n_ranges; i++) {
+        if (range_changed(&image->ranges[i], old_lut, new_lut)) {
+            add_range_damage(damage, &image->range_pixels[i]);
+        }
+    }
+    transform_damage(damage, dst_width, dst_height, origin_x, origin_y, scale);
+}
+
+uint64_t lbm_pixels_generation(const struct lbm_image *image) {
+    return image->frames ? anim_frames_generation(image->frames) : 0;
+}
+
+// Add the bounding boxes of the pixels changed since generation `from`, up to generation `to`, to the damage and to
+// the merged render if there is one. Returns false if those changes are no longer kept.
+static bool merge_pixel_changes(const struct lbm_image *image, uint64_t from, uint64_t to,
+                                struct merged_render *r, struct bounding_box *damage) {
+    if (from > to) {
+        return false;
+    }
+    for (uint64_t generation = from + 1; generation <= to; generation++) {
+        if (!anim_frames_change(image->frames, generation)) {
+            return false;
+        }
+    }
+    for (uint64_t generation = from + 1; generation <= to; generation++) {
+        const struct anim_change *change = anim_frames_change(image->frames, generation);
+        if (change->list.n_pixels == 0) {
+            continue;
+        }
+        damage->max_x = MAX(damage->max_x, change->bbox.max_x);
+        damage->max_y = MAX(damage->max_y, change->bbox.max_y);
+        damage->min_x = MIN(damage->min_x, change->bbox.min_x);
+        damage->min_y = MIN(damage->min_y, change->bbox.min_y);
+        if (r) {
+            merge_group(r, &change->list);
+        }
+    }
+    return true;
+}
+
+static void image_damage(const struct lbm_image *image, struct bounding_box *damage) {
+    damage->min_x = 0;
+    damage->min_y = 0;
+    damage->max_x = image->width - 1;
+    damage->max_y = image->height - 1;
+}
+
+void render_pixel_changes(void *buffer, const struct lbm_image *image, uint64_t from,
+                          unsigned int dst_width, unsigned int dst_height, unsigned int dst_stride,
+                          int origin_x, int origin_y, int scale, struct bounding_box *damage) {
+    damage->min_x = INT_MAX;
+    damage->min_y = INT_MAX;
+    damage->max_x = 0;
+    damage->max_y = 0;
+
+    const uint64_t to = lbm_pixels_generation(image);
+    if (from == to) {
+        return;
+    }
+    struct merged_render r = {
+        .buffer = buffer,
+        .image = image,
+        .lut = image->lut,
+        .dst_width = dst_width,
+        .dst_height = dst_height,
+        .dst_stride = dst_stride / pixel_format_bytes_per_pixel(image->format),
+        .origin_x = origin_x,
+        .origin_y = origin_y,
+        .scale = scale,
+    };
+    if (merge_pixel_changes(image, from, to, &r, damage)) {
+        flush_merged(&r);
+    } else {
+        render_lbm_image(buffer, image, dst_width, dst_height, dst_stride, origin_x, origin_y, scale);
+        image_damage(image, damage);
+    }
+    transform_damage(damage, dst_width, dst_height, origin_x, origin_y, scale);
+}
+
+void pixel_changes_damage(const struct lbm_image *image, uint64_t from, uint64_t to,
+                          unsigned int dst_width, unsigned int dst_height, int origin_x, int origin_y, int scale,
+                          struct bounding_box *damage) {
+    damage->min_x = INT_MAX;
+    damage->min_y = INT_MAX;
+    damage->max_x = 0;
+    damage->max_y = 0;
+
+    if (from != to && !merge_pixel_changes(image, MIN(from, to), MAX(from, to), NULL, damage)) {
+        image_damage(image, damage);
+    }
+    transform_damage(damage, dst_width, dst_height, origin_x, origin_y, scale);
+}
+
+void merge_damage(struct bounding_box *damage, const struct bounding_box *other) {
+    if (other->min_x >= other->max_x || other->min_y >= other->max_y) {
+        return;
+    }
+    if (damage->min_x >= damage->max_x || damage->min_y >= damage->max_y) {
+        *damage = *other;
+        return;
+    }
+    damage->min_x = MIN(damage->min_x, other->min_x);
+    damage->min_y = MIN(damage->min_y, other->min_y);
+    damage->max_x = MAX(damage->max_x, other->max_x);
+    damage->max_y = MAX(damage->max_y, other->max_y);
+}
@@ -1,21 +1,40 @@
 #define _POSIX_C_SOURCE 200809L
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
+#include <unistd.h>
 #include <wayland-client.h>
 #include "background-image.h"
 #include "cairo_util.h"
+#include "control.h"
+#include "export.h"
+#include "frame-ring.h"
+#include "governor.h"
+#include "image-loader.h"
 #include "log.h"
+#include "memstats.h"
+#include "pixel-format.h"
 #include "pool-buffer.h"
+#include "presentation.h"
+#include "render-thread.h"
+#include "resample.h"
+#include "thumbnail-cache.h"
 #include "wlr-layer-shell-unstable-v1-client-protocol.h"
 #include "viewporter-client-protocol.h"
 #include "single-pixel-buffer-v1-client-protocol.h"
 #include "fractional-scale-v1-client-protocol.h"
+#include "presentation-time-client-protocol.h"
 #include "lbm.h"
 
 /*
@@ -47,14 +66,35 @@ struct swaybg_state {
 	struct wl_display *display;
 	struct wl_compositor *compositor;
 	struct wl_shm *shm;
+	uint32_t shm_formats;  // bitmask of supported enum pixel_format
+	enum pixel_format pixel_format;
+	size_t frame_ring_budget;  // bytes, 0 if disabled
+	uint32_t pan_speed;  // buffer pixels per second
+	enum resample_filter resample_filter;  // for static images
 	struct zwlr_layer_shell_v1 *layer_shell;
 	struct wp_viewporter *viewporter;
 	struct wp_single_pixel_buffer_manager_v1 *single_pixel_buffer_manager;
 	struct wp_fractional_scale_manager_v1 *fractional_scale_manager;
+	struct wp_presentation *presentation;
+	clockid_t presentation_clock;
 	struct wl_list configs;  // struct swaybg_output_config::link
 	struct wl_list outputs;  // struct swaybg_output::link
 	struct wl_list images;   // struct swaybg_image::link
+	struct image_loader *loader;
+	struct render_thread *renderer;
+	struct export_options export;
+	const char *control_path;  // NULL for the default, empty to disable
+	struct control_server *control;
+	// Set at runtime through the control socket
+	bool paused;
+	unsigned int max_fps;  // 0 if uncapped
+	bool smooth;  // blend color ranges between steps
+	struct governor_config governor_config;
+	struct governor *governor;
+	// The above merged with the policy of the governor
+	struct governor_policy policy;
 	bool run_display;
+	uint64_t start_time;  // CLOCK_MONOTONIC ms
 };
 
 
@@ -88,14 +128,59 @@ struct swaybg_output {
 	int32_t committed_width, committed_height, committed_scale;
 	uint32_t last_requested_frame_time;
 	uint32_t last_committed_frame_time;
+	int32_t refresh;  // mHz, of the current mode, 0 if unknown
+	bool frame_pending;  // a frame callback was requested
+	// CLOCK_MONOTONIC ms at which to request the next frame callback, or 0.
+	// Animations sleep between palette changes rather than waking every frame.
+	uint64_t frame_request_time;
+	bool placeholder_shown, first_frame_shown;
 
 	struct pool_buffer buffer;
-	void *native_buffer;
+	// Animation frames are rendered into the back buffer ahead of the frame
+	// callback that shows them, then swapped with the front buffer
+	struct pool_buffer back_buffer;
+	bool back_buffer_ready;
+	// Colors each buffer was last rendered with
+	uint32_t buffer_lut[256];
+	uint32_t back_buffer_lut[256];
+	// and the frame of an ANIM they show, see lbm_pixels_generation
+	uint64_t buffer_generation;
+	uint64_t back_buffer_generation;
+	// and when the cycle tick they show was due, in ns of the presentation
+	// clock, 0 if unknown
+	int64_t buffer_due_ns;
+	int64_t back_buffer_due_ns;
+	int64_t render_due_ns;  // of the job in flight
+	struct render_job render_job;
+	bool render_pending, render_cancelled;
+	int32_t render_width, render_height;  // size of buffers
 	int lbm_origin_x;
 	int lbm_origin_y;
 	unsigned int lbm_scale;
+	// Visible range pixels at that placement, see get_output_layout
+	struct lbm_layout *layout;
+	struct frame_ring *frame_ring;
+	// In pan mode, the buffer holds the whole scene and the viewport shows a
+	// window of it that moves from frame to frame
+	bool panning;
+	bool pan_started;
+	uint32_t pan_start_time;
 	struct wp_fractional_scale_v1 *fractional_scale;
 	struct wp_viewport *viewport;
+	// Presentation clock time the last frame callback was handled
+	int64_t frame_done_ns;
+	struct wl_list feedbacks;  // struct swaybg_feedback::link
+	unsigned int n_feedbacks;
+	struct presentation_stats presentation;
+	struct wl_list link;
+};
+
+// Presentation feedback requested for a commit
+struct swaybg_feedback {
+	struct swaybg_output *output;
+	struct wp_presentation_feedback *feedback;
+	int64_t commit_ns;
+	int64_t due_ns;
 	struct wl_list link;
 };
 
@@ -117,81 +202,559 @@ bool is_valid_color(const char *color) {
 	return true;
 }
 
+static void schedule_render(struct swaybg_output *output);
+
 void release_buffer(void *data, struct wl_buffer *buffer) {
 	struct swaybg_output *output = data;
 //	swaybg_log(LOG_DEBUG, "%s %p",__FUNCTION__, buffer);
-	if( output->buffer.buffer == buffer ) { // If frame callback is not reallocating buffer, this is always the case
+	// Buffers of an output are destroyed when they are replaced, so a release
+	// is always for one of the current ones
+	if( output->buffer.buffer == buffer ) {
 		// Let the output reuse this buffer if it can
 		output->buffer.available = true;
 //		swaybg_log(LOG_DEBUG, "%s Reusing %p",__FUNCTION__, buffer);
-	} else {
-//		swaybg_log(LOG_DEBUG, "%s Destroying %p",__FUNCTION__, buffer);
-		destroy_buffer(&output->buffer);
+	} else if (output->back_buffer.buffer == buffer) {
+		output->back_buffer.available = true;
+		schedule_render(output);
+	}
+}
+
+static const struct wl_callback_listener wl_surface_frame_listener;
+
+// Rate of cycle_palette ticks, 60Hz per the ILBM spec
+#define CYCLE_TICK_US (1000000 / 60)
+// Longest an animation sleeps before checking the time again
+#define MAX_SLEEP_TICKS 600
+
+static uint64_t get_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Shortest time between two updates of an animation, 0 if uncapped
+static int64_t get_min_update_us(const struct swaybg_state *state) {
+	return state->policy.max_fps ? 1000000 / state->policy.max_fps : 0;
+}
+
+static int64_t get_frame_period_us(const struct swaybg_output *output) {
+	// Presentation feedback reports the exact period, the mode a rounded one
+	if (output->presentation.refresh_ns) {
+		return (output->presentation.refresh_ns + 500) / 1000;
+	}
+	// Assume 60Hz until the compositor says otherwise
+	return output->refresh > 0 ? 1000000000LL / output->refresh : CYCLE_TICK_US;
+}
+
+// Most feedback requested but not yet answered per output, in case a
+// compositor is slow to answer
+#define MAX_PENDING_FEEDBACKS 8
+// Presentation latency taken into account when pacing animations at most
+#define MAX_PACING_LATENCY_US 100000
+
+static int64_t get_presentation_time_ns(const struct swaybg_state *state) {
+	struct timespec ts;
+	clock_gettime(state->presentation_clock, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void destroy_feedback(struct swaybg_feedback *fb) {
+	wp_presentation_feedback_destroy(fb->feedback);
+	wl_list_remove(&fb->link);
+	fb->output->n_feedbacks--;
+	free(fb);
+}
+
+static void feedback_sync_output(void *data,
+		struct wp_presentation_feedback *feedback, struct wl_output *output) {
+	// Outputs are known from the surface already
+}
+
+static void feedback_presented(void *data,
+		struct wp_presentation_feedback *feedback, uint32_t tv_sec_hi,
+		uint32_t tv_sec_lo, uint32_t tv_nsec, uint32_t refresh,
+		uint32_t seq_hi, uint32_t seq_lo, uint32_t flags) {
+	struct swaybg_feedback *fb = data;
+	struct swaybg_output *output = fb->output;
+	int64_t present_ns = (int64_t)(((uint64_t)tv_sec_hi << 32) | tv_sec_lo) *
+		1000000000 + tv_nsec;
+	if (!refresh) {
+		// Variable refresh rate, or the compositor does not know
+		refresh = output->refresh > 0 ? 1000000000000LL / output->refresh : 0;
 	}
+	presentation_stats_presented(&output->presentation, fb->commit_ns,
+			present_ns, refresh, fb->due_ns);
+	destroy_feedback(fb);
 }
 
-const struct wl_buffer_listener buffer_listener = {
-	.release = release_buffer
+static void feedback_discarded(void *data,
+		struct wp_presentation_feedback *feedback) {
+	struct swaybg_feedback *fb = data;
+	presentation_stats_discarded(&fb->output->presentation);
+	destroy_feedback(fb);
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = feedback_sync_output,
+	.presented = feedback_presented,
+	.discarded = feedback_discarded,
 };
 
-static const struct wl_callback_listener wl_surface_frame_listener;
+/*
+ * Ask when the content about to be committed by the caller is presented.
+ * `due_ns` is when the cycle tick it shows was due, 0 if unknown.
+ */
+static void request_feedback(struct swaybg_output *output, int64_t due_ns) {
+	struct swaybg_state *state = output->state;
+	if (!state->presentation || output->n_feedbacks >= MAX_PENDING_FEEDBACKS) {
+		return;
+	}
+	struct swaybg_feedback *fb = calloc(1, sizeof(struct swaybg_feedback));
+	if (!fb) {
+		return;
+	}
+	fb->output = output;
+	fb->feedback = wp_presentation_feedback(state->presentation,
+			output->surface);
+	fb->commit_ns = get_presentation_time_ns(state);
+	fb->due_ns = due_ns;
+	wp_presentation_feedback_add_listener(fb->feedback, &feedback_listener, fb);
+	wl_list_insert(&output->feedbacks, &fb->link);
+	output->n_feedbacks++;
+}
 
+/*
+ * How long commits take to be presented, to advance animations by the ticks
+ * due when a frame is shown rather than when it is drawn.
+ */
+static int64_t get_presentation_latency_us(const struct swaybg_output *output) {
+	int64_t latency = output->presentation.latency_avg_ns / 1000;
+	return latency < MAX_PACING_LATENCY_US ? latency : MAX_PACING_LATENCY_US;
+}
 
-void set_lbm_geometry_for_output( struct swaybg_output *output, int dst_width, int dst_height) {
-	output->lbm_scale = 1;
-	output->lbm_origin_y = 0;
-	output->lbm_origin_x = 0;
-	const struct lbm_image *image = output->config->image->anim;
-	if( !image ) {
+/*
+ * Request a frame callback, to be committed by the caller. Only one is ever
+ * pending, so that callbacks do not pile up.
+ */
+static void request_frame(struct swaybg_output *output) {
+	output->frame_request_time = 0;
+	if (output->frame_pending) {
 		return;
 	}
-	// Scale the image up until it matches the configured display mode
-	while(1) {
-		int image_width = image->width * output->lbm_scale;
-		int image_height = image->height * output->lbm_scale;
-		output->lbm_origin_x = (dst_width - image_width) / 2;
-		output->lbm_origin_y = (dst_height - image_height) / 2;
+	struct wl_callback *cb = wl_surface_frame(output->surface);
+	wl_callback_add_listener(cb, &wl_surface_frame_listener, output);
+	output->frame_pending = true;
+}
 
-		swaybg_log(LOG_DEBUG, "%s trying %d,%d at %dx", __FUNCTION__, output->lbm_origin_x, output->lbm_origin_y, output->lbm_scale);
+void set_lbm_geometry_for_output( struct swaybg_output *output, int dst_width, int dst_height) {
+	get_lbm_image_geometry(output->config->image->anim, output->config->mode,
+			dst_width, dst_height, &output->lbm_origin_x, &output->lbm_origin_y,
+			&output->lbm_scale);
+}
 
-		// Allow a small margin in case it *almost* fits at a certain scale
-		// TODO: allow providing this margin on the command line
-		const int margin = 100;
-		if ( output->config->mode == BACKGROUND_MODE_CENTER ) {
-			break;
-		} else if ( output->config->mode == BACKGROUND_MODE_FIT ) {
-			if ( output->lbm_origin_x <= margin || output->lbm_origin_y <= margin ) {
-				break;
-			}
-		} else if( output->config->mode == BACKGROUND_MODE_FILL ) {
-			if ( output->lbm_origin_x <= margin && output->lbm_origin_y <= margin ) {
-				break;
-			}
-		}
-		output->lbm_scale++;
+/*
+ * The range lists of the output's image culled to what it shows, made again
+ * when the placement or the pixels of the image change. Must not be called
+ * while a job of the output is in flight.
+ */
+static const struct lbm_layout *get_output_layout(struct swaybg_output *output,
+		const struct lbm_image *anim) {
+	if (!lbm_layout_matches(output->layout, anim, output->render_width,
+			output->render_height, output->buffer.stride,
+			output->lbm_origin_x, output->lbm_origin_y, output->lbm_scale)) {
+		lbm_layout_destroy(output->layout);
+		output->layout = lbm_layout_create(anim, output->render_width,
+				output->render_height, output->buffer.stride,
+				output->lbm_origin_x, output->lbm_origin_y, output->lbm_scale);
 	}
+	return output->layout;
 }
 
-static void render_frame(struct swaybg_output *output, cairo_surface_t *surface) {
+// Layouts only compare their image by its lists, so drop them with the image
+static void drop_output_layout(struct swaybg_output *output) {
+	lbm_layout_destroy(output->layout);
+	output->layout = NULL;
+}
 
-	int buffer_width = output->width, buffer_height = output->height, buffer_scale = output->scale;
+/*
+ * Compute the size of the buffer needed to cover the output, and the buffer
+ * scale it should be committed with.
+ */
+static void get_buffer_size(const struct swaybg_output *output,
+		int *buffer_width, int *buffer_height, int *buffer_scale) {
+	*buffer_width = output->width;
+	*buffer_height = output->height;
+	*buffer_scale = output->scale;
 
 	if (output->scale_120ths) {
-		buffer_width *= output->scale_120ths;
-		while (buffer_width % 120) buffer_width++;
-		buffer_width /= 120;
+		*buffer_width *= output->scale_120ths;
+		while (*buffer_width % 120) (*buffer_width)++;
+		*buffer_width /= 120;
 
-		buffer_height *= output->scale_120ths;
-		while (buffer_height % 120) buffer_height++;
-		buffer_height /= 120;
+		*buffer_height *= output->scale_120ths;
+		while (*buffer_height % 120) (*buffer_height)++;
+		*buffer_height /= 120;
 
 		// According to fractional_scale_v1 protocol, buffer scale should be 1 if there is a preferred scale,
 		// regardless of the output scale
-		buffer_scale = 1;
+		*buffer_scale = 1;
 	} else {
-		buffer_width *= output->scale;
-		buffer_height *= output->scale;
+		*buffer_width *= output->scale;
+		*buffer_height *= output->scale;
+	}
+}
+
+/*
+ * Offset along an axis in 1/256 pixels, bouncing back and forth between 0 and
+ * `range` pixels as `distance` (also in 1/256 pixels) grows.
+ */
+static wl_fixed_t get_pan_offset(uint64_t distance, int range) {
+	if (range <= 0) {
+		return 0;
+	}
+	uint64_t period = (uint64_t)range * 256 * 2;
+	uint64_t offset = distance % period;
+	return offset <= period / 2 ? offset : period - offset;
+}
+
+/*
+ * Show the window of the scene in the buffer for the given time. Only the
+ * viewport source moves, the pixels of the buffer are left alone.
+ */
+static void update_pan(struct swaybg_output *output, uint32_t time) {
+	int window_width, window_height, buffer_scale;
+	get_buffer_size(output, &window_width, &window_height, &buffer_scale);
+
+	// Frame times only start with the first frame callback
+	if (!output->pan_started && time != 0) {
+		output->pan_started = true;
+		output->pan_start_time = time;
+	}
+	uint64_t distance = 0;
+	if (output->pan_started) {
+		distance = (uint64_t)(time - output->pan_start_time) *
+			output->state->pan_speed * 256 / 1000;
+	}
+
+	wp_viewport_set_source(output->viewport,
+			get_pan_offset(distance, output->render_width - window_width),
+			get_pan_offset(distance, output->render_height - window_height),
+			wl_fixed_from_int(window_width), wl_fixed_from_int(window_height));
+	wp_viewport_set_destination(output->viewport, output->width, output->height);
+	output->panning = true;
+}
+
+static void handle_render_done(struct swaybg_output *output,
+		struct render_job *job);
+
+static void process_render_results(struct swaybg_state *state) {
+	if (!state->renderer) {
+		return;
+	}
+	struct render_job *job;
+	while ((job = render_thread_pop_completed(state->renderer))) {
+		handle_render_done(job->owner, job);
+	}
+}
+
+/*
+ * Wait for the job in flight for an output, if any, and discard its result.
+ * Must be called before the buffers or the image it renders are freed.
+ */
+static void cancel_render(struct swaybg_output *output) {
+	if (!output->render_pending) {
+		return;
+	}
+	if (!output->state->renderer) {
+		// The thread is gone, and so is the job
+		output->render_pending = false;
+		return;
+	}
+	output->render_cancelled = true;
+	render_thread_wait(output->state->renderer);
+	process_render_results(output->state);
+}
+
+static void run_render_job(struct swaybg_output *output,
+		struct render_job *job) {
+	output->render_pending = true;
+	if (!output->state->renderer ||
+			!render_thread_submit(output->state->renderer, job)) {
+		render_job_run(job);
+		handle_render_done(output, job);
+	}
+}
+
+static void submit_render_job(struct swaybg_output *output,
+		struct lbm_image *anim, enum render_job_type type) {
+	struct render_job *job = &output->render_job;
+	job->type = type;
+	job->owner = output;
+	job->image = *anim;
+	job->generation = lbm_pixels_generation(anim);
+	job->width = output->render_width;
+	job->height = output->render_height;
+	job->stride = output->buffer.stride;
+	job->origin_x = output->lbm_origin_x;
+	job->origin_y = output->lbm_origin_y;
+	job->scale = output->lbm_scale;
+	job->layout = get_output_layout(output, anim);
+	job->ring = NULL;
+	output->render_due_ns = output->config->image->cycle_due_ns;
+	run_render_job(output, job);
+}
+
+/*
+ * Queue the next step of pre-rendering `ring`, which is owned by the job until
+ * it completes.
+ */
+static void submit_ring_job(struct swaybg_output *output,
+		struct frame_ring *ring, enum render_job_type type) {
+	struct render_job *job = &output->render_job;
+	job->type = type;
+	job->owner = output;
+	job->ring = ring;
+	if (type == RENDER_JOB_RING_RENDER) {
+		// The front buffer does not change while the job is in flight
+		memcpy(job->old_lut, output->buffer_lut, sizeof(job->old_lut));
+		job->targets[0] = output->buffer.data;
+		job->n_targets = 1;
+	}
+	run_render_job(output, job);
+}
+
+/*
+ * Queue rendering of the current palette of the image into the back buffer,
+ * if it is free and out of date.
+ */
+static void schedule_render(struct swaybg_output *output) {
+	struct lbm_image *anim = output->config && output->config->image ?
+		output->config->image->anim : NULL;
+	if (!anim || output->frame_ring || output->render_pending ||
+			output->back_buffer_ready || !output->back_buffer.buffer ||
+			!output->back_buffer.available) {
+		return;
+	}
+	if (memcmp(output->back_buffer_lut, anim->lut, sizeof(anim->lut)) == 0 &&
+			output->back_buffer_generation == lbm_pixels_generation(anim)) {
+		return;
+	}
+	struct render_job *job = &output->render_job;
+	memcpy(job->old_lut, output->back_buffer_lut, sizeof(job->old_lut));
+	job->old_generation = output->back_buffer_generation;
+	job->targets[0] = output->back_buffer.data;
+	job->n_targets = 1;
+	submit_render_job(output, anim, RENDER_JOB_DELTA);
+}
+
+static void swap_buffers(struct swaybg_output *output) {
+	struct pool_buffer buffer = output->buffer;
+	output->buffer = output->back_buffer;
+	output->back_buffer = buffer;
+
+	uint32_t lut[256];
+	memcpy(lut, output->buffer_lut, sizeof(lut));
+	memcpy(output->buffer_lut, output->back_buffer_lut, sizeof(lut));
+	memcpy(output->back_buffer_lut, lut, sizeof(lut));
+	uint64_t generation = output->buffer_generation;
+	output->buffer_generation = output->back_buffer_generation;
+	output->back_buffer_generation = generation;
+	int64_t due_ns = output->buffer_due_ns;
+	output->buffer_due_ns = output->back_buffer_due_ns;
+	output->back_buffer_due_ns = due_ns;
+	output->back_buffer_ready = false;
+}
+
+static void log_first_frame(struct swaybg_output *output) {
+	if (output->first_frame_shown) {
+		return;
+	}
+	output->first_frame_shown = true;
+	swaybg_log(LOG_INFO, "Output %s: first frame committed %lu ms after start%s",
+			output->name, (unsigned long)(get_time_ms() - output->state->start_time),
+			output->placeholder_shown ? ", replacing the placeholder" : "");
+}
+
+/*
+ * Until its image is decoded, fill the output with a single pixel of the
+ * image's dominant color if it is cached, else of the configured color.
+ */
+static void show_placeholder(struct swaybg_output *output) {
+	struct swaybg_state *state = output->state;
+	if (!state->viewporter || !state->single_pixel_buffer_manager) {
+		return;
+	}
+	struct swaybg_image *image = output->config->image;
+	uint32_t color = 0x000000ff;
+	if (image && image->has_placeholder_color) {
+		color = image->placeholder_color;
+	} else if (output->config->color) {
+		color = output->config->color;
+	}
+	// Scale each 8 bit channel to 32 bits
+	uint32_t f = 0xFFFFFFFF / 0xFF;
+	struct wl_buffer *buffer = wp_single_pixel_buffer_manager_v1_create_u32_rgba_buffer(
+		state->single_pixel_buffer_manager, ((color >> 24) & 0xFF) * f,
+		((color >> 16) & 0xFF) * f, ((color >> 8) & 0xFF) * f, (color & 0xFF) * f);
+	wl_surface_set_buffer_scale(output->surface, 1);
+	wl_surface_attach(output->surface, buffer, 0, 0);
+	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+	wp_viewport_set_destination(output->viewport, output->width, output->height);
+	wl_surface_commit(output->surface);
+	wl_buffer_destroy(buffer);
+
+	output->placeholder_shown = true;
+	swaybg_log(LOG_INFO, "Output %s: placeholder committed %lu ms after start",
+			output->name, (unsigned long)(get_time_ms() - state->start_time));
+}
+
+/*
+ * Commit the whole front buffer.
+ */
+static void commit_buffer(struct swaybg_output *output) {
+	wl_surface_set_buffer_scale(output->surface, output->committed_scale);
+	wl_surface_attach(output->surface, output->buffer.buffer, 0, 0);
+	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
+	if (output->config->image && output->config->image->anim &&
+			output->config->mode == BACKGROUND_MODE_PAN) {
+		update_pan(output, output->last_requested_frame_time);
+	} else {
+		if (output->panning) {
+			wp_viewport_set_source(output->viewport, wl_fixed_from_int(-1),
+					wl_fixed_from_int(-1), wl_fixed_from_int(-1),
+					wl_fixed_from_int(-1));
+			output->panning = false;
+		}
+		wp_viewport_set_destination(output->viewport, output->width, output->height);
+	}
+
+	request_feedback(output, output->buffer_due_ns);
+	wl_surface_commit(output->surface);
+	output->buffer.available = false;
+	output->last_committed_frame_time = output->last_requested_frame_time;
+	log_first_frame(output);
+}
+
+static void handle_ring_done(struct swaybg_output *output,
+		struct render_job *job) {
+	struct frame_ring *ring = job->ring;
+	job->ring = NULL;
+	if (job->type == RENDER_JOB_RING_PLAN) {
+		if (ring->n_frames == 0 ||
+				!frame_ring_alloc(ring, output->state->shm)) {
+			frame_ring_destroy(ring);
+			return;
+		}
+		submit_ring_job(output, ring, RENDER_JOB_RING_RENDER);
+		return;
+	}
+	// Shown from the next frame callback
+	frame_ring_finish(ring);
+	output->frame_ring = ring;
+}
+
+static void handle_render_done(struct swaybg_output *output,
+		struct render_job *job) {
+	output->render_pending = false;
+	if (output->render_cancelled) {
+		output->render_cancelled = false;
+		frame_ring_destroy(job->ring);
+		job->ring = NULL;
+		return;
+	}
+	if (job->type == RENDER_JOB_RING_PLAN ||
+			job->type == RENDER_JOB_RING_RENDER) {
+		handle_ring_done(output, job);
+		return;
+	}
+	if (job->type == RENDER_JOB_DELTA) {
+		// Shown on the next frame callback
+		memcpy(output->back_buffer_lut, job->image.lut, sizeof(job->image.lut));
+		output->back_buffer_generation = job->generation;
+		output->back_buffer_due_ns = output->render_due_ns;
+		output->back_buffer_ready = true;
+		return;
+	}
+
+	memcpy(output->buffer_lut, job->image.lut, sizeof(job->image.lut));
+	memcpy(output->back_buffer_lut, job->image.lut, sizeof(job->image.lut));
+	output->buffer_generation = job->generation;
+	output->back_buffer_generation = job->generation;
+	output->buffer_due_ns = output->render_due_ns;
+	output->back_buffer_due_ns = output->render_due_ns;
+
+	struct lbm_image *anim = output->config->image ?
+		output->config->image->anim : NULL;
+	if (!anim) {
+		// The image was dropped, its jobs are cancelled before that
+		return;
+	}
+	frame_ring_destroy(output->frame_ring);
+	output->frame_ring = NULL;
+
+	request_frame(output);
+	swaybg_log(LOG_DEBUG, "Added listener for %d", output->wl_name);
+	commit_buffer(output);
+
+	if (output->state->frame_ring_budget) {
+		// Pre-rendered on the render thread on top of the committed
+		// buffer, which stays up until the frames are ready
+		struct frame_ring *ring = frame_ring_create(anim,
+				get_output_layout(output, anim), output->render_width,
+				output->render_height, output->buffer.stride,
+				output->buffer.format, output->lbm_origin_x,
+				output->lbm_origin_y, output->lbm_scale,
+				output->state->frame_ring_budget);
+		if (ring) {
+			submit_ring_job(output, ring, RENDER_JOB_RING_PLAN);
+		}
+	}
+}
+
+/*
+ * Draw a static image, or only the background color, into the front buffer.
+ */
+static void draw_static_background(struct swaybg_output *output,
+		cairo_surface_t *surface, int width, int height) {
+	if (surface && output->config->mode != BACKGROUND_MODE_SOLID_COLOR &&
+			resample_background_image(output->buffer.data,
+				output->buffer.format, output->buffer.stride, surface,
+				output->config->mode, output->config->color,
+				output->state->resample_filter, width, height)) {
+		// Written past cairo, which must not keep stale copies
+		if (output->buffer.surface) {
+			cairo_surface_mark_dirty(output->buffer.surface);
+		}
+		return;
+	}
+
+	cairo_t *cairo = get_buffer_cairo(&output->buffer);
+	cairo_save(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
+	cairo_paint(cairo);
+	cairo_restore(cairo);
+	if (output->config->mode == BACKGROUND_MODE_SOLID_COLOR) {
+		cairo_set_source_u32(cairo, output->config->color);
+		cairo_paint(cairo);
+		return;
+	}
+	if (output->config->color) {
+		cairo_set_source_u32(cairo, output->config->color);
+		cairo_paint(cairo);
+	}
+	if (surface) {
+		render_background_image(cairo, surface, output->config->mode,
+				width, height);
 	}
+}
+
+static void render_frame(struct swaybg_output *output, cairo_surface_t *surface) {
+
+	int buffer_width, buffer_height, buffer_scale;
+	get_buffer_size(output, &buffer_width, &buffer_height, &buffer_scale);
+
+	// The buffers are about to be rendered again, or replaced
+	cancel_render(output);
 
 	swaybg_log(LOG_DEBUG, "%s %s last committed size %ix%i, this buffer size %ix%i", __FUNCTION__, output->name,
 			output->committed_width, output->committed_height, buffer_width, buffer_height);
@@ -230,67 +793,114 @@ static void render_frame(struct swaybg_output *output, cairo_surface_t *surface)
 		wl_surface_commit(output->surface);
 
 		wl_buffer_destroy(buffer);
+		log_first_frame(output);
 		return;
 	}
 
-	if (output->committed_width != buffer_width ||
-			output->committed_height != buffer_height) {
+	// Panned scenes are rendered once at their full size
+	int render_width = buffer_width, render_height = buffer_height;
+	struct lbm_image *anim = output->config->image ?
+		output->config->image->anim : NULL;
+	if (anim) {
+		drop_output_layout(output);
+		set_lbm_geometry_for_output(output, buffer_width, buffer_height);
+		if (output->config->mode == BACKGROUND_MODE_PAN) {
+			render_width = anim->width * output->lbm_scale;
+			render_height = anim->height * output->lbm_scale;
+			buffer_scale = 1;
+		}
+	}
+
+	if (!output->buffer.buffer || output->render_width != render_width ||
+			output->render_height != render_height) {
 		if(output->buffer.buffer) {
 			destroy_buffer(&output->buffer);
 		}
 		swaybg_log(LOG_DEBUG, "Creating new buffer for %s", output->name);
 		if( !create_buffer(&output->buffer, output->state->shm,
-				buffer_width, buffer_height, WL_SHM_FORMAT_ARGB8888, output) )
+				render_width, render_height, output->state->pixel_format, output) )
 			return;
+		output->render_width = render_width;
+		output->render_height = render_height;
 	}
-
-	cairo_t *cairo = output->buffer.cairo;
-	cairo_save(cairo);
-	cairo_set_operator(cairo, CAIRO_OPERATOR_CLEAR);
-	cairo_paint(cairo);
-	cairo_restore(cairo);
-	if (output->config->mode == BACKGROUND_MODE_SOLID_COLOR) {
-		cairo_set_source_u32(cairo, output->config->color);
-		cairo_paint(cairo);
-	} else {
-		if (output->config->color) {
-			cairo_set_source_u32(cairo, output->config->color);
-			cairo_paint(cairo);
-		}
-
-		if (surface) {
-			render_background_image(cairo, surface,
-				output->config->mode, buffer_width, buffer_height);
+	// Only animations use a back buffer
+	if (output->back_buffer.buffer && (!anim ||
+			output->back_buffer.size != output->buffer.size)) {
+		destroy_buffer(&output->back_buffer);
+	}
+	if (anim && !output->back_buffer.buffer) {
+		if (!create_buffer(&output->back_buffer, output->state->shm,
+				render_width, render_height, output->state->pixel_format, output)) {
+			return;
 		}
 	}
+	output->back_buffer_ready = false;
 
+	// Animations are drawn whole by the render thread, margins included
+	if (!anim) {
+		draw_static_background(output, surface, render_width, render_height);
+	}
 
-	if(output->config->image->anim) {
-		if(output->native_buffer) {
-			free(output->native_buffer);
-		}
-		output->native_buffer = calloc(1, buffer_width*buffer_height*4);
-
-		set_lbm_geometry_for_output(output, buffer_width, buffer_height);
+	output->committed_width = buffer_width;
+	output->committed_height = buffer_height;
+	output->committed_scale = buffer_scale;
 
-		render_lbm_image(output->native_buffer, output->config->image->anim, buffer_width, buffer_height, output->lbm_origin_x, output->lbm_origin_y, output->lbm_scale);
-		struct wl_callback *cb = wl_surface_frame(output->surface);
-		wl_callback_add_listener(cb, &wl_surface_frame_listener, output);
-		swaybg_log(LOG_DEBUG, "Added listener for %d", output->wl_name);
-		memcpy(output->buffer.data, output->native_buffer, buffer_width * buffer_height * 4);
+	if (anim) {
+		// Rendered into both buffers on the render thread, then committed
+		// once done
+		struct render_job *job = &output->render_job;
+		job->background = pixel_format_convert(output->state->pixel_format,
+				background_color_argb(output->config->color));
+		job->targets[0] = output->buffer.data;
+		job->targets[1] = output->back_buffer.data;
+		job->n_targets = 2;
+		submit_render_job(output, anim, RENDER_JOB_FULL);
+		return;
 	}
 
-	wl_surface_set_buffer_scale(output->surface, buffer_scale);
-	wl_surface_attach(output->surface, output->buffer.buffer, 0, 0);
-	wl_surface_damage_buffer(output->surface, 0, 0, INT32_MAX, INT32_MAX);
-	wp_viewport_set_destination(output->viewport, output->width, output->height);
+	commit_buffer(output);
+}
 
-	wl_surface_commit(output->surface);
-	output->last_committed_frame_time = output->last_requested_frame_time;
+/*
+ * Determine the size static images need to be decoded at, so that they are
+ * never decoded at a larger resolution than any output showing them needs.
+ * Outputs that use different modes share the bounding size in fill mode, which
+ * covers fit and stretch too. Center and tile need the native resolution.
+ */
+static void get_decode_target(const struct swaybg_state *state,
+		const struct swaybg_image *image, enum background_mode *mode,
+		int *decode_width, int *decode_height) {
+	*decode_width = 0;
+	*decode_height = 0;
+	*mode = BACKGROUND_MODE_INVALID;
 
-	output->committed_width = buffer_width;
-	output->committed_height = buffer_height;
-	output->committed_scale = buffer_scale;
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->config || output->config->image != image) {
+			continue;
+		}
+		enum background_mode output_mode = output->config->mode;
+		if (output_mode == BACKGROUND_MODE_CENTER ||
+				output_mode == BACKGROUND_MODE_TILE) {
+			*decode_width = 0;
+			*decode_height = 0;
+			return;
+		}
+		if (*mode == BACKGROUND_MODE_INVALID) {
+			*mode = output_mode;
+		} else if (*mode != output_mode) {
+			*mode = BACKGROUND_MODE_FILL;
+		}
+
+		int buffer_width, buffer_height, buffer_scale;
+		get_buffer_size(output, &buffer_width, &buffer_height, &buffer_scale);
+		if (buffer_width > *decode_width) {
+			*decode_width = buffer_width;
+		}
+		if (buffer_height > *decode_height) {
+			*decode_height = buffer_height;
+		}
+	}
 }
 
 // TODO: Update the driver only when the connected outputs change. Dont need to do this every frame.
@@ -304,27 +914,75 @@ struct swaybg_output *get_driver_for_image( const struct swaybg_state *state, co
 	return NULL;
 }
 
+/*
+ * Whether a render job of an output showing the image is in flight. The frames
+ * of an ANIM change the pixels of the image, so they wait for it.
+ */
+static bool image_render_pending(const struct swaybg_state *state,
+		const struct swaybg_image *image) {
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->config && output->config->image == image &&
+				output->render_pending) {
+			return true;
+		}
+	}
+	return false;
+}
+
 static void render_animated_frame(struct swaybg_output* output, struct swaybg_image *image)
 {
 	swaybg_log(LOG_DEBUG, "%s  \t now:%d\t last cycle time:%d\t last image change time:%d",
 			output->name, output->last_requested_frame_time, image->last_cycle_time, image->last_update_time);
 	struct lbm_image* anim = image->anim;
 
-	// Advance the animation if the last cycle was more than 1s/60 ago (per ILBM spec)
-	// TODO: Dont use a hardcoded constant here for timing
+	// Advance the animation by the ticks that are due by this frame. Each tick
+	// is taken by the frame closest to it, so fast outputs do not cycle early
+	// and slow ones take several ticks per frame.
 	const uint32_t this_frame_time = output->last_requested_frame_time;
-	bool do_cycle = image->last_cycle_time + 8 < this_frame_time;
-	if (do_cycle) {
-		if (cycle_palette(anim) ) {
+	const int64_t frame_period = get_frame_period_us(output);
+	// Slowed down animations take longer over each tick
+	const int64_t tick_us = (int64_t)CYCLE_TICK_US * output->state->policy.slowdown;
+	if (!image->cycle_started) {
+		// First frame since the image was loaded or the animation resumed
+		image->last_cycle_time = this_frame_time;
+		image->last_cycle_us = 0;
+		image->last_update_time = this_frame_time;
+		image->cycle_due_ns = output->frame_done_ns;
+		image->cycle_started = true;
+	}
+	// The frame is shown this long after it is committed, so it takes the
+	// ticks due by then
+	const int64_t latency_us = get_presentation_latency_us(output);
+	int64_t since_tick = (int64_t)(int32_t)(this_frame_time - image->last_cycle_time) * 1000 -
+		image->last_cycle_us + latency_us;
+	// Under an fps cap, ticks that come due before the next update is allowed
+	// are left to pile up, and are then taken together
+	const int64_t min_update_us = get_min_update_us(output->state);
+	int64_t since_update = (int64_t)(int32_t)(this_frame_time - image->last_update_time) * 1000;
+	bool throttled = output->state->policy.paused ||
+		since_update + frame_period / 2 < min_update_us ||
+		(anim->frames && image_render_pending(output->state, image));
+	// All ticks due are taken at once, however late the frame is, so the
+	// animation keeps to the wall clock at any frame rate
+	unsigned long n_ticks = 0;
+	if (!throttled && since_tick + frame_period / 2 >= tick_us) {
+		n_ticks = (since_tick + frame_period / 2) / tick_us;
+		if (lbm_advance(anim, n_ticks)) {
 			image->last_update_time = this_frame_time;
+			since_update = 0;
 		}
-		image->last_cycle_time = this_frame_time;
-		swaybg_log(LOG_DEBUG, "%s", "FRAME");
+		uint64_t elapsed_us = image->last_cycle_us + (uint64_t)n_ticks * tick_us;
+		image->last_cycle_time += elapsed_us / 1000;
+		image->last_cycle_us = elapsed_us % 1000;
+		since_tick -= (int64_t)n_ticks * tick_us;
+		image->cycle_due_ns = output->frame_done_ns -
+			(since_tick - latency_us) * 1000;
 	}
+	bool do_cycle = n_ticks > 0;
 
 	// Render the image to our buffer if it is less than one frame old
-	// TODO: This should use the output's frame period instead of assuming 60Hz
-	bool do_render = (image->last_update_time + 16 > this_frame_time);
+	bool do_render = image->last_update_time + (frame_period + 999) / 1000 > this_frame_time;
 
 	// Skip rendering if this is a duplicate frame callback
 	do_render = do_render  && output->last_committed_frame_time < output->last_requested_frame_time;
@@ -334,54 +992,77 @@ static void render_animated_frame(struct swaybg_output* output, struct swaybg_im
 			do_render ? "YES" : "NO ");
 
 
-	if (do_render) {
-		bool buffer_size_changed = false; // TODO: check if size has changed
-		if( buffer_size_changed || !output->buffer.available ) {
-			swaybg_log(LOG_DEBUG, "%s No buffer available. Skipping frame", __FUNCTION__);
-			// Can't use the current buffer. Either it's the wrong size or the compositor hasn't released it
-			// If the buffer isn't free yet, just hope it will be released eventually. Seems to be the case.
-			// If the compositor ever fails to release a buffer, the animation will stop. Should handle this somehow.
-			// Could also allocate a new buffer, but doing that a lot might cause us to fall further behind
-			//create_buffer(&output->buffer, output->state->shm, surface_width, surface_height, WL_SHM_FORMAT_ARGB8888, output);
-			return;
-		}
-
+	if (do_render && output->frame_ring) {
+		// All frames are pre-rendered, only the buffer needs to be swapped
 		struct bounding_box damage;
-		int buffer_width = output->width, buffer_height = output->height, buffer_scale = output->scale;
-
-		// TODO: DRY
-		if (output->scale_120ths) {
-			buffer_width *= output->scale_120ths;
-			while (buffer_width % 120) buffer_width++;
-			buffer_width /= 120;
-
-			buffer_height *= output->scale_120ths;
-			while (buffer_height % 120) buffer_height++;
-			buffer_height /= 120;
-
-			// According to fractional_scale_v1 protocol, buffer scale should be 1 if there is a preferred scale,
-			// regardless of the output scale
-			buffer_scale = 1;
-		} else {
-			buffer_width *= output->scale;
-			buffer_height *= output->scale;
+		struct frame_ring_frame *frame =
+			frame_ring_update(output->frame_ring, anim, &damage);
+		if (frame) {
+			request_feedback(output, image->cycle_due_ns);
+			wl_surface_attach(output->surface, frame->buffer, 0, 0);
+			wl_surface_damage_buffer(output->surface,
+					damage.min_x,
+					damage.min_y,
+					damage.max_x - damage.min_x,
+					damage.max_y - damage.min_y);
 		}
-
-		render_delta(output->buffer.data, anim, buffer_width, buffer_height, output->lbm_origin_x, output->lbm_origin_y, output->lbm_scale, &damage, false);
-		wl_surface_set_buffer_scale(output->surface, buffer_scale);
+	} else if (!output->frame_ring && output->back_buffer_ready &&
+			output->last_committed_frame_time < output->last_requested_frame_time) {
+		// The frame was rendered ahead of this callback, only swap buffers.
+		// The back buffer may be more than one palette step ahead.
+		struct bounding_box damage, frame_damage;
+		lut_damage(anim, output->buffer_lut, output->back_buffer_lut,
+				output->render_width, output->render_height,
+				output->lbm_origin_x, output->lbm_origin_y, output->lbm_scale, &damage);
+		pixel_changes_damage(anim, output->buffer_generation,
+				output->back_buffer_generation, output->render_width,
+				output->render_height, output->lbm_origin_x,
+				output->lbm_origin_y, output->lbm_scale, &frame_damage);
+		merge_damage(&damage, &frame_damage);
+		swap_buffers(output);
+		request_feedback(output, output->buffer_due_ns);
+		wl_surface_set_buffer_scale(output->surface, output->committed_scale);
 		wl_surface_attach(output->surface, output->buffer.buffer, 0, 0);
 
-		wl_surface_damage_buffer(output->surface,
-				damage.min_x,
-				damage.min_y,
-				damage.max_x - damage.min_x,
-				damage.max_y - damage.min_y);
+		if (damage.min_x < damage.max_x && damage.min_y < damage.max_y) {
+			wl_surface_damage_buffer(output->surface,
+					damage.min_x,
+					damage.min_y,
+					damage.max_x - damage.min_x,
+					damage.max_y - damage.min_y);
+		}
 		output->buffer.available = false;
-		wp_viewport_set_destination( output->viewport, output->width, output->height);
+		if (!output->panning) {
+			wp_viewport_set_destination( output->viewport, output->width, output->height);
+		}
+	}
+	// Render the next frame while waiting for the next callback
+	schedule_render(output);
+	if (output->panning) {
+		update_pan(output, this_frame_time);
 	}
 
-	struct wl_callback *cb = wl_surface_frame(output->surface);
-	wl_callback_add_listener(cb, &wl_surface_frame_listener, output);
+	// Keep going every frame while there is something to show, else sleep
+	// until the frame nearest to the next palette change
+	unsigned long ticks = lbm_ticks_until_change(anim);
+	if (output->panning || output->render_pending || output->back_buffer_ready) {
+		request_frame(output);
+	} else if (ticks > 0 && !output->state->policy.paused) {
+		if (ticks > MAX_SLEEP_TICKS) {
+			ticks = MAX_SLEEP_TICKS;
+		}
+		// Leave a millisecond for timer slack
+		int64_t delay = (int64_t)ticks * tick_us - since_tick - frame_period / 2 - 1000;
+		int64_t cap_delay = min_update_us - since_update - frame_period / 2 - 1000;
+		if (delay < cap_delay) {
+			delay = cap_delay;
+		}
+		if (delay < frame_period) {
+			request_frame(output);
+		} else {
+			output->frame_request_time = get_time_ms() + delay / 1000;
+		}
+	}
 
 	wl_surface_commit(output->surface);
 	output->last_committed_frame_time = output->last_requested_frame_time;
@@ -392,9 +1073,15 @@ static void wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t t
 
 	struct swaybg_output *output = data;
 	output->dirty = false;
+	output->frame_pending = false;
+	if (!output->config->image || !output->config->image->anim) {
+		// No longer animated
+		return;
+	}
 	// TODO this should also be called from the configure callback. Otherwise there is a single frame at the wrong scale
 
 	output->last_requested_frame_time = time;
+	output->frame_done_ns = get_presentation_time_ns(output->state);
 	if (output->last_requested_frame_time == output->last_committed_frame_time) {
 		swaybg_log(LOG_DEBUG, "Duplicate frame detected! %s %s requested:%d last committed:%d", __FUNCTION__, output->name, output->last_requested_frame_time, output->last_committed_frame_time);
 	}
@@ -413,9 +1100,43 @@ static void destroy_swaybg_image(struct swaybg_image *image) {
 	if (image->anim) {
 		free_lbm_image(image->anim);
 	}
+	free(image->path);
 	free(image);
 }
 
+/*
+ * Find the image loaded from `path`, or add one to be loaded.
+ */
+static struct swaybg_image *get_swaybg_image(struct swaybg_state *state,
+		const char *path) {
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (strcmp(image->path, path) == 0) {
+			return image;
+		}
+	}
+	image = calloc(1, sizeof(struct swaybg_image));
+	image->path = strdup(path);
+	struct thumbnail thumb;
+	if (thumbnail_cache_read(image->path, &thumb)) {
+		image->placeholder_color = thumbnail_dominant_color(&thumb);
+		image->has_placeholder_color = true;
+	}
+	wl_list_insert(&state->images, &image->link);
+	return image;
+}
+
+static bool image_in_use(const struct swaybg_state *state,
+		const struct swaybg_image *image) {
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, &state->configs, link) {
+		if (config->image == image) {
+			return true;
+		}
+	}
+	return false;
+}
+
 static void destroy_swaybg_output_config(struct swaybg_output_config *config) {
 	if (!config) {
 		return;
@@ -429,23 +1150,35 @@ static void destroy_swaybg_output(struct swaybg_output *output) {
 	if (!output) {
 		return;
 	}
+	cancel_render(output);
 	wl_list_remove(&output->link);
+	struct swaybg_feedback *fb, *tmp;
+	wl_list_for_each_safe(fb, tmp, &output->feedbacks, link) {
+		destroy_feedback(fb);
+	}
 	if (output->layer_surface != NULL) {
 		zwlr_layer_surface_v1_destroy(output->layer_surface);
 	}
 	if (output->surface != NULL) {
 		wl_surface_destroy(output->surface);
 	}
-	if (output->native_buffer != NULL) {
-		free(output->native_buffer);
-	}
+	frame_ring_destroy(output->frame_ring);
+	lbm_layout_destroy(output->layout);
 	destroy_buffer(&output->buffer);
+	destroy_buffer(&output->back_buffer);
 	wl_output_destroy(output->wl_output);
 	free(output->name);
 	free(output->identifier);
 	free(output);
 }
 
+// The output's buffer changes size, its image may decode at the new one
+static void retry_failed_image(struct swaybg_output *output) {
+	if (output->config && output->config->image) {
+		output->config->image->load_failed = false;
+	}
+}
+
 static void layer_surface_configure(void *data,
 		struct zwlr_layer_surface_v1 *surface,
 		uint32_t serial, uint32_t width, uint32_t height) {
@@ -466,6 +1199,7 @@ static void layer_surface_configure(void *data,
 		swaybg_log(LOG_DEBUG, "Dirtying output %s because of configure{%p,%d,%d,%d}. Output surface needs ack",
 				output->name, surface, width, height, serial);
 		output->dirty = true;
+		retry_failed_image(output);
 	}
 }
 
@@ -488,9 +1222,15 @@ static void output_geometry(void *data, struct wl_output *output, int32_t x,
 	// Who cares
 }
 
-static void output_mode(void *data, struct wl_output *output, uint32_t flags,
+static void output_mode(void *data, struct wl_output *wl_output, uint32_t flags,
 		int32_t width, int32_t height, int32_t refresh) {
-	// Who cares
+	struct swaybg_output *output = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		// Drives frame pacing of animations
+		output->refresh = refresh;
+		swaybg_log(LOG_DEBUG, "Output %s refreshes at %d mHz",
+				output->name ? output->name : "(unnamed)", refresh);
+	}
 }
 
 void preferred_scale( void *data, struct wp_fractional_scale_v1 *wp_fractional_scale_v1, uint32_t scale ) {
@@ -514,6 +1254,14 @@ static void create_layer_surface(struct swaybg_output *output) {
 	wl_surface_set_input_region(output->surface, input_region);
 	wl_region_destroy(input_region);
 
+	// Buffers are always opaque, so let the compositor skip blending
+	struct wl_region *opaque_region =
+		wl_compositor_create_region(output->state->compositor);
+	assert(opaque_region);
+	wl_region_add(opaque_region, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_set_opaque_region(output->surface, opaque_region);
+	wl_region_destroy(opaque_region);
+
 	output->fractional_scale = wp_fractional_scale_manager_v1_get_fractional_scale(
 			output->state->fractional_scale_manager, output->surface);
 	wp_fractional_scale_v1_add_listener(output->fractional_scale,
@@ -560,6 +1308,7 @@ static void output_scale(void *data, struct wl_output *wl_output,
 	if (output->scale != scale && output->width > 0 && output->height > 0) {
 		swaybg_log(LOG_DEBUG, "Dirtying output %s because of output scale: %d, (was %d)", output->name, scale, output->scale);
 		output->dirty = true;
+		retry_failed_image(output);
 	}
 	output->scale = scale;
 }
@@ -605,17 +1354,43 @@ static void output_description(void *data, struct wl_output *wl_output,
 		strncpy(output->identifier, description, length);
 		output->identifier[length - 1] = '\0';
 
-		find_config(output, output->identifier);
+		find_config(output, output->identifier);
+	}
+}
+
+static const struct wl_output_listener output_listener = {
+	.geometry = output_geometry,
+	.mode = output_mode,
+	.done = output_done,
+	.scale = output_scale,
+	.name = output_name,
+	.description = output_description,
+};
+
+static void shm_format(void *data, struct wl_shm *shm, uint32_t wl_format) {
+	struct swaybg_state *state = data;
+	enum pixel_format format = pixel_format_from_wl_shm(wl_format);
+	if (format != PIXEL_FORMAT_INVALID) {
+		state->shm_formats |= 1 << format;
+	}
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = shm_format,
+};
+
+static void presentation_clock_id(void *data,
+		struct wp_presentation *presentation, uint32_t clk_id) {
+	struct swaybg_state *state = data;
+	struct timespec ts;
+	// Keep to CLOCK_MONOTONIC if the clock cannot be read
+	if (clock_gettime(clk_id, &ts) == 0) {
+		state->presentation_clock = clk_id;
 	}
 }
 
-static const struct wl_output_listener output_listener = {
-	.geometry = output_geometry,
-	.mode = output_mode,
-	.done = output_done,
-	.scale = output_scale,
-	.name = output_name,
-	.description = output_description,
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_clock_id,
 };
 
 static void handle_global(void *data, struct wl_registry *registry,
@@ -626,10 +1401,12 @@ static void handle_global(void *data, struct wl_registry *registry,
 			wl_registry_bind(registry, name, &wl_compositor_interface, 4);
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+		wl_shm_add_listener(state->shm, &shm_listener, state);
 	} else if (strcmp(interface, wl_output_interface.name) == 0) {
 		struct swaybg_output *output = calloc(1, sizeof(struct swaybg_output));
 		output->state = state;
 		output->wl_name = name;
+		wl_list_init(&output->feedbacks);
 		output->wl_output =
 			wl_registry_bind(registry, name, &wl_output_interface, 4);
 		wl_output_add_listener(output->wl_output, &output_listener, output);
@@ -648,6 +1425,11 @@ static void handle_global(void *data, struct wl_registry *registry,
 			wp_fractional_scale_manager_v1_interface.name) == 0) {
 		state->fractional_scale_manager = wl_registry_bind(registry, name,
 				&wp_fractional_scale_manager_v1_interface, 1);
+	} else if (strcmp(interface, wp_presentation_interface.name) == 0) {
+		state->presentation = wl_registry_bind(registry, name,
+				&wp_presentation_interface, 1);
+		wp_presentation_add_listener(state->presentation,
+				&presentation_listener, state);
 	}
 }
 
@@ -670,6 +1452,492 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = handle_global_remove,
 };
 
+/*
+ * Render the frames of outputs showing a freshly decoded image, then drop the
+ * decoded surface of static images; it is reloaded if an output changes size.
+ */
+static void handle_image_loaded(struct swaybg_state *state,
+		struct image_load_job *job) {
+	struct swaybg_image *image = job->image;
+	image->loading = false;
+	if (!image_in_use(state, image)) {
+		// Replaced through the control socket while it was loading
+		if (job->anim) {
+			free_lbm_image(job->anim);
+			job->anim = NULL;
+		}
+		destroy_swaybg_image(image);
+		return;
+	}
+	struct swaybg_output *output;
+	if (image->anim) {
+		// Jobs in flight read the pixels of the old image
+		wl_list_for_each(output, &state->outputs, link) {
+			if (!output->config || output->config->image != image) {
+				continue;
+			}
+			if (output->render_pending) {
+				cancel_render(output);
+				output->dirty = true;
+			}
+			drop_output_layout(output);
+		}
+		free_lbm_image(image->anim);
+	}
+	image->anim = job->anim;
+	job->anim = NULL;
+	if (image->anim) {
+		lbm_set_pixel_format(image->anim, state->pixel_format);
+		lbm_set_smooth(image->anim, state->smooth);
+		image->cycle_started = false;
+		size_t pixels, ranges;
+		lbm_image_memory(image->anim, &pixels, &ranges);
+		swaybg_log(LOG_DEBUG, "Loaded %s: %zu bytes of pixels, %zu bytes of "
+				"range lists, from a %zu byte IFF chunk tree", image->path,
+				pixels, ranges, image->anim->iff_size);
+	}
+	// Checked for every output before any renders, as their jobs share the
+	// pixels of the image
+	wl_list_for_each(output, &state->outputs, link) {
+		if (image->anim && output->config && output->config->image == image &&
+				output->config->mode != BACKGROUND_MODE_FIT &&
+				output->config->mode != BACKGROUND_MODE_FILL &&
+				output->config->mode != BACKGROUND_MODE_PAN &&
+				output->config->mode != BACKGROUND_MODE_CENTER) {
+			// TODO: tiling should be supported too
+			swaybg_log(LOG_ERROR, "Only modes \"fit\", \"fill\", \"center\" and \"pan\" are supported for LBM images");
+			free_lbm_image(image->anim);
+			image->anim = NULL;
+		}
+	}
+	image->load_failed = !image->anim && !job->surface;
+	if (image->load_failed) {
+		// Outputs waiting for it show their color instead, until the
+		// image or their size changes. The others keep what they show.
+		wl_list_for_each(output, &state->outputs, link) {
+			if (!output->config || output->config->image != image ||
+					!output->dirty) {
+				continue;
+			}
+			output->dirty = false;
+			render_frame(output, NULL);
+		}
+		return;
+	}
+
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->config || output->config->image != image) {
+			continue;
+		}
+		if (output->dirty) {
+			if ( image->anim ) {
+				image->anim->userdata = output;
+			}
+			output->dirty = false;
+			swaybg_log(LOG_DEBUG, "%d going to render a whole new frame for %s", __LINE__, output->name);
+			render_frame(output, job->surface);
+		}
+	}
+}
+
+/*
+ * Print memory usage by class, then broken down per image and per output.
+ */
+static void write_memory_stats(struct swaybg_state *state, FILE *f) {
+	memstats_print(f);
+
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (!image->anim) {
+			continue;
+		}
+		size_t pixels, ranges;
+		lbm_image_memory(image->anim, &pixels, &ranges);
+		fprintf(f, "  image %s: %zu bytes of pixels, %zu bytes of range lists "
+				"(IFF chunk tree was %zu bytes)\n", image->path, pixels,
+				ranges, image->anim->iff_size);
+	}
+
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		size_t frame_ring_size =
+			output->frame_ring ? output->frame_ring->block.size : 0;
+		fprintf(f, "  output %s: %zu bytes of shm buffers, %zu bytes of frame "
+				"ring, %zu bytes of culled range lists\n",
+				output->name ? output->name : "(unnamed)",
+				output->buffer.size + output->back_buffer.size,
+				frame_ring_size, lbm_layout_memory(output->layout));
+	}
+}
+
+// Written to by the SIGUSR1 handler, polled by the main loop
+static int stats_signal_fds[2] = { -1, -1 };
+
+static void handle_stats_signal(int signal) {
+	int saved_errno = errno;
+	char c = 0;
+	if (write(stats_signal_fds[1], &c, 1) < 0) {
+		// The pipe is full, a dump is already pending
+	}
+	errno = saved_errno;
+}
+
+static bool setup_stats_signal(void) {
+	if (pipe(stats_signal_fds) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create signal pipe");
+		return false;
+	}
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(stats_signal_fds[i], F_GETFL);
+		fcntl(stats_signal_fds[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(stats_signal_fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	struct sigaction sa = {
+		.sa_handler = handle_stats_signal,
+		.sa_flags = SA_RESTART,
+	};
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to install SIGUSR1 handler");
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Request a frame from every animated output, so that changes to the pacing
+ * of animations apply right away rather than after they wake up.
+ */
+static void wake_animations(struct swaybg_state *state) {
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->surface && output->config && output->config->image &&
+				output->config->image->anim) {
+			request_frame(output);
+			wl_surface_commit(output->surface);
+		}
+	}
+}
+
+/*
+ * Merge the settings made through the control socket with the policy of the
+ * governor, and apply the result to animations.
+ */
+static void update_policy(struct swaybg_state *state) {
+	struct governor_policy policy = GOVERNOR_POLICY_FULL;
+	policy.paused = state->paused;
+	policy.max_fps = state->max_fps;
+	if (state->governor) {
+		governor_policy_merge(&policy, governor_get_policy(state->governor));
+	}
+	if (governor_policy_equal(&policy, &state->policy)) {
+		return;
+	}
+	if (state->policy.paused && !policy.paused) {
+		// Carry on from where the animations stopped
+		struct swaybg_image *image;
+		wl_list_for_each(image, &state->images, link) {
+			image->cycle_started = false;
+		}
+	}
+	state->policy = policy;
+	wake_animations(state);
+}
+
+static void set_smooth(struct swaybg_state *state, bool smooth) {
+	state->smooth = smooth;
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (image->anim) {
+			lbm_set_smooth(image->anim, smooth);
+		}
+	}
+	// Pre-rendered frames no longer match the palette, nor do those being
+	// rendered
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->frame_ring ||
+				(output->render_pending && output->render_job.ring)) {
+			output->dirty = true;
+		}
+	}
+	wake_animations(state);
+}
+
+/*
+ * Show the image at `path` on the output named `output_name`, or on every
+ * output if it is NULL. Images no output shows any more are freed.
+ */
+static bool set_image(struct swaybg_state *state, const char *path,
+		const char *output_name, FILE *reply) {
+	if (access(path, R_OK) != 0) {
+		fprintf(reply, "error: cannot read %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	struct swaybg_output *output;
+	if (output_name) {
+		bool found = false;
+		wl_list_for_each(output, &state->outputs, link) {
+			found = found || (output->name && strcmp(output->name, output_name) == 0);
+		}
+		if (!found) {
+			fprintf(reply, "error: no output named %s\n", output_name);
+			return false;
+		}
+	}
+
+	struct swaybg_image *image = get_swaybg_image(state, path);
+	// The file may have been fixed since
+	image->load_failed = false;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->config || (output_name && (!output->name ||
+				strcmp(output->name, output_name) != 0))) {
+			continue;
+		}
+		struct swaybg_output_config *config = output->config;
+		if (output_name && strcmp(config->output, output_name) != 0) {
+			// Shared with other outputs, give this one its own
+			struct swaybg_output_config *own =
+				calloc(1, sizeof(struct swaybg_output_config));
+			own->output = strdup(output_name);
+			own->mode = config->mode;
+			own->color = config->color;
+			wl_list_insert(&state->configs, &own->link);
+			output->config = own;
+		}
+		// The buffers and pre-rendered frames are of the old image
+		cancel_render(output);
+		drop_output_layout(output);
+		frame_ring_destroy(output->frame_ring);
+		output->frame_ring = NULL;
+		output->committed_width = 0;
+		output->committed_height = 0;
+		output->dirty = true;
+	}
+	struct swaybg_output_config *config;
+	wl_list_for_each(config, &state->configs, link) {
+		if (output_name && strcmp(config->output, output_name) != 0) {
+			continue;
+		}
+		config->image = image;
+		config->image_path = image->path;
+		if (config->mode == BACKGROUND_MODE_SOLID_COLOR) {
+			config->mode = BACKGROUND_MODE_FILL;
+		}
+	}
+
+	// Images still being decoded are freed once the loader is done with them
+	struct swaybg_image *tmp;
+	wl_list_for_each_safe(image, tmp, &state->images, link) {
+		if (!image->loading && !image_in_use(state, image)) {
+			destroy_swaybg_image(image);
+		}
+	}
+	return true;
+}
+
+static void write_animation_stats(struct swaybg_state *state, FILE *f) {
+	const struct governor_policy *policy = &state->policy;
+	fprintf(f, "Animation: %s, %s cycling, ", policy->paused ? "paused" : "running",
+			state->smooth ? "smooth" : "stepped");
+	if (policy->slowdown > 1) {
+		fprintf(f, "1/%u rate, ", policy->slowdown);
+	}
+	if (policy->max_fps) {
+		fprintf(f, "at most %u fps\n", policy->max_fps);
+	} else {
+		fprintf(f, "uncapped\n");
+	}
+	if (state->governor) {
+		fprintf(f, "  governor: on %s%s\n",
+				governor_on_battery(state->governor) ? "battery" : "mains",
+				governor_busy(state->governor) ? ", system is busy" : "");
+	}
+	struct swaybg_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		if (image->anim) {
+			fprintf(f, "  image %s: %lu ticks, %lu palette changes\n",
+					image->path, image->anim->tick_count,
+					image->anim->frame_count);
+		}
+	}
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		fprintf(f, "  output %s: %s, refresh %d mHz%s\n",
+				output->name ? output->name : "(unnamed)",
+				output->config && output->config->image_path ?
+					output->config->image_path : "solid color",
+				output->refresh,
+				output->frame_ring ? ", pre-rendered" : "");
+		if (state->presentation) {
+			presentation_stats_print(&output->presentation, f);
+		}
+	}
+}
+
+static void handle_control_request(struct swaybg_state *state,
+		struct control_request *request) {
+	FILE *f = request->reply;
+	int argc = request->argc;
+	char **argv = request->argv;
+	if (argc == 0) {
+		fprintf(f, "error: empty or unreadable request\n");
+		return;
+	}
+	swaybg_log(LOG_DEBUG, "Control request: %s", argv[0]);
+
+	if (strcmp(argv[0], "pause") == 0 && argc == 1) {
+		state->paused = true;
+		update_policy(state);
+	} else if (strcmp(argv[0], "resume") == 0 && argc == 1) {
+		state->paused = false;
+		update_policy(state);
+	} else if (strcmp(argv[0], "fps") == 0 && argc == 2) {
+		char *end;
+		unsigned long fps = strtoul(argv[1], &end, 10);
+		if (*end != '\0' || fps > 1000) {
+			fprintf(f, "error: %s is not a valid frame rate\n", argv[1]);
+			return;
+		}
+		state->max_fps = fps;
+		update_policy(state);
+	} else if (strcmp(argv[0], "smooth") == 0 && argc == 1) {
+		set_smooth(state, true);
+	} else if (strcmp(argv[0], "stepped") == 0 && argc == 1) {
+		set_smooth(state, false);
+	} else if (strcmp(argv[0], "image") == 0 && (argc == 2 || argc == 3)) {
+		if (!set_image(state, argv[1], argc == 3 ? argv[2] : NULL, f)) {
+			return;
+		}
+	} else if (strcmp(argv[0], "stats") == 0 && argc == 1) {
+		fprintf(f, "ok\n");
+		write_animation_stats(state, f);
+		fprintf(f, "Memory usage:\n");
+		write_memory_stats(state, f);
+		return;
+	} else {
+		fprintf(f, "error: unknown command or wrong arguments: %s\n", argv[0]);
+		return;
+	}
+	fprintf(f, "ok\n");
+}
+
+/*
+ * Time until the next scheduled frame callback request, for poll().
+ */
+static int get_poll_timeout(struct swaybg_state *state) {
+	uint64_t now = get_time_ms();
+	int timeout = state->governor ?
+		governor_get_timeout(state->governor, now) : -1;
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (!output->frame_request_time) {
+			continue;
+		}
+		int delay = output->frame_request_time > now ?
+			(int)(output->frame_request_time - now) : 0;
+		if (timeout < 0 || delay < timeout) {
+			timeout = delay;
+		}
+	}
+	return timeout;
+}
+
+static void request_scheduled_frames(struct swaybg_state *state) {
+	uint64_t now = get_time_ms();
+	struct swaybg_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (output->frame_request_time && output->frame_request_time <= now) {
+			request_frame(output);
+			wl_surface_commit(output->surface);
+		}
+	}
+}
+
+/*
+ * Wait for and dispatch Wayland events, while also waking up for images
+ * finished by the loader threads, for requests to dump statistics and for
+ * control requests. Returns -1 if the connection failed.
+ */
+static int dispatch_events(struct swaybg_state *state) {
+	while (wl_display_prepare_read(state->display) != 0) {
+		if (wl_display_dispatch_pending(state->display) < 0) {
+			return -1;
+		}
+	}
+	if (wl_display_flush(state->display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(state->display);
+		return -1;
+	}
+
+	struct pollfd fds[] = {
+		{ .fd = wl_display_get_fd(state->display), .events = POLLIN },
+		{ .fd = image_loader_get_fd(state->loader), .events = POLLIN },
+		{ .fd = stats_signal_fds[0], .events = POLLIN },
+		{ .fd = state->renderer ? render_thread_get_fd(state->renderer) : -1,
+			.events = POLLIN },
+		{ .fd = state->control ? control_server_get_fd(state->control) : -1,
+			.events = POLLIN },
+	};
+	if (poll(fds, sizeof(fds) / sizeof(fds[0]), get_poll_timeout(state)) < 0) {
+		wl_display_cancel_read(state->display);
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		if (wl_display_read_events(state->display) < 0) {
+			return -1;
+		}
+	} else {
+		wl_display_cancel_read(state->display);
+		if (fds[0].revents & (POLLERR | POLLHUP)) {
+			return -1;
+		}
+	}
+	if (wl_display_dispatch_pending(state->display) < 0) {
+		return -1;
+	}
+
+	if (fds[1].revents & POLLIN) {
+		struct image_load_job *job;
+		while ((job = image_loader_pop_completed(state->loader))) {
+			handle_image_loaded(state, job);
+			if (job->surface) {
+				cairo_surface_destroy(job->surface);
+			}
+			free(job);
+		}
+	}
+
+	if (fds[3].revents & POLLIN) {
+		process_render_results(state);
+	}
+
+	if (state->governor && governor_update(state->governor, get_time_ms())) {
+		update_policy(state);
+	}
+
+	if (fds[4].revents & POLLIN) {
+		struct control_request request;
+		while (control_server_accept(state->control, &request)) {
+			handle_control_request(state, &request);
+			control_request_finish(&request);
+		}
+	}
+
+	request_scheduled_frames(state);
+
+	if (fds[2].revents & POLLIN) {
+		char buf[16];
+		while (read(stats_signal_fds[0], buf, sizeof(buf)) > 0) {
+			// drain
+		}
+		swaybg_log(LOG_INFO, "Memory usage:");
+		write_memory_stats(state, stderr);
+	}
+	return 0;
+}
+
 static bool store_swaybg_output_config(struct swaybg_state *state,
 		struct swaybg_output_config *config) {
 	struct swaybg_output_config *oc = NULL;
@@ -701,6 +1969,19 @@ static void parse_command_line(int argc, char **argv,
 		{"image", required_argument, NULL, 'i'},
 		{"mode", required_argument, NULL, 'm'},
 		{"output", required_argument, NULL, 'o'},
+		{"pixel-format", required_argument, NULL, 'f'},
+		{"frame-ring", required_argument, NULL, 'R'},
+		{"filter", required_argument, NULL, 'r'},
+		{"export", required_argument, NULL, 'E'},
+		{"export-format", required_argument, NULL, 'F'},
+		{"frames", required_argument, NULL, 'n'},
+		{"pan-speed", required_argument, NULL, 'p'},
+		{"size", required_argument, NULL, 's'},
+		{"socket", required_argument, NULL, 'S'},
+		{"battery", required_argument, NULL, 'b'},
+		{"busy", required_argument, NULL, 'B'},
+		{"sysfs-root", required_argument, NULL, 'Y'},
+		{"perf-counters", no_argument, NULL, 'P'},
 		{"version", no_argument, NULL, 'v'},
 		{0, 0, 0, 0}
 	};
@@ -708,15 +1989,40 @@ static void parse_command_line(int argc, char **argv,
 	const char *usage =
 		"Usage: swaybg <options...>\n"
 		"\n"
+		"  -b, --battery          Set the animation policy on battery.\n"
+		"  -B, --busy             Set the animation policy under load as policy[@load].\n"
 		"  -c, --color            Set the background color.\n"
 		"  -h, --help             Show help message and quit.\n"
 		"  -i, --image            Set the image to display.\n"
 		"  -m, --mode             Set the mode to use for the image.\n"
 		"  -o, --output           Set the output to operate on or * for all.\n"
+		"  -f, --pixel-format     Set the pixel format of buffers.\n"
+		"  -r, --filter           Set the filter static images are scaled with.\n"
+		"  -R, --frame-ring       Pre-render animations using up to this many MiB.\n"
+		"  -E, --export           Write frames of an LBM image to a file or - and quit.\n"
+		"  -F, --export-format    Set the format of exported frames.\n"
+		"  -n, --frames           Set the number of frames to export.\n"
+		"  -s, --size             Set the size of exported frames as WxH[@scale].\n"
+		"      --perf-counters    Count CPU events of each stage while exporting.\n"
+		"      --sysfs-root       Read /sys and /proc under this directory.\n"
+		"  -p, --pan-speed        Set the speed of pan mode in pixels per second.\n"
+		"  -S, --socket           Listen for swaybgctl requests on this socket.\n"
 		"  -v, --version          Show the version number and quit.\n"
 		"\n"
 		"Background Modes:\n"
-		"  stretch, fit, fill, center, tile, or solid_color\n";
+		"  stretch, fit, fill, center, tile, pan, or solid_color\n"
+		"\n"
+		"Pixel Formats:\n"
+		"  xrgb8888 (default), rgb565, or xrgb2101010\n"
+		"\n"
+		"Filters:\n"
+		"  box, bilinear, or lanczos (default)\n"
+		"\n"
+		"Export Formats:\n"
+		"  raw, ppm, or y4m (default)\n"
+		"\n"
+		"Animation Policies:\n"
+		"  full (default), half, pause, or a number of frames per second\n";
 
 	struct swaybg_output_config *config = calloc(1, sizeof(struct swaybg_output_config));
 	config->output = strdup("*");
@@ -726,7 +2032,7 @@ static void parse_command_line(int argc, char **argv,
 	int c;
 	while (1) {
 		int option_index = 0;
-		c = getopt_long(argc, argv, "c:hi:m:o:v", long_options, &option_index);
+		c = getopt_long(argc, argv, "b:B:c:E:f:F:hi:m:n:o:p:r:R:s:S:v", long_options, &option_index);
 		if (c == -1) {
 			break;
 		}
@@ -747,6 +2053,102 @@ static void parse_command_line(int argc, char **argv,
 				swaybg_log(LOG_ERROR, "Invalid mode: %s", optarg);
 			}
 			break;
+		case 'f':  // pixel format
+			state->pixel_format = parse_pixel_format(optarg);
+			if (state->pixel_format == PIXEL_FORMAT_INVALID) {
+				swaybg_log(LOG_ERROR, "Invalid pixel format: %s", optarg);
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':  // resample filter
+			state->resample_filter = parse_resample_filter(optarg);
+			if (state->resample_filter == RESAMPLE_FILTER_INVALID) {
+				swaybg_log(LOG_ERROR, "Invalid filter: %s", optarg);
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'R': {  // frame ring budget
+			char *end;
+			unsigned long mib = strtoul(optarg, &end, 10);
+			if (*end != '\0') {
+				swaybg_log(LOG_ERROR, "%s is not a valid frame ring budget", optarg);
+				continue;
+			}
+			state->frame_ring_budget = (size_t)mib * 1024 * 1024;
+			break;
+		}
+		case 'E':  // export
+			state->export.path = optarg;
+			break;
+		case 'F':  // export format
+			state->export.format = parse_export_format(optarg);
+			if (state->export.format == EXPORT_FORMAT_INVALID) {
+				fprintf(stderr, "%s", usage);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'n': {  // exported frames
+			char *end;
+			state->export.n_frames = strtoul(optarg, &end, 10);
+			if (*end != '\0') {
+				swaybg_log(LOG_ERROR, "%s is not a valid number of frames", optarg);
+				state->export.n_frames = 0;
+			}
+			break;
+		}
+		case 'p': {  // pan speed
+			char *end;
+			state->pan_speed = strtoul(optarg, &end, 10);
+			if (*end != '\0') {
+				swaybg_log(LOG_ERROR, "%s is not a valid pan speed", optarg);
+				state->pan_speed = 20;
+			}
+			break;
+		}
+		case 's':  // export size
+			state->export.scale = 1;
+			if (sscanf(optarg, "%dx%d@%d", &state->export.width,
+					&state->export.height, &state->export.scale) < 2 ||
+					state->export.width <= 0 || state->export.height <= 0 ||
+					state->export.scale <= 0) {
+				swaybg_log(LOG_ERROR, "%s is not a valid size", optarg);
+				state->export.width = state->export.height = 0;
+				state->export.scale = 1;
+			}
+			break;
+		case 'b':  // battery policy
+			if (!parse_governor_policy(optarg, &state->governor_config.battery)) {
+				swaybg_log(LOG_ERROR, "%s is not a valid animation policy", optarg);
+			}
+			break;
+		case 'B': {  // busy policy
+			char *load = strchr(optarg, '@');
+			if (load) {
+				*load++ = '\0';
+			}
+			char *end = NULL;
+			state->governor_config.busy_load = load ? strtod(load, &end) : 1.0;
+			if (!parse_governor_policy(optarg, &state->governor_config.busy) ||
+					(end && (*end != '\0' || end == load)) ||
+					state->governor_config.busy_load <= 0) {
+				swaybg_log(LOG_ERROR, "%s is not a valid animation policy "
+						"under load", optarg);
+				state->governor_config.busy = GOVERNOR_POLICY_FULL;
+				state->governor_config.busy_load = 0;
+			}
+			break;
+		}
+		case 'Y':  // sysfs root
+			state->governor_config.root = optarg;
+			break;
+		case 'P':  // perf counters
+			state->export.perf_counters = true;
+			break;
+		case 'S':  // control socket
+			state->control_path = optarg;
+			break;
 		case 'o':  // output
 			if (config && !store_swaybg_output_config(state, config)) {
 				// Empty config or merged on top of an existing one
@@ -803,6 +2205,15 @@ int main(int argc, char **argv) {
 	swaybg_log_init(LOG_INFO);
 
 	struct swaybg_state state = {0};
+	state.start_time = get_time_ms();
+	state.presentation_clock = CLOCK_MONOTONIC;
+	state.export.format = EXPORT_FORMAT_Y4M;
+	state.export.n_frames = 600;
+	state.pan_speed = 20;
+	state.resample_filter = RESAMPLE_FILTER_LANCZOS;
+	state.policy = GOVERNOR_POLICY_FULL;
+	state.governor_config.battery = GOVERNOR_POLICY_FULL;
+	state.governor_config.busy = GOVERNOR_POLICY_FULL;
 	wl_list_init(&state.configs);
 	wl_list_init(&state.outputs);
 	wl_list_init(&state.images);
@@ -816,19 +2227,19 @@ int main(int argc, char **argv) {
 		if (!config->image_path) {
 			continue;
 		}
-		wl_list_for_each(image, &state.images, link) {
-			if (strcmp(image->path, config->image_path) == 0) {
-				config->image = image;
-				break;
+		config->image = get_swaybg_image(&state, config->image_path);
+	}
+
+	if (state.export.path) {
+		// Export the image of the first output config that has one
+		wl_list_for_each(config, &state.configs, link) {
+			if (config->image_path) {
+				return export_lbm_image(config->image_path, config->mode,
+						config->color, &state.export);
 			}
 		}
-		if (config->image) {
-			continue;
-		}
-		image = calloc(1, sizeof(struct swaybg_image));
-		image->path = config->image_path;
-		wl_list_insert(&state.images, &image->link);
-		config->image = image;
+		swaybg_log(LOG_ERROR, "No image to export");
+		return 1;
 	}
 
 	state.display = wl_display_connect(NULL);
@@ -850,13 +2261,55 @@ int main(int argc, char **argv) {
 		swaybg_log(LOG_ERROR, "Missing a required Wayland interface");
 		return 1;
 	}
+	// Receive the wl_shm formats
+	if (wl_display_roundtrip(state.display) < 0) {
+		swaybg_log(LOG_ERROR, "wl_display_roundtrip failed");
+		return 1;
+	}
+	// XRGB8888 is always supported, the other formats are opt-in
+	if (!(state.shm_formats & (1 << state.pixel_format))) {
+		swaybg_log(LOG_ERROR, "Compositor does not support pixel format %s, "
+				"falling back to %s", pixel_format_name(state.pixel_format),
+				pixel_format_name(PIXEL_FORMAT_XRGB8888));
+		state.pixel_format = PIXEL_FORMAT_XRGB8888;
+	}
+	swaybg_log(LOG_DEBUG, "Using pixel format %s",
+			pixel_format_name(state.pixel_format));
+
+	state.loader = image_loader_create();
+	if (!state.loader) {
+		return 1;
+	}
+	// Dump statistics on SIGUSR1. Not fatal if it cannot be set up.
+	setup_stats_signal();
+	// Also optional
+	char control_path[PATH_MAX];
+	if (!state.control_path && control_socket_path(control_path, sizeof(control_path))) {
+		state.control_path = control_path;
+	}
+	if (state.control_path && state.control_path[0]) {
+		// Replies to clients that hung up must not kill swaybg
+		signal(SIGPIPE, SIG_IGN);
+		state.control = control_server_create(state.control_path);
+	}
+	// Only created if a policy restricts animations
+	state.governor = governor_create(&state.governor_config);
+	if (state.governor && governor_update(state.governor, get_time_ms())) {
+		update_policy(&state);
+	}
+	// Without a render thread, frames are rendered on the main thread
+	state.renderer = render_thread_create();
 
 	state.run_display = true;
-	while (wl_display_dispatch(state.display) != -1 && state.run_display) {
+	while (state.run_display) {
 #ifdef PROFILE
 		static int times = 1000;
 		if(times-- == 0) state.run_display = false;
 #endif
+		if (dispatch_events(&state) < 0) {
+			break;
+		}
+
 		// Send acks, and determine which images need to be loaded
 		struct swaybg_output *output;
 		wl_list_for_each(output, &state.outputs, link) {
@@ -867,60 +2320,45 @@ int main(int argc, char **argv) {
 						output->configure_serial);
 				swaybg_log(LOG_DEBUG, "Acking %s", output->name);
 			}
-			int buffer_width = output->width * output->scale,
-				buffer_height = output->height * output->scale;
+			int buffer_width, buffer_height, buffer_scale;
+			get_buffer_size(output, &buffer_width, &buffer_height, &buffer_scale);
 			bool buffer_change =
 				output->committed_height != buffer_height ||
 				output->committed_width != buffer_width;
-			if (output->dirty && output->config->image && !output->config->image->anim && buffer_change) {
+			if (output->dirty && output->config->image && !output->config->image->anim &&
+					!output->config->image->load_failed && buffer_change) {
 				swaybg_log(LOG_DEBUG, "reload required. committed size%d,%d; new size %d,%d",
 						output->committed_width, output->committed_height, buffer_width, buffer_height);
 				output->config->image->load_required = true;
 			}
 		}
 
-		// Load images, render associated frames, and unload
+		// Queue images for decoding on the loader threads. Their frames are
+		// rendered once the decoded result comes back through the loader.
 		wl_list_for_each(image, &state.images, link) {
-			if (!image->load_required) {
+			if (!image->load_required || image->loading) {
 				continue;
 			}
-
-			cairo_surface_t *surface = NULL;
-			image->anim = read_lbm_image(image->path);
-			if (!image->anim) {
-				surface = load_background_image(image->path);
-				if (!surface) {
-					swaybg_log(LOG_ERROR, "Failed to load image: %s", image->path);
-					continue;
-				}
-			}
-
-			wl_list_for_each(output, &state.outputs, link) {
-				struct swaybg_image *image = output->config->image;
-				if ( image->anim && (output->config->mode != BACKGROUND_MODE_FIT ) &&
-						(output->config->mode != BACKGROUND_MODE_FILL) &&
-						(output->config->mode != BACKGROUND_MODE_CENTER)) {
-					// TODO: tiling should be supported too
-					swaybg_log(LOG_ERROR, "Only modes \"fit\", \"fill\" and \"center\" are supported for LBM images");
-					free_lbm_image(image->anim);
-					image->anim = NULL;
-				} else if (output->dirty && output->config->image == image) {
-
-					if ( image->anim ) {
-						image->anim->userdata = output;
-					}
-					output->dirty = false;
-					swaybg_log(LOG_DEBUG, "%d going to render a whole new frame for %s", __LINE__, output->name);
-					render_frame(output, surface);
-				}
+			enum background_mode mode;
+			int decode_width, decode_height;
+			get_decode_target(&state, image, &mode, &decode_width, &decode_height);
+			if (image_loader_submit(state.loader, image, mode,
+					decode_width, decode_height)) {
+				image->loading = true;
+				image->load_required = false;
 			}
-			image->load_required = false;
-			cairo_surface_destroy(surface);
 		}
 
-		// Redraw outputs without associated image
+		// Redraw outputs without associated image. Outputs that have
+		// never been drawn get a placeholder while theirs loads.
 		wl_list_for_each(output, &state.outputs, link) {
-			if (output->dirty) {
+			if (output->dirty && output->config->image &&
+					output->config->image->loading &&
+					!output->first_frame_shown && !output->placeholder_shown) {
+				show_placeholder(output);
+			}
+			if (output->dirty && !(output->config->image &&
+					output->config->image->loading)) {
 				output->dirty = false;
 				swaybg_log(LOG_DEBUG, "%d going to render a whole new frame for %s", __LINE__, output->name);
 				render_frame(output, NULL);
@@ -928,10 +2366,18 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	image_loader_destroy(state.loader);
+	render_thread_destroy(state.renderer);
+	control_server_destroy(state.control);
+	governor_destroy(state.governor);
+	state.renderer = NULL;
+
 	struct swaybg_output *output, *tmp_output;
 	wl_list_for_each_safe(output, tmp_output, &state.outputs, link) {
 		destroy_swaybg_output(output);
 	}
+	frame_ring_destroy_orphans();
+	destroy_shm_arena();
 
 	struct swaybg_output_config *tmp_config = NULL;
 	wl_list_for_each_safe(config, tmp_config, &state.configs, link) {
@@ -0,0 +1,53 @@
+#include <stdatomic.h>
+#include "memstats.h"
+
+struct memstats_counter {
+	atomic_size_t current;
+	atomic_size_t peak;
+};
+
+static struct memstats_counter counters[MEMSTATS_CLASS_COUNT];
+
+static const char *class_names[MEMSTATS_CLASS_COUNT] = {
+	[MEMSTATS_IFF] = "IFF chunk trees",
+	[MEMSTATS_PIXELS] = "LBM pixels",
+	[MEMSTATS_RANGES] = "LBM range lists",
+	[MEMSTATS_SHM] = "shm buffers",
+	[MEMSTATS_CAIRO] = "cairo surfaces",
+};
+
+void memstats_alloc(enum memstats_class class, size_t bytes) {
+	struct memstats_counter *counter = &counters[class];
+	size_t current = atomic_fetch_add(&counter->current, bytes) + bytes;
+	size_t peak = atomic_load(&counter->peak);
+	while (current > peak &&
+			!atomic_compare_exchange_weak(&counter->peak, &peak, current)) {
+		// peak was reloaded, try again
+	}
+}
+
+void memstats_free(enum memstats_class class, size_t bytes) {
+	atomic_fetch_sub(&counters[class].current, bytes);
+}
+
+size_t memstats_current(enum memstats_class class) {
+	return atomic_load(&counters[class].current);
+}
+
+size_t memstats_peak(enum memstats_class class) {
+	return atomic_load(&counters[class].peak);
+}
+
+const char *memstats_class_name(enum memstats_class class) {
+	return class_names[class];
+}
+
+void memstats_print(FILE *f) {
+	size_t total = 0;
+	for (int i = 0; i < MEMSTATS_CLASS_COUNT; i++) {
+		fprintf(f, "  %-16s %12zu bytes (peak %zu)\n", class_names[i],
+				memstats_current(i), memstats_peak(i));
+		total += memstats_current(i);
+	}
+	fprintf(f, "  %-16s %12zu bytes\n", "total", total);
+}
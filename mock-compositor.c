@@ -0,0 +1,1488 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server.h>
+#include "log.h"
+#include "wlr-layer-shell-unstable-v1-server-protocol.h"
+#include "viewporter-server-protocol.h"
+#include "fractional-scale-v1-server-protocol.h"
+#include "presentation-time-server-protocol.h"
+
+/*
+ * A stand-in compositor for exercising swaybg's frame pipeline without a real
+ * compositor. It implements just enough of wl_compositor, wl_shm, wl_output,
+ * wlr-layer-shell, viewporter, fractional-scale and presentation-time for
+ * swaybg to run, fires frame callbacks on a scripted schedule, and records every
+ * commit.
+ */
+
+struct mock_state {
+	struct wl_display *display;
+	struct wl_event_loop *loop;
+	struct wl_list outputs;  // struct mock_output::link
+	struct wl_list surfaces; // struct mock_surface::link
+	struct wl_list events;   // struct mock_event::link, sorted by time
+
+	struct wl_event_source *frame_timer;
+	struct wl_event_source *event_timer;
+	uint32_t frame_interval_ms;
+	uint32_t release_delay_ms;
+	uint32_t frame_seq;
+	bool checksum;
+	bool presentation;
+	// Vblanks between latching a commit and presenting it
+	uint32_t present_latency;
+	struct wl_list latched_feedbacks;  // struct mock_feedback::link
+
+	FILE *record;
+	struct timespec start;
+	pid_t child;
+	int exit_status;
+};
+
+struct mock_output {
+	struct mock_state *state;
+	struct wl_global *global;
+	struct wl_list resources;
+	char *name;
+	int32_t width, height;
+	int32_t scale;
+	// Preferred fractional scale in 120ths, or 0 to prefer the integer scale
+	int32_t scale_120ths;
+	struct wl_list link;
+};
+
+struct mock_surface_state {
+	struct wl_resource *buffer;
+	bool attached;
+	int32_t scale;
+	uint32_t n_damage;
+	uint64_t damage_area;
+	int32_t x1, y1, x2, y2; // damage bounding box in buffer coordinates
+};
+
+struct mock_surface {
+	struct mock_state *state;
+	struct wl_resource *resource;
+	struct wl_resource *layer_surface;
+	struct wl_resource *viewport;
+	struct wl_resource *fractional_scale;
+	struct mock_output *output;
+
+	struct mock_surface_state pending, current;
+	struct wl_listener pending_buffer_destroy;
+	struct wl_listener current_buffer_destroy;
+	struct wl_list pending_callbacks; // wl_callback resources
+	struct wl_list frame_callbacks;   // wl_callback resources, sent on next frame
+	struct wl_list pending_feedbacks;   // struct mock_feedback::link
+	struct wl_list committed_feedbacks; // latched on the next frame
+
+	uint32_t configure_serial;
+	uint32_t configured_width, configured_height;
+	int32_t viewport_width, viewport_height;
+
+	// Statistics
+	uint64_t n_commits;
+	uint64_t n_buffer_commits;
+	uint64_t total_damage_area;
+	uint64_t last_commit_us;
+	uint64_t commit_interval_sum_us;
+	uint64_t commit_interval_max_us;
+	uint64_t last_frame_done_us;
+	uint64_t frame_to_commit_sum_us;
+	uint64_t n_frame_to_commit;
+	uint64_t n_presented;
+	uint64_t n_discarded;
+
+	struct wl_list link;
+};
+
+// A wp_presentation_feedback, from the commit it was requested for until it is
+// presented or discarded
+struct mock_feedback {
+	struct wl_resource *resource;
+	struct mock_surface *surface;
+	uint32_t present_seq;  // once latched
+	struct wl_list link;
+};
+
+struct mock_release {
+	struct mock_state *state;
+	struct wl_resource *buffer;
+	struct wl_listener buffer_destroy;
+	struct wl_event_source *timer;
+};
+
+enum mock_event_type {
+	EVENT_PLUG,
+	EVENT_UNPLUG,
+	EVENT_SCALE,
+	EVENT_FRACTIONAL_SCALE,
+	EVENT_FRAME_INTERVAL,
+	EVENT_RELEASE_DELAY,
+	EVENT_PRESENT_LATENCY,
+	EVENT_QUIT,
+};
+
+struct mock_event {
+	uint32_t time_ms;
+	enum mock_event_type type;
+	char *output;
+	int32_t width, height, scale;
+	uint32_t value;
+	struct wl_list link;
+};
+
+static uint64_t now_us(const struct mock_state *state) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)(ts.tv_sec - state->start.tv_sec) * 1000000 +
+		(ts.tv_nsec - state->start.tv_nsec) / 1000;
+}
+
+static uint32_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void remove_resource_link(struct wl_resource *resource) {
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void handle_destroy(struct wl_client *client, struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+static const char *surface_output_name(const struct mock_surface *surface) {
+	return surface->output ? surface->output->name : "-";
+}
+
+static void output_logical_size(const struct mock_output *output,
+		uint32_t *width, uint32_t *height) {
+	if (output->scale_120ths) {
+		*width = output->width * 120 / output->scale_120ths;
+		*height = output->height * 120 / output->scale_120ths;
+	} else {
+		*width = output->width / output->scale;
+		*height = output->height / output->scale;
+	}
+}
+
+// Buffer release
+
+static void release_destroy(struct mock_release *release) {
+	wl_list_remove(&release->buffer_destroy.link);
+	if (release->timer) {
+		wl_event_source_remove(release->timer);
+	}
+	free(release);
+}
+
+static int handle_release_timer(void *data) {
+	struct mock_release *release = data;
+	wl_buffer_send_release(release->buffer);
+	release_destroy(release);
+	return 0;
+}
+
+static void handle_release_buffer_destroy(struct wl_listener *listener, void *data) {
+	struct mock_release *release =
+		wl_container_of(listener, release, buffer_destroy);
+	release_destroy(release);
+}
+
+/*
+ * Release a buffer once its contents have been copied, as shm compositors do on
+ * each commit that attaches it. A buffer attached again before its release is
+ * due is released once, after the last commit.
+ */
+static void release_buffer(struct mock_state *state, struct wl_resource *buffer) {
+	if (state->release_delay_ms == 0) {
+		wl_buffer_send_release(buffer);
+		return;
+	}
+	struct wl_listener *pending = wl_resource_get_destroy_listener(buffer,
+			handle_release_buffer_destroy);
+	if (pending) {
+		struct mock_release *release =
+			wl_container_of(pending, release, buffer_destroy);
+		wl_event_source_timer_update(release->timer, state->release_delay_ms);
+		return;
+	}
+	struct mock_release *release = calloc(1, sizeof(struct mock_release));
+	if (!release) {
+		wl_buffer_send_release(buffer);
+		return;
+	}
+	release->state = state;
+	release->buffer = buffer;
+	release->buffer_destroy.notify = handle_release_buffer_destroy;
+	wl_resource_add_destroy_listener(buffer, &release->buffer_destroy);
+	release->timer = wl_event_loop_add_timer(state->loop,
+			handle_release_timer, release);
+	wl_event_source_timer_update(release->timer, state->release_delay_ms);
+}
+
+// wl_region
+
+static void region_add(struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	// Regions do not affect what is recorded
+}
+
+static void region_subtract(struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	// Regions do not affect what is recorded
+}
+
+static const struct wl_region_interface region_impl = {
+	.destroy = handle_destroy,
+	.add = region_add,
+	.subtract = region_subtract,
+};
+
+// wl_surface
+
+static void handle_pending_buffer_destroy(struct wl_listener *listener, void *data) {
+	struct mock_surface *surface =
+		wl_container_of(listener, surface, pending_buffer_destroy);
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
+	surface->pending.buffer = NULL;
+}
+
+static void handle_current_buffer_destroy(struct wl_listener *listener, void *data) {
+	struct mock_surface *surface =
+		wl_container_of(listener, surface, current_buffer_destroy);
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
+	surface->current.buffer = NULL;
+}
+
+static void surface_attach(struct wl_client *client, struct wl_resource *resource,
+		struct wl_resource *buffer, int32_t x, int32_t y) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	wl_list_remove(&surface->pending_buffer_destroy.link);
+	wl_list_init(&surface->pending_buffer_destroy.link);
+	surface->pending.buffer = buffer;
+	surface->pending.attached = true;
+	if (buffer) {
+		wl_resource_add_destroy_listener(buffer, &surface->pending_buffer_destroy);
+	}
+}
+
+static void surface_damage_buffer(struct wl_client *client,
+		struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	struct mock_surface_state *pending = &surface->pending;
+	if (width <= 0 || height <= 0) {
+		return;
+	}
+	// Clip "everything" damage to something representable
+	int64_t x2 = (int64_t)x + width, y2 = (int64_t)y + height;
+	if (x2 > INT32_MAX) {
+		x2 = INT32_MAX;
+	}
+	if (y2 > INT32_MAX) {
+		y2 = INT32_MAX;
+	}
+	if (pending->n_damage == 0) {
+		pending->x1 = x;
+		pending->y1 = y;
+		pending->x2 = x2;
+		pending->y2 = y2;
+	} else {
+		pending->x1 = x < pending->x1 ? x : pending->x1;
+		pending->y1 = y < pending->y1 ? y : pending->y1;
+		pending->x2 = x2 > pending->x2 ? x2 : pending->x2;
+		pending->y2 = y2 > pending->y2 ? y2 : pending->y2;
+	}
+	pending->n_damage++;
+	pending->damage_area += (uint64_t)(x2 - x) * (y2 - y);
+}
+
+static void surface_damage(struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	// swaybg only uses buffer damage; treat surface damage the same way
+	surface_damage_buffer(client, resource, x, y, width, height);
+}
+
+static void surface_frame(struct wl_client *client, struct wl_resource *resource,
+		uint32_t id) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback = wl_resource_create(client,
+			&wl_callback_interface, 1, id);
+	if (!callback) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(callback, NULL, NULL, remove_resource_link);
+	wl_list_insert(surface->pending_callbacks.prev,
+			wl_resource_get_link(callback));
+}
+
+static void surface_set_region(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *region) {
+	// Regions do not affect what is recorded
+}
+
+static void surface_set_buffer_transform(struct wl_client *client,
+		struct wl_resource *resource, int32_t transform) {
+	// Transforms are not emulated
+}
+
+static void surface_set_buffer_scale(struct wl_client *client,
+		struct wl_resource *resource, int32_t scale) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	surface->pending.scale = scale;
+}
+
+static void surface_offset(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y) {
+	// Offsets are not emulated
+}
+
+static uint32_t buffer_checksum(struct wl_resource *buffer) {
+	struct wl_shm_buffer *shm_buffer = wl_shm_buffer_get(buffer);
+	if (!shm_buffer) {
+		return 0;
+	}
+	// FNV-1a over the visible bytes of each row
+	uint32_t hash = 2166136261u;
+	int32_t height = wl_shm_buffer_get_height(shm_buffer);
+	int32_t stride = wl_shm_buffer_get_stride(shm_buffer);
+	uint32_t format = wl_shm_buffer_get_format(shm_buffer);
+	int32_t row_bytes = wl_shm_buffer_get_width(shm_buffer) *
+		(format == WL_SHM_FORMAT_RGB565 ? 2 : 4);
+	wl_shm_buffer_begin_access(shm_buffer);
+	const uint8_t *data = wl_shm_buffer_get_data(shm_buffer);
+	for (int32_t y = 0; y < height; y++) {
+		const uint8_t *row = data + (size_t)y * stride;
+		for (int32_t x = 0; x < row_bytes; x++) {
+			// Ignore the padding byte of XRGB8888, which is undefined
+			if (format == WL_SHM_FORMAT_XRGB8888 && x % 4 == 3) {
+				continue;
+			}
+			hash = (hash ^ row[x]) * 16777619u;
+		}
+	}
+	wl_shm_buffer_end_access(shm_buffer);
+	return hash;
+}
+
+static void send_configure(struct mock_surface *surface) {
+	if (!surface->layer_surface || !surface->output) {
+		return;
+	}
+	uint32_t width, height;
+	output_logical_size(surface->output, &width, &height);
+	if (surface->configure_serial &&
+			width == surface->configured_width &&
+			height == surface->configured_height) {
+		return;
+	}
+	surface->configure_serial = wl_display_next_serial(surface->state->display);
+	surface->configured_width = width;
+	surface->configured_height = height;
+	zwlr_layer_surface_v1_send_configure(surface->layer_surface,
+			surface->configure_serial, width, height);
+	if (surface->state->record) {
+		fprintf(surface->state->record, "configure,%lu,%s,%ux%u,%u\n",
+				(unsigned long)now_us(surface->state),
+				surface_output_name(surface), width, height,
+				surface->configure_serial);
+	}
+}
+
+// Presentation feedback
+
+static void feedback_destroy(struct wl_resource *resource) {
+	struct mock_feedback *feedback = wl_resource_get_user_data(resource);
+	wl_list_remove(&feedback->link);
+	free(feedback);
+}
+
+static void discard_feedbacks(struct wl_list *feedbacks) {
+	struct mock_feedback *feedback, *tmp;
+	wl_list_for_each_safe(feedback, tmp, feedbacks, link) {
+		struct mock_surface *surface = feedback->surface;
+		surface->n_discarded++;
+		if (surface->state->record) {
+			fprintf(surface->state->record, "discard,%lu,%s\n",
+					(unsigned long)now_us(surface->state),
+					surface_output_name(surface));
+		}
+		wp_presentation_feedback_send_discarded(feedback->resource);
+		wl_resource_destroy(feedback->resource);
+	}
+}
+
+static void present_feedback(struct mock_feedback *feedback,
+		const struct timespec *when) {
+	struct mock_surface *surface = feedback->surface;
+	struct mock_state *state = surface->state;
+	if (surface->output) {
+		struct wl_client *client = wl_resource_get_client(feedback->resource);
+		struct wl_resource *output;
+		wl_resource_for_each(output, &surface->output->resources) {
+			if (wl_resource_get_client(output) == client) {
+				wp_presentation_feedback_send_sync_output(feedback->resource,
+						output);
+			}
+		}
+	}
+	uint64_t sec = when->tv_sec;
+	wp_presentation_feedback_send_presented(feedback->resource, sec >> 32,
+			sec & 0xFFFFFFFF, when->tv_nsec, state->frame_interval_ms * 1000000,
+			0, state->frame_seq, WP_PRESENTATION_FEEDBACK_KIND_VSYNC);
+	surface->n_presented++;
+	if (state->record) {
+		fprintf(state->record, "present,%lu,%s,%u\n",
+				(unsigned long)now_us(state), surface_output_name(surface),
+				state->frame_seq);
+	}
+	wl_resource_destroy(feedback->resource);
+}
+
+/*
+ * On each frame, present what was latched present_latency frames ago, then
+ * latch the commits made since the last frame.
+ */
+static void update_feedbacks(struct mock_state *state) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct mock_feedback *feedback, *tmp;
+	wl_list_for_each_safe(feedback, tmp, &state->latched_feedbacks, link) {
+		if ((int32_t)(feedback->present_seq - state->frame_seq) <= 0) {
+			present_feedback(feedback, &now);
+		}
+	}
+	struct mock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		wl_list_for_each_safe(feedback, tmp, &surface->committed_feedbacks, link) {
+			feedback->present_seq = state->frame_seq + state->present_latency;
+			wl_list_remove(&feedback->link);
+			if (state->present_latency == 0) {
+				wl_list_init(&feedback->link);
+				present_feedback(feedback, &now);
+			} else {
+				wl_list_insert(state->latched_feedbacks.prev, &feedback->link);
+			}
+		}
+	}
+}
+
+static void surface_commit(struct wl_client *client, struct wl_resource *resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	struct mock_state *state = surface->state;
+	struct mock_surface_state *pending = &surface->pending;
+	uint64_t t = now_us(state);
+
+	if (pending->attached) {
+		wl_list_remove(&surface->current_buffer_destroy.link);
+		wl_list_init(&surface->current_buffer_destroy.link);
+		surface->current.buffer = pending->buffer;
+		if (pending->buffer) {
+			wl_resource_add_destroy_listener(pending->buffer,
+					&surface->current_buffer_destroy);
+		}
+		wl_list_remove(&surface->pending_buffer_destroy.link);
+		wl_list_init(&surface->pending_buffer_destroy.link);
+	}
+	if (pending->scale) {
+		surface->current.scale = pending->scale;
+	}
+
+	surface->n_commits++;
+	if (surface->last_commit_us) {
+		uint64_t interval = t - surface->last_commit_us;
+		surface->commit_interval_sum_us += interval;
+		if (interval > surface->commit_interval_max_us) {
+			surface->commit_interval_max_us = interval;
+		}
+	}
+	surface->last_commit_us = t;
+	if (surface->last_frame_done_us) {
+		surface->frame_to_commit_sum_us += t - surface->last_frame_done_us;
+		surface->n_frame_to_commit++;
+		surface->last_frame_done_us = 0;
+	}
+
+	struct wl_shm_buffer *shm_buffer = surface->current.buffer ?
+		wl_shm_buffer_get(surface->current.buffer) : NULL;
+	if (pending->attached && shm_buffer) {
+		surface->n_buffer_commits++;
+		surface->total_damage_area += pending->damage_area;
+	}
+	if (state->record) {
+		uint32_t checksum = 0;
+		if (state->checksum && pending->attached && surface->current.buffer) {
+			checksum = buffer_checksum(surface->current.buffer);
+		}
+		fprintf(state->record, "commit,%lu,%s,%dx%d,%d,%u,%lu,%d,%d,%d,%d,%dx%d,%08x\n",
+				(unsigned long)t, surface_output_name(surface),
+				shm_buffer ? wl_shm_buffer_get_width(shm_buffer) : 0,
+				shm_buffer ? wl_shm_buffer_get_height(shm_buffer) : 0,
+				surface->current.scale, pending->n_damage,
+				(unsigned long)pending->damage_area,
+				pending->x1, pending->y1, pending->x2 - pending->x1,
+				pending->y2 - pending->y1,
+				surface->viewport_width, surface->viewport_height, checksum);
+	}
+
+	// The contents were uploaded, even if the same buffer was attached again
+	if (pending->attached && surface->current.buffer) {
+		release_buffer(state, surface->current.buffer);
+	}
+
+	// Callbacks of this commit fire on the next frame
+	wl_list_insert_list(surface->frame_callbacks.prev, &surface->pending_callbacks);
+	wl_list_init(&surface->pending_callbacks);
+	// A new buffer replaces content that was never shown
+	if (pending->attached) {
+		discard_feedbacks(&surface->committed_feedbacks);
+	}
+	wl_list_insert_list(surface->committed_feedbacks.prev,
+			&surface->pending_feedbacks);
+	wl_list_init(&surface->pending_feedbacks);
+
+	memset(pending, 0, sizeof(*pending));
+
+	// The initial commit of a layer surface asks for a configure
+	if (surface->layer_surface && surface->configure_serial == 0) {
+		send_configure(surface);
+	}
+}
+
+static const struct wl_surface_interface surface_impl = {
+	.destroy = handle_destroy,
+	.attach = surface_attach,
+	.damage = surface_damage,
+	.frame = surface_frame,
+	.set_opaque_region = surface_set_region,
+	.set_input_region = surface_set_region,
+	.commit = surface_commit,
+	.set_buffer_transform = surface_set_buffer_transform,
+	.set_buffer_scale = surface_set_buffer_scale,
+	.damage_buffer = surface_damage_buffer,
+	.offset = surface_offset,
+};
+
+static void destroy_callbacks(struct wl_list *callbacks) {
+	struct wl_resource *callback, *tmp;
+	wl_resource_for_each_safe(callback, tmp, callbacks) {
+		wl_resource_destroy(callback);
+	}
+}
+
+static void print_surface_stats(const struct mock_surface *surface) {
+	if (surface->n_commits == 0) {
+		return;
+	}
+	uint64_t intervals = surface->n_commits > 1 ? surface->n_commits - 1 : 1;
+	uint64_t buffer_commits = surface->n_buffer_commits ?
+		surface->n_buffer_commits : 1;
+	uint64_t frame_commits = surface->n_frame_to_commit ?
+		surface->n_frame_to_commit : 1;
+	swaybg_log(LOG_INFO, "%s: %lu commits (%lu with buffers), "
+			"commit interval avg %.2f ms max %.2f ms, "
+			"frame done to commit avg %.3f ms, "
+			"damage avg %lu px per buffer commit, "
+			"%lu presented, %lu discarded",
+			surface_output_name(surface),
+			(unsigned long)surface->n_commits,
+			(unsigned long)surface->n_buffer_commits,
+			surface->commit_interval_sum_us / (double)intervals / 1000.0,
+			surface->commit_interval_max_us / 1000.0,
+			surface->frame_to_commit_sum_us / (double)frame_commits / 1000.0,
+			(unsigned long)(surface->total_damage_area / buffer_commits),
+			(unsigned long)surface->n_presented,
+			(unsigned long)surface->n_discarded);
+}
+
+static void surface_destroy(struct wl_resource *resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	print_surface_stats(surface);
+	destroy_callbacks(&surface->pending_callbacks);
+	destroy_callbacks(&surface->frame_callbacks);
+	struct mock_feedback *feedback, *tmp;
+	wl_list_for_each_safe(feedback, tmp, &surface->state->latched_feedbacks, link) {
+		if (feedback->surface == surface) {
+			wl_list_remove(&feedback->link);
+			wl_list_insert(surface->committed_feedbacks.prev, &feedback->link);
+		}
+	}
+	discard_feedbacks(&surface->pending_feedbacks);
+	discard_feedbacks(&surface->committed_feedbacks);
+	wl_list_remove(&surface->pending_buffer_destroy.link);
+	wl_list_remove(&surface->current_buffer_destroy.link);
+	if (surface->layer_surface) {
+		wl_resource_set_user_data(surface->layer_surface, NULL);
+	}
+	if (surface->viewport) {
+		wl_resource_set_user_data(surface->viewport, NULL);
+	}
+	if (surface->fractional_scale) {
+		wl_resource_set_user_data(surface->fractional_scale, NULL);
+	}
+	wl_list_remove(&surface->link);
+	free(surface);
+}
+
+// wl_compositor
+
+static void compositor_create_surface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct mock_state *state = wl_resource_get_user_data(resource);
+	struct mock_surface *surface = calloc(1, sizeof(struct mock_surface));
+	if (!surface) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	surface->resource = wl_resource_create(client, &wl_surface_interface,
+			wl_resource_get_version(resource), id);
+	if (!surface->resource) {
+		free(surface);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	surface->state = state;
+	surface->current.scale = 1;
+	wl_list_init(&surface->pending_callbacks);
+	wl_list_init(&surface->frame_callbacks);
+	wl_list_init(&surface->pending_feedbacks);
+	wl_list_init(&surface->committed_feedbacks);
+	surface->pending_buffer_destroy.notify = handle_pending_buffer_destroy;
+	wl_list_init(&surface->pending_buffer_destroy.link);
+	surface->current_buffer_destroy.notify = handle_current_buffer_destroy;
+	wl_list_init(&surface->current_buffer_destroy.link);
+	wl_list_insert(&state->surfaces, &surface->link);
+	wl_resource_set_implementation(surface->resource, &surface_impl,
+			surface, surface_destroy);
+}
+
+static void compositor_create_region(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct wl_resource *region = wl_resource_create(client,
+			&wl_region_interface, 1, id);
+	if (!region) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+	.create_surface = compositor_create_surface,
+	.create_region = compositor_create_region,
+};
+
+static void bind_compositor(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+			&wl_compositor_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &compositor_impl, data, NULL);
+}
+
+// wl_output
+
+static const struct wl_output_interface output_impl = {
+	.release = handle_destroy,
+};
+
+static void send_output_state(struct mock_output *output,
+		struct wl_resource *resource) {
+	int32_t refresh = 1000000 / output->state->frame_interval_ms;
+	wl_output_send_geometry(resource, 0, 0, 0, 0, WL_OUTPUT_SUBPIXEL_UNKNOWN,
+			"swaybg", "mock", WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(resource,
+			WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+			output->width, output->height, refresh);
+	if (wl_resource_get_version(resource) >= 2) {
+		wl_output_send_scale(resource, output->scale);
+	}
+	if (wl_resource_get_version(resource) >= 4) {
+		wl_output_send_name(resource, output->name);
+		wl_output_send_description(resource, "swaybg mock output");
+	}
+	if (wl_resource_get_version(resource) >= 2) {
+		wl_output_send_done(resource);
+	}
+}
+
+static void bind_output(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct mock_output *output = data;
+	struct wl_resource *resource = wl_resource_create(client,
+			&wl_output_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &output_impl, output,
+			remove_resource_link);
+	wl_list_insert(&output->resources, wl_resource_get_link(resource));
+	send_output_state(output, resource);
+}
+
+static struct mock_output *find_output(struct mock_state *state, const char *name) {
+	struct mock_output *output;
+	wl_list_for_each(output, &state->outputs, link) {
+		if (strcmp(output->name, name) == 0) {
+			return output;
+		}
+	}
+	return NULL;
+}
+
+static struct mock_output *create_output(struct mock_state *state,
+		const char *name, int32_t width, int32_t height, int32_t scale) {
+	struct mock_output *output = calloc(1, sizeof(struct mock_output));
+	if (!output) {
+		return NULL;
+	}
+	output->state = state;
+	output->name = strdup(name);
+	output->width = width;
+	output->height = height;
+	output->scale = scale > 0 ? scale : 1;
+	wl_list_init(&output->resources);
+	output->global = wl_global_create(state->display, &wl_output_interface,
+			4, output, bind_output);
+	wl_list_insert(state->outputs.prev, &output->link);
+	swaybg_log(LOG_DEBUG, "Added output %s %dx%d@%d", name, width, height,
+			output->scale);
+	return output;
+}
+
+static void destroy_output(struct mock_output *output) {
+	struct mock_surface *surface;
+	wl_list_for_each(surface, &output->state->surfaces, link) {
+		if (surface->output == output) {
+			if (surface->layer_surface) {
+				zwlr_layer_surface_v1_send_closed(surface->layer_surface);
+			}
+			surface->output = NULL;
+		}
+	}
+	struct wl_resource *resource, *tmp;
+	wl_resource_for_each_safe(resource, tmp, &output->resources) {
+		wl_resource_set_user_data(resource, NULL);
+		wl_list_remove(wl_resource_get_link(resource));
+		wl_list_init(wl_resource_get_link(resource));
+	}
+	wl_global_destroy(output->global);
+	wl_list_remove(&output->link);
+	free(output->name);
+	free(output);
+}
+
+static void update_output_scale(struct mock_output *output) {
+	struct wl_resource *resource;
+	wl_resource_for_each(resource, &output->resources) {
+		send_output_state(output, resource);
+	}
+	struct mock_surface *surface;
+	wl_list_for_each(surface, &output->state->surfaces, link) {
+		if (surface->output != output) {
+			continue;
+		}
+		if (surface->fractional_scale) {
+			wp_fractional_scale_v1_send_preferred_scale(surface->fractional_scale,
+					output->scale_120ths ? output->scale_120ths : output->scale * 120);
+		}
+		send_configure(surface);
+	}
+}
+
+// wlr-layer-shell
+
+static void layer_surface_set_size(struct wl_client *client,
+		struct wl_resource *resource, uint32_t width, uint32_t height) {
+	// Layer surfaces always cover the output
+}
+
+static void layer_surface_set_anchor(struct wl_client *client,
+		struct wl_resource *resource, uint32_t anchor) {
+	// Layer surfaces always cover the output
+}
+
+static void layer_surface_set_exclusive_zone(struct wl_client *client,
+		struct wl_resource *resource, int32_t zone) {
+	// Layer surfaces always cover the output
+}
+
+static void layer_surface_set_margin(struct wl_client *client,
+		struct wl_resource *resource,
+		int32_t top, int32_t right, int32_t bottom, int32_t left) {
+	// Layer surfaces always cover the output
+}
+
+static void layer_surface_set_keyboard_interactivity(struct wl_client *client,
+		struct wl_resource *resource, uint32_t interactivity) {
+	// There is no input
+}
+
+static void layer_surface_get_popup(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *popup) {
+	// There are no popups
+}
+
+static void layer_surface_ack_configure(struct wl_client *client,
+		struct wl_resource *resource, uint32_t serial) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	if (surface && surface->state->record) {
+		fprintf(surface->state->record, "ack,%lu,%s,%u\n",
+				(unsigned long)now_us(surface->state),
+				surface_output_name(surface), serial);
+	}
+}
+
+static void layer_surface_set_layer(struct wl_client *client,
+		struct wl_resource *resource, uint32_t layer) {
+	// Layers are not emulated
+}
+
+static const struct zwlr_layer_surface_v1_interface layer_surface_impl = {
+	.set_size = layer_surface_set_size,
+	.set_anchor = layer_surface_set_anchor,
+	.set_exclusive_zone = layer_surface_set_exclusive_zone,
+	.set_margin = layer_surface_set_margin,
+	.set_keyboard_interactivity = layer_surface_set_keyboard_interactivity,
+	.get_popup = layer_surface_get_popup,
+	.ack_configure = layer_surface_ack_configure,
+	.destroy = handle_destroy,
+	.set_layer = layer_surface_set_layer,
+};
+
+static void layer_surface_destroy(struct wl_resource *resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	if (surface) {
+		surface->layer_surface = NULL;
+	}
+}
+
+static void layer_shell_get_layer_surface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *surface_resource, struct wl_resource *output_resource,
+		uint32_t layer, const char *namespace) {
+	struct mock_state *state = wl_resource_get_user_data(resource);
+	struct mock_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct wl_resource *layer_surface = wl_resource_create(client,
+			&zwlr_layer_surface_v1_interface,
+			wl_resource_get_version(resource), id);
+	if (!layer_surface) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(layer_surface, &layer_surface_impl,
+			surface, layer_surface_destroy);
+	surface->layer_surface = layer_surface;
+	surface->output = output_resource ?
+		wl_resource_get_user_data(output_resource) : NULL;
+	if (!surface->output && !wl_list_empty(&state->outputs)) {
+		surface->output = wl_container_of(state->outputs.next,
+				surface->output, link);
+	}
+}
+
+static const struct zwlr_layer_shell_v1_interface layer_shell_impl = {
+	.get_layer_surface = layer_shell_get_layer_surface,
+	.destroy = handle_destroy,
+};
+
+static void bind_layer_shell(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+			&zwlr_layer_shell_v1_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &layer_shell_impl, data, NULL);
+}
+
+// viewporter
+
+static void viewport_set_source(struct wl_client *client,
+		struct wl_resource *resource,
+		wl_fixed_t x, wl_fixed_t y, wl_fixed_t width, wl_fixed_t height) {
+	// Source rectangles are not emulated
+}
+
+static void viewport_set_destination(struct wl_client *client,
+		struct wl_resource *resource, int32_t width, int32_t height) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	if (surface) {
+		surface->viewport_width = width;
+		surface->viewport_height = height;
+	}
+}
+
+static const struct wp_viewport_interface viewport_impl = {
+	.destroy = handle_destroy,
+	.set_source = viewport_set_source,
+	.set_destination = viewport_set_destination,
+};
+
+static void viewport_destroy(struct wl_resource *resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	if (surface) {
+		surface->viewport = NULL;
+	}
+}
+
+static void viewporter_get_viewport(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *surface_resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct wl_resource *viewport = wl_resource_create(client,
+			&wp_viewport_interface, wl_resource_get_version(resource), id);
+	if (!viewport) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(viewport, &viewport_impl, surface,
+			viewport_destroy);
+	surface->viewport = viewport;
+}
+
+static const struct wp_viewporter_interface viewporter_impl = {
+	.destroy = handle_destroy,
+	.get_viewport = viewporter_get_viewport,
+};
+
+static void bind_viewporter(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+			&wp_viewporter_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &viewporter_impl, data, NULL);
+}
+
+// fractional-scale
+
+static const struct wp_fractional_scale_v1_interface fractional_scale_impl = {
+	.destroy = handle_destroy,
+};
+
+static void fractional_scale_destroy(struct wl_resource *resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	if (surface) {
+		surface->fractional_scale = NULL;
+	}
+}
+
+static void fractional_scale_manager_get_fractional_scale(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *surface_resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct wl_resource *fractional_scale = wl_resource_create(client,
+			&wp_fractional_scale_v1_interface,
+			wl_resource_get_version(resource), id);
+	if (!fractional_scale) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(fractional_scale, &fractional_scale_impl,
+			surface, fractional_scale_destroy);
+	surface->fractional_scale = fractional_scale;
+}
+
+static const struct wp_fractional_scale_manager_v1_interface fractional_scale_manager_impl = {
+	.destroy = handle_destroy,
+	.get_fractional_scale = fractional_scale_manager_get_fractional_scale,
+};
+
+static void bind_fractional_scale_manager(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+			&wp_fractional_scale_manager_v1_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &fractional_scale_manager_impl,
+			data, NULL);
+}
+
+// wp_presentation
+
+static void presentation_feedback(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *surface_resource,
+		uint32_t id) {
+	struct mock_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct mock_feedback *feedback = calloc(1, sizeof(struct mock_feedback));
+	if (!feedback) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	feedback->resource = wl_resource_create(client,
+			&wp_presentation_feedback_interface, 1, id);
+	if (!feedback->resource) {
+		free(feedback);
+		wl_client_post_no_memory(client);
+		return;
+	}
+	feedback->surface = surface;
+	wl_list_insert(surface->pending_feedbacks.prev, &feedback->link);
+	wl_resource_set_implementation(feedback->resource, NULL, feedback,
+			feedback_destroy);
+}
+
+static const struct wp_presentation_interface presentation_impl = {
+	.destroy = handle_destroy,
+	.feedback = presentation_feedback,
+};
+
+static void bind_presentation(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+			&wp_presentation_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &presentation_impl, data, NULL);
+	wp_presentation_send_clock_id(resource, CLOCK_MONOTONIC);
+}
+
+// Frame and script timers
+
+static int handle_frame_timer(void *data) {
+	struct mock_state *state = data;
+	uint32_t time = now_ms();
+	uint64_t t = now_us(state);
+	state->frame_seq++;
+	update_feedbacks(state);
+
+	struct mock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (wl_list_empty(&surface->frame_callbacks)) {
+			continue;
+		}
+		struct wl_resource *callback, *tmp;
+		wl_resource_for_each_safe(callback, tmp, &surface->frame_callbacks) {
+			wl_callback_send_done(callback, time);
+			wl_resource_destroy(callback);
+		}
+		surface->last_frame_done_us = t;
+		if (state->record) {
+			fprintf(state->record, "frame,%lu,%s,%u\n", (unsigned long)t,
+					surface_output_name(surface), state->frame_seq);
+		}
+	}
+	wl_event_source_timer_update(state->frame_timer, state->frame_interval_ms);
+	return 0;
+}
+
+static void run_event(struct mock_state *state, struct mock_event *event) {
+	struct mock_output *output = event->output ?
+		find_output(state, event->output) : NULL;
+	if (event->output && event->type != EVENT_PLUG && !output) {
+		swaybg_log(LOG_ERROR, "Script refers to unknown output %s", event->output);
+		return;
+	}
+	if (state->record) {
+		fprintf(state->record, "event,%lu,%s,%d\n", (unsigned long)now_us(state),
+				event->output ? event->output : "-", event->type);
+	}
+
+	switch (event->type) {
+	case EVENT_PLUG:
+		create_output(state, event->output, event->width, event->height,
+				event->scale);
+		break;
+	case EVENT_UNPLUG:
+		destroy_output(output);
+		break;
+	case EVENT_SCALE:
+		output->scale = event->value;
+		output->scale_120ths = 0;
+		update_output_scale(output);
+		break;
+	case EVENT_FRACTIONAL_SCALE:
+		output->scale_120ths = event->value;
+		output->scale = (event->value + 119) / 120;
+		update_output_scale(output);
+		break;
+	case EVENT_FRAME_INTERVAL:
+		state->frame_interval_ms = event->value;
+		break;
+	case EVENT_RELEASE_DELAY:
+		state->release_delay_ms = event->value;
+		break;
+	case EVENT_PRESENT_LATENCY:
+		state->present_latency = event->value;
+		break;
+	case EVENT_QUIT:
+		if (state->child > 0) {
+			kill(state->child, SIGTERM);
+		}
+		wl_display_terminate(state->display);
+		break;
+	}
+}
+
+static int handle_event_timer(void *data) {
+	struct mock_state *state = data;
+	uint32_t t = now_us(state) / 1000;
+
+	struct mock_event *event, *tmp;
+	wl_list_for_each_safe(event, tmp, &state->events, link) {
+		if (event->time_ms > t) {
+			wl_event_source_timer_update(state->event_timer,
+					event->time_ms - t);
+			break;
+		}
+		wl_list_remove(&event->link);
+		run_event(state, event);
+		free(event->output);
+		free(event);
+	}
+	return 0;
+}
+
+static int handle_sigchld(int signal_number, void *data) {
+	struct mock_state *state = data;
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		if (pid == state->child) {
+			state->exit_status = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+			state->child = 0;
+			wl_display_terminate(state->display);
+		}
+	}
+	return 0;
+}
+
+static int handle_sigterm(int signal_number, void *data) {
+	struct mock_state *state = data;
+	if (state->child > 0) {
+		kill(state->child, SIGTERM);
+	}
+	wl_display_terminate(state->display);
+	return 0;
+}
+
+// Command line
+
+static bool parse_geometry(const char *spec, int32_t *width, int32_t *height,
+		int32_t *scale) {
+	*scale = 1;
+	int n = sscanf(spec, "%dx%d@%d", width, height, scale);
+	return n >= 2 && *width > 0 && *height > 0 && *scale > 0;
+}
+
+static bool parse_event(struct mock_state *state, const char *spec) {
+	struct mock_event *event = calloc(1, sizeof(struct mock_event));
+	if (!event) {
+		return false;
+	}
+	char *copy = strdup(spec);
+	char *saveptr = NULL;
+	char *time = strtok_r(copy, ":", &saveptr);
+	char *command = strtok_r(NULL, ":", &saveptr);
+	char *arg1 = strtok_r(NULL, ":", &saveptr);
+	char *arg2 = strtok_r(NULL, ":", &saveptr);
+	bool ok = time && command;
+	if (ok) {
+		event->time_ms = strtoul(time, NULL, 10);
+	}
+
+	if (!ok) {
+		// Fall through to the error
+	} else if (strcmp(command, "plug") == 0 && arg1 && arg2) {
+		event->type = EVENT_PLUG;
+		event->output = strdup(arg1);
+		ok = parse_geometry(arg2, &event->width, &event->height, &event->scale);
+	} else if (strcmp(command, "unplug") == 0 && arg1) {
+		event->type = EVENT_UNPLUG;
+		event->output = strdup(arg1);
+	} else if (strcmp(command, "scale") == 0 && arg1 && arg2) {
+		event->type = EVENT_SCALE;
+		event->output = strdup(arg1);
+		event->value = strtoul(arg2, NULL, 10);
+		ok = event->value > 0;
+	} else if (strcmp(command, "fscale") == 0 && arg1 && arg2) {
+		event->type = EVENT_FRACTIONAL_SCALE;
+		event->output = strdup(arg1);
+		event->value = strtoul(arg2, NULL, 10);
+		ok = event->value > 0;
+	} else if (strcmp(command, "interval") == 0 && arg1) {
+		event->type = EVENT_FRAME_INTERVAL;
+		event->value = strtoul(arg1, NULL, 10);
+		ok = event->value > 0;
+	} else if (strcmp(command, "release-delay") == 0 && arg1) {
+		event->type = EVENT_RELEASE_DELAY;
+		event->value = strtoul(arg1, NULL, 10);
+	} else if (strcmp(command, "latency") == 0 && arg1) {
+		event->type = EVENT_PRESENT_LATENCY;
+		event->value = strtoul(arg1, NULL, 10);
+	} else if (strcmp(command, "quit") == 0) {
+		event->type = EVENT_QUIT;
+	} else {
+		ok = false;
+	}
+	free(copy);
+
+	if (!ok) {
+		swaybg_log(LOG_ERROR, "Invalid event: %s", spec);
+		free(event->output);
+		free(event);
+		return false;
+	}
+
+	// Keep the script sorted by time
+	struct mock_event *other;
+	struct wl_list *prev = state->events.prev;
+	wl_list_for_each(other, &state->events, link) {
+		if (other->time_ms > event->time_ms) {
+			prev = other->link.prev;
+			break;
+		}
+	}
+	wl_list_insert(prev, &event->link);
+	return true;
+}
+
+static const char usage[] =
+	"Usage: swaybg-mock-compositor [options...] [-- command...]\n"
+	"\n"
+	"  -o, --output <name>:<w>x<h>[@scale]  Add an output.\n"
+	"  -i, --frame-interval <ms>            Time between frame callbacks.\n"
+	"  -r, --release-delay <ms>             Delay before releasing buffers.\n"
+	"  -l, --present-latency <frames>       Frames between latching and\n"
+	"                                       presenting a commit.\n"
+	"  -P, --no-presentation                Do not offer wp_presentation.\n"
+	"  -e, --event <ms>:<command>[:args]    Schedule a scripted event.\n"
+	"  -t, --duration <ms>                  Quit after this long.\n"
+	"  -w, --record <path>                  Record commits and frames as CSV.\n"
+	"  -c, --checksum                       Record a checksum of each buffer.\n"
+	"  -d, --debug                          Enable debug logging.\n"
+	"  -h, --help                           Show help message and quit.\n"
+	"\n"
+	"Events:\n"
+	"  plug:<name>:<w>x<h>[@scale], unplug:<name>, scale:<name>:<scale>,\n"
+	"  fscale:<name>:<120ths>, interval:<ms>, release-delay:<ms>,\n"
+	"  latency:<frames>, quit\n"
+	"\n"
+	"The command is run with WAYLAND_DISPLAY set to the private socket.\n";
+
+int main(int argc, char **argv) {
+	static struct option long_options[] = {
+		{"output", required_argument, NULL, 'o'},
+		{"frame-interval", required_argument, NULL, 'i'},
+		{"release-delay", required_argument, NULL, 'r'},
+		{"present-latency", required_argument, NULL, 'l'},
+		{"no-presentation", no_argument, NULL, 'P'},
+		{"event", required_argument, NULL, 'e'},
+		{"duration", required_argument, NULL, 't'},
+		{"record", required_argument, NULL, 'w'},
+		{"checksum", no_argument, NULL, 'c'},
+		{"debug", no_argument, NULL, 'd'},
+		{"help", no_argument, NULL, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	swaybg_log_init(LOG_INFO);
+
+	struct mock_state state = {0};
+	state.frame_interval_ms = 16;
+	state.presentation = true;
+	wl_list_init(&state.latched_feedbacks);
+	wl_list_init(&state.outputs);
+	wl_list_init(&state.surfaces);
+	wl_list_init(&state.events);
+	clock_gettime(CLOCK_MONOTONIC, &state.start);
+
+	state.display = wl_display_create();
+	if (!state.display) {
+		swaybg_log(LOG_ERROR, "Failed to create display");
+		return EXIT_FAILURE;
+	}
+	state.loop = wl_display_get_event_loop(state.display);
+
+	uint32_t duration_ms = 0;
+	int c;
+	while ((c = getopt_long(argc, argv, "o:i:r:l:Pe:t:w:cdh", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'o': {
+			char *name = strdup(optarg);
+			char *geometry = strchr(name, ':');
+			int32_t width, height, scale;
+			if (!geometry || !parse_geometry(geometry + 1, &width, &height, &scale)) {
+				swaybg_log(LOG_ERROR, "Invalid output: %s", optarg);
+				free(name);
+				return EXIT_FAILURE;
+			}
+			*geometry = '\0';
+			create_output(&state, name, width, height, scale);
+			free(name);
+			break;
+		}
+		case 'i':
+			state.frame_interval_ms = strtoul(optarg, NULL, 10);
+			if (state.frame_interval_ms == 0) {
+				state.frame_interval_ms = 1;
+			}
+			break;
+		case 'r':
+			state.release_delay_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			state.present_latency = strtoul(optarg, NULL, 10);
+			break;
+		case 'P':
+			state.presentation = false;
+			break;
+		case 'e':
+			if (!parse_event(&state, optarg)) {
+				return EXIT_FAILURE;
+			}
+			break;
+		case 't':
+			duration_ms = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			state.record = fopen(optarg, "w");
+			if (!state.record) {
+				swaybg_log_errno(LOG_ERROR, "Failed to open %s", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'c':
+			state.checksum = true;
+			break;
+		case 'd':
+			swaybg_log_init(LOG_DEBUG);
+			break;
+		default:
+			fprintf(c == 'h' ? stdout : stderr, "%s", usage);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (wl_list_empty(&state.outputs)) {
+		create_output(&state, "MOCK-1", 1920, 1080, 1);
+	}
+	if (duration_ms) {
+		char spec[32];
+		snprintf(spec, sizeof(spec), "%u:quit", duration_ms);
+		parse_event(&state, spec);
+	}
+
+	wl_global_create(state.display, &wl_compositor_interface, 4, &state,
+			bind_compositor);
+	wl_display_init_shm(state.display);
+	wl_display_add_shm_format(state.display, WL_SHM_FORMAT_RGB565);
+	wl_display_add_shm_format(state.display, WL_SHM_FORMAT_XRGB2101010);
+	wl_global_create(state.display, &zwlr_layer_shell_v1_interface, 1, &state,
+			bind_layer_shell);
+	wl_global_create(state.display, &wp_viewporter_interface, 1, &state,
+			bind_viewporter);
+	wl_global_create(state.display, &wp_fractional_scale_manager_v1_interface,
+			1, &state, bind_fractional_scale_manager);
+	if (state.presentation) {
+		wl_global_create(state.display, &wp_presentation_interface, 1, &state,
+				bind_presentation);
+	}
+
+	const char *socket = wl_display_add_socket_auto(state.display);
+	if (!socket) {
+		swaybg_log(LOG_ERROR, "Failed to create socket");
+		return EXIT_FAILURE;
+	}
+	swaybg_log(LOG_INFO, "Running on WAYLAND_DISPLAY=%s", socket);
+
+	if (state.record) {
+		fprintf(state.record, "# commit,time_us,output,buffer,scale,n_damage,"
+				"damage_area,damage_x,damage_y,damage_w,damage_h,viewport,checksum\n"
+				"# frame,time_us,output,seq\n"
+				"# present,time_us,output,seq\n"
+				"# discard,time_us,output\n"
+				"# configure,time_us,output,size,serial\n"
+				"# ack,time_us,output,serial\n"
+				"# event,time_us,output,type\n");
+	}
+
+	state.frame_timer = wl_event_loop_add_timer(state.loop,
+			handle_frame_timer, &state);
+	wl_event_source_timer_update(state.frame_timer, state.frame_interval_ms);
+	state.event_timer = wl_event_loop_add_timer(state.loop,
+			handle_event_timer, &state);
+	if (!wl_list_empty(&state.events)) {
+		struct mock_event *first =
+			wl_container_of(state.events.next, first, link);
+		wl_event_source_timer_update(state.event_timer,
+				first->time_ms ? first->time_ms : 1);
+	}
+	wl_event_loop_add_signal(state.loop, SIGCHLD, handle_sigchld, &state);
+	wl_event_loop_add_signal(state.loop, SIGTERM, handle_sigterm, &state);
+	wl_event_loop_add_signal(state.loop, SIGINT, handle_sigterm, &state);
+
+	if (optind < argc) {
+		state.child = fork();
+		if (state.child < 0) {
+			swaybg_log_errno(LOG_ERROR, "fork failed");
+			return EXIT_FAILURE;
+		} else if (state.child == 0) {
+			sigset_t mask;
+			sigemptyset(&mask);
+			sigprocmask(SIG_SETMASK, &mask, NULL);
+			setenv("WAYLAND_DISPLAY", socket, 1);
+			execvp(argv[optind], &argv[optind]);
+			swaybg_log_errno(LOG_ERROR, "Failed to run %s", argv[optind]);
+			_exit(127);
+		}
+	}
+
+	wl_display_run(state.display);
+
+	if (state.child > 0) {
+		kill(state.child, SIGTERM);
+		waitpid(state.child, NULL, 0);
+	}
+
+	// Print statistics of surfaces that are still alive
+	struct mock_surface *surface;
+	wl_list_for_each(surface, &state.surfaces, link) {
+		print_surface_stats(surface);
+		surface->n_commits = 0;
+	}
+	wl_display_destroy_clients(state.display);
+
+	struct mock_event *event, *tmp_event;
+	wl_list_for_each_safe(event, tmp_event, &state.events, link) {
+		wl_list_remove(&event->link);
+		free(event->output);
+		free(event);
+	}
+	struct mock_output *output, *tmp_output;
+	wl_list_for_each_safe(output, tmp_output, &state.outputs, link) {
+		destroy_output(output);
+	}
+	wl_display_destroy(state.display);
+	if (state.record) {
+		fclose(state.record);
+	}
+	return state.exit_status;
+}
@@ -0,0 +1,326 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if HAVE_PERF_EVENTS
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "lbm.h"
+#include "log.h"
+#include "perf-counters.h"
+
+enum counter {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_L1D_MISSES,
+	COUNTER_LLC_MISSES,
+	COUNTER_DTLB_MISSES,
+	N_COUNTERS,
+};
+
+static const char *counter_names[N_COUNTERS] = {
+	[COUNTER_CYCLES] = "cycles",
+	[COUNTER_INSTRUCTIONS] = "instructions",
+	[COUNTER_BRANCH_MISSES] = "branch misses",
+	[COUNTER_L1D_MISSES] = "L1d misses",
+	[COUNTER_LLC_MISSES] = "LLC misses",
+	[COUNTER_DTLB_MISSES] = "dTLB misses",
+};
+
+static const char *stage_names[LBM_STAGE_COUNT] = {
+	[LBM_STAGE_UNPACK] = "unpack",
+	[LBM_STAGE_PIXEL_LISTS] = "prepare_pixel_lists",
+	[LBM_STAGE_RENDER] = "render_lbm_image",
+	[LBM_STAGE_DELTA] = "render_delta",
+};
+
+/*
+ * Most CPUs have only a few general purpose counters, so the events are split
+ * into a group for the pipeline and one for the memory hierarchy. Each group is
+ * scheduled as a whole, and the kernel multiplexes them if both do not fit.
+ */
+#define N_GROUPS 2
+#define GROUP_SIZE 3
+
+static const enum counter group_counters[N_GROUPS][GROUP_SIZE] = {
+	{ COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_BRANCH_MISSES },
+	{ COUNTER_L1D_MISSES, COUNTER_LLC_MISSES, COUNTER_DTLB_MISSES },
+};
+
+struct counter_group {
+	int fds[GROUP_SIZE];  // the first open one leads, -1 if not open
+	int leader;  // -1 if none could be opened
+	unsigned int n_open;
+};
+
+// A read of a group, with PERF_FORMAT_GROUP and both time fields
+struct group_reading {
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[GROUP_SIZE];
+};
+
+struct stage_stats {
+	unsigned long calls;
+	uint64_t ns;
+	uint64_t pixels;
+	// Summed over calls, and scaled by enabled / running time when reported
+	uint64_t time_enabled[N_GROUPS];
+	uint64_t time_running[N_GROUPS];
+	uint64_t counts[N_COUNTERS];
+
+	// Snapshot taken when the stage began
+	uint64_t start_ns;
+	struct group_reading start[N_GROUPS];
+};
+
+struct perf_counters {
+	struct counter_group groups[N_GROUPS];
+	bool available;
+	struct stage_stats stages[LBM_STAGE_COUNT];
+};
+
+static uint64_t get_time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if HAVE_PERF_EVENTS
+static bool counter_attr(enum counter counter, struct perf_event_attr *attr) {
+	memset(attr, 0, sizeof(*attr));
+	attr->size = sizeof(*attr);
+	attr->exclude_kernel = 1;
+	attr->exclude_hv = 1;
+	attr->read_format = PERF_FORMAT_GROUP |
+		PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	const uint64_t cache_read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	switch (counter) {
+	case COUNTER_CYCLES:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_CPU_CYCLES;
+		return true;
+	case COUNTER_INSTRUCTIONS:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+		return true;
+	case COUNTER_BRANCH_MISSES:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+		return true;
+	case COUNTER_L1D_MISSES:
+		attr->type = PERF_TYPE_HW_CACHE;
+		attr->config = PERF_COUNT_HW_CACHE_L1D | cache_read_miss;
+		return true;
+	case COUNTER_LLC_MISSES:
+		attr->type = PERF_TYPE_HARDWARE;
+		attr->config = PERF_COUNT_HW_CACHE_MISSES;
+		return true;
+	case COUNTER_DTLB_MISSES:
+		attr->type = PERF_TYPE_HW_CACHE;
+		attr->config = PERF_COUNT_HW_CACHE_DTLB | cache_read_miss;
+		return true;
+	case N_COUNTERS:
+		break;
+	}
+	return false;
+}
+
+/*
+ * Open what can be opened of a group, on any CPU the calling thread runs on.
+ * Returns the errno of the first failure, or 0.
+ */
+static int open_group(struct counter_group *group, const enum counter *counters) {
+	int err = 0;
+	group->leader = -1;
+	for (int i = 0; i < GROUP_SIZE; i++) {
+		struct perf_event_attr attr;
+		group->fds[i] = -1;
+		if (!counter_attr(counters[i], &attr)) {
+			continue;
+		}
+		attr.disabled = group->leader < 0;
+		int fd = syscall(SYS_perf_event_open, &attr, 0, -1,
+				group->leader < 0 ? -1 : group->fds[group->leader], 0);
+		if (fd < 0) {
+			err = err ? err : errno;
+			continue;
+		}
+		group->fds[i] = fd;
+		group->n_open++;
+		if (group->leader < 0) {
+			group->leader = i;
+		}
+	}
+	if (group->leader >= 0) {
+		int fd = group->fds[group->leader];
+		ioctl(fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+	return err;
+}
+
+static void read_group(const struct counter_group *group,
+		struct group_reading *reading) {
+	memset(reading, 0, sizeof(*reading));
+	if (group->leader < 0) {
+		return;
+	}
+	ssize_t len = read(group->fds[group->leader], reading, sizeof(*reading));
+	if (len < 0 || reading->nr != group->n_open) {
+		memset(reading, 0, sizeof(*reading));
+	}
+}
+#endif
+
+struct perf_counters *perf_counters_create(void) {
+	struct perf_counters *counters = calloc(1, sizeof(struct perf_counters));
+	if (!counters) {
+		return NULL;
+	}
+	for (int g = 0; g < N_GROUPS; g++) {
+		counters->groups[g].leader = -1;
+		for (int i = 0; i < GROUP_SIZE; i++) {
+			counters->groups[g].fds[i] = -1;
+		}
+	}
+
+#if HAVE_PERF_EVENTS
+	int err = 0;
+	for (int g = 0; g < N_GROUPS; g++) {
+		int group_err = open_group(&counters->groups[g], group_counters[g]);
+		err = err ? err : group_err;
+		counters->available = counters->available ||
+			counters->groups[g].leader >= 0;
+	}
+	if (!counters->available) {
+		swaybg_log(LOG_INFO, "Hardware counters are unavailable (%s), "
+				"only timing stages", strerror(err));
+	} else if (err) {
+		swaybg_log(LOG_INFO, "Some hardware counters are unavailable (%s)",
+				strerror(err));
+	}
+#else
+	swaybg_log(LOG_INFO, "Built without perf events, only timing stages");
+#endif
+	return counters;
+}
+
+void perf_counters_destroy(struct perf_counters *counters) {
+	if (!counters) {
+		return;
+	}
+	for (int g = 0; g < N_GROUPS; g++) {
+		for (int i = 0; i < GROUP_SIZE; i++) {
+			if (counters->groups[g].fds[i] >= 0) {
+				close(counters->groups[g].fds[i]);
+			}
+		}
+	}
+	free(counters);
+}
+
+bool perf_counters_available(const struct perf_counters *counters) {
+	return counters->available;
+}
+
+static void stage_begin(enum lbm_stage stage, void *data) {
+	struct perf_counters *counters = data;
+	struct stage_stats *stats = &counters->stages[stage];
+#if HAVE_PERF_EVENTS
+	for (int g = 0; g < N_GROUPS; g++) {
+		read_group(&counters->groups[g], &stats->start[g]);
+	}
+#endif
+	// Last, so that reading the counters is not timed
+	stats->start_ns = get_time_ns();
+}
+
+static void stage_end(enum lbm_stage stage, size_t n_pixels, void *data) {
+	uint64_t end_ns = get_time_ns();
+	struct perf_counters *counters = data;
+	struct stage_stats *stats = &counters->stages[stage];
+	stats->calls++;
+	stats->ns += end_ns - stats->start_ns;
+	stats->pixels += n_pixels;
+#if HAVE_PERF_EVENTS
+	for (int g = 0; g < N_GROUPS; g++) {
+		const struct counter_group *group = &counters->groups[g];
+		const struct group_reading *start = &stats->start[g];
+		struct group_reading end;
+		read_group(group, &end);
+		if (!end.nr || end.nr != start->nr) {
+			continue;
+		}
+		stats->time_enabled[g] += end.time_enabled - start->time_enabled;
+		stats->time_running[g] += end.time_running - start->time_running;
+		// Values are in the order of the open counters
+		unsigned int v = 0;
+		for (int i = 0; i < GROUP_SIZE; i++) {
+			if (group->fds[i] >= 0) {
+				stats->counts[group_counters[g][i]] +=
+					end.values[v] - start->values[v];
+				v++;
+			}
+		}
+	}
+#endif
+}
+
+void perf_counters_install(struct perf_counters *counters) {
+	struct lbm_stage_hooks hooks = {
+		.begin = stage_begin,
+		.end = stage_end,
+		.data = counters,
+	};
+	lbm_set_stage_hooks(&hooks);
+}
+
+void perf_counters_report(const struct perf_counters *counters) {
+	for (int s = 0; s < LBM_STAGE_COUNT; s++) {
+		const struct stage_stats *stats = &counters->stages[s];
+		if (!stats->calls) {
+			continue;
+		}
+		double pixels = stats->pixels ? stats->pixels : 1;
+		char line[512];
+		int len = snprintf(line, sizeof(line), "%s: %lu calls, %.3f ms, "
+				"%llu pixels; per pixel: %.3f ns", stage_names[s],
+				stats->calls, stats->ns / 1e6,
+				(unsigned long long)stats->pixels, stats->ns / pixels);
+		for (int g = 0; g < N_GROUPS && counters->available; g++) {
+			const struct counter_group *group = &counters->groups[g];
+			if (group->leader < 0 || !stats->time_running[g]) {
+				continue;
+			}
+			// Estimate the counts over the whole stage if the group was
+			// only scheduled for part of it
+			double scale = (double)stats->time_enabled[g] /
+				stats->time_running[g];
+			for (int i = 0; i < GROUP_SIZE; i++) {
+				enum counter counter = group_counters[g][i];
+				if (group->fds[i] < 0 || len < 0 ||
+						(size_t)len >= sizeof(line)) {
+					continue;
+				}
+				len += snprintf(line + len, sizeof(line) - len, ", %.4g %s",
+						stats->counts[counter] * scale / pixels,
+						counter_names[counter]);
+			}
+			if (scale > 1.01 && len >= 0 && (size_t)len < sizeof(line)) {
+				len += snprintf(line + len, sizeof(line) - len,
+						" (counted %.0f%% of the time)", 100 / scale);
+			}
+		}
+		swaybg_log(LOG_INFO, "Stage %s", line);
+	}
+}
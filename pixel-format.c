@@ -0,0 +1,65 @@
+#include <string.h>
+#include <wayland-client.h>
+#include "log.h"
+#include "pixel-format.h"
+
+static const struct {
+	const char *name;
+	uint32_t wl_format;
+	int bytes_per_pixel;
+} formats[] = {
+	[PIXEL_FORMAT_XRGB8888] = { "xrgb8888", WL_SHM_FORMAT_XRGB8888, 4 },
+	[PIXEL_FORMAT_RGB565] = { "rgb565", WL_SHM_FORMAT_RGB565, 2 },
+	[PIXEL_FORMAT_XRGB2101010] = { "xrgb2101010", WL_SHM_FORMAT_XRGB2101010, 4 },
+};
+
+enum pixel_format parse_pixel_format(const char *name) {
+	for (int i = 0; i < PIXEL_FORMAT_INVALID; i++) {
+		if (strcmp(name, formats[i].name) == 0) {
+			return i;
+		}
+	}
+	swaybg_log(LOG_ERROR, "Unsupported pixel format: %s", name);
+	return PIXEL_FORMAT_INVALID;
+}
+
+const char *pixel_format_name(enum pixel_format format) {
+	return format < PIXEL_FORMAT_INVALID ? formats[format].name : "invalid";
+}
+
+uint32_t pixel_format_to_wl_shm(enum pixel_format format) {
+	return formats[format].wl_format;
+}
+
+enum pixel_format pixel_format_from_wl_shm(uint32_t wl_format) {
+	for (int i = 0; i < PIXEL_FORMAT_INVALID; i++) {
+		if (formats[i].wl_format == wl_format) {
+			return i;
+		}
+	}
+	return PIXEL_FORMAT_INVALID;
+}
+
+int pixel_format_bytes_per_pixel(enum pixel_format format) {
+	return formats[format].bytes_per_pixel;
+}
+
+uint32_t pixel_format_convert(enum pixel_format format, uint32_t argb) {
+	uint32_t r = (argb >> 16) & 0xFF;
+	uint32_t g = (argb >> 8) & 0xFF;
+	uint32_t b = argb & 0xFF;
+	switch (format) {
+	case PIXEL_FORMAT_RGB565:
+		return (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+	case PIXEL_FORMAT_XRGB2101010:
+		// Replicate the top bits so that white stays white
+		r = r << 2 | r >> 6;
+		g = g << 2 | g >> 6;
+		b = b << 2 | b >> 6;
+		return 0x3u << 30 | r << 20 | g << 10 | b;
+	case PIXEL_FORMAT_XRGB8888:
+	case PIXEL_FORMAT_INVALID:
+		break;
+	}
+	return 0xFF000000 | argb;
+}
@@ -1,5 +1,4 @@
-#define _POSIX_C_SOURCE 200809
-#include <assert.h>
+#define _GNU_SOURCE
 #include <cairo.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -7,12 +6,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
+#include "cairo_util.h"
+#include "log.h"
+#include "memstats.h"
 #include "pool-buffer.h"
 
+// Blocks at least this large are backed by transparent huge pages if the
+// kernel allows it for shared memory
+#define HUGEPAGE_THRESHOLD (4 << 20)
+// Address space reserved for the arena; pools are limited to INT32_MAX bytes.
+// Halved until it can be reserved.
+#define ARENA_MAX_RESERVE ((size_t)1 << 30)
+#define ARENA_MIN_RESERVE ((size_t)64 << 20)
+// Buffers kept for reuse after they are destroyed
+#define ARENA_MAX_CACHED 4
+
 static int anonymous_shm_open(void) {
+#if HAVE_MEMFD_CREATE
+	int memfd = memfd_create("swaybg", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd >= 0) {
+		return memfd;
+	}
+	// Older kernels, fall back to shm_open
+#endif
+
 	int retries = 100;
 
 	do {
@@ -37,49 +58,475 @@ static int anonymous_shm_open(void) {
 	return -1;
 }
 
-extern struct wl_buffer_listener buffer_listener;
+/*
+ * A free range of the arena, between blocks.
+ */
+struct shm_range {
+	size_t offset, size;
+	struct wl_list link;  // shm_arena::free_ranges, by offset
+};
 
-bool create_buffer(struct pool_buffer *buf, struct wl_shm *shm,
-		int32_t width, int32_t height, uint32_t format, struct swaybg_output *output) {
-	uint32_t stride = width * 4;
-	size_t size = stride * height;
+/*
+ * A wl_buffer and the block of the arena it covers. Slots outlive their
+ * pool_buffer, so that the buffer can be handed out again.
+ */
+struct shm_slot {
+	struct wl_buffer *buffer;
+	struct shm_block block;
+	int32_t width, height;
+	uint32_t stride;
+	enum pixel_format format;
+	// Output notified of releases, NULL once the slot is cached
+	struct swaybg_output *output;
+	// Attached and not yet released by the compositor
+	bool busy;
+	struct wl_list link;  // shm_arena::cached, most recently cached first
+};
 
-	int fd = anonymous_shm_open();
-	assert(fd != -1);
+/*
+ * Every shm buffer of the process is carved out of a single pool, whose file
+ * grows as needed. The whole reserved address range is mapped up front, so
+ * growing the pool never moves existing buffers. Blocks that do not fit in the
+ * reserve get a pool of their own.
+ */
+struct shm_arena {
+	struct wl_shm *shm;
+	struct wl_shm_pool *pool;
+	int fd;
+	uint8_t *data;
+	size_t reserved;
+	size_t size;  // of the file and of the pool
+	size_t top;   // end of the highest block
+	struct wl_list free_ranges;
+	struct wl_list cached;
+	int n_cached;
+};
+
+static struct shm_arena *arena;
+
+/*
+ * Fault in every page of a new mapping, so the first render into it does not
+ * take thousands of page faults. Huge pages are requested first, as populating
+ * the mapping fixes its page size.
+ */
+static void prefault(void *data, size_t size) {
+#ifdef MADV_HUGEPAGE
+	if (size >= HUGEPAGE_THRESHOLD) {
+		madvise(data, size, MADV_HUGEPAGE);
+	}
+#endif
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(data, size, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	// Kernels older than 5.14. Blocks may be recycled, keep their contents.
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	volatile uint8_t *bytes = data;
+	for (size_t offset = 0; offset < size; offset += page_size) {
+		bytes[offset] = bytes[offset];
+	}
+}
+
+static double get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t page_align(size_t size) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	return (size + page_size - 1) / page_size * page_size;
+}
+
+static struct shm_arena *get_arena(struct wl_shm *shm) {
+	if (arena) {
+		return arena;
+	}
+	struct shm_arena *new_arena = calloc(1, sizeof(struct shm_arena));
+	if (!new_arena) {
+		return NULL;
+	}
+	new_arena->fd = anonymous_shm_open();
+	if (new_arena->fd < 0) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create shm file");
+		free(new_arena);
+		return NULL;
+	}
+#if HAVE_MEMFD_CREATE
+	// The compositor can then map the pool without guarding against it
+	// shrinking. Fails harmlessly for shm_open descriptors.
+	fcntl(new_arena->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+#endif
+
+	// Mapping past the end of the file is fine as long as it is not touched
+	for (size_t reserve = ARENA_MAX_RESERVE; reserve >= ARENA_MIN_RESERVE;
+			reserve /= 2) {
+		void *data = mmap(NULL, reserve, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_NORESERVE, new_arena->fd, 0);
+		if (data != MAP_FAILED) {
+			new_arena->data = data;
+			new_arena->reserved = reserve;
+			break;
+		}
+	}
+	if (!new_arena->data) {
+		swaybg_log_errno(LOG_ERROR, "Failed to reserve shm arena");
+		close(new_arena->fd);
+		free(new_arena);
+		return NULL;
+	}
+
+	new_arena->shm = shm;
+	wl_list_init(&new_arena->free_ranges);
+	wl_list_init(&new_arena->cached);
+	arena = new_arena;
+	return arena;
+}
+
+static bool grow_arena(size_t size) {
+	if (size <= arena->size) {
+		return true;
+	}
+	// Double to keep pool resizes rare; pages are only used once touched
+	size_t new_size = arena->size * 2;
+	if (new_size < size) {
+		new_size = size;
+	}
+	if (new_size > arena->reserved) {
+		new_size = arena->reserved;
+	}
+	if (size > new_size || ftruncate(arena->fd, new_size) < 0) {
+		return false;
+	}
+	if (!arena->pool) {
+		arena->pool = wl_shm_create_pool(arena->shm, arena->fd, new_size);
+	} else {
+		wl_shm_pool_resize(arena->pool, new_size);
+	}
+	swaybg_log(LOG_DEBUG, "Grew shm arena from %zu to %zu bytes",
+			arena->size, new_size);
+	arena->size = new_size;
+	return true;
+}
+
+static void free_range(size_t offset, size_t size) {
+#ifdef MADV_REMOVE
+	// Give the pages back, the file cannot shrink
+	madvise(arena->data + offset, size, MADV_REMOVE);
+#endif
+	memstats_free(MEMSTATS_SHM, size);
+
+	struct shm_range *next = NULL, *range;
+	wl_list_for_each(range, &arena->free_ranges, link) {
+		if (range->offset > offset) {
+			next = range;
+			break;
+		}
+	}
+	struct wl_list *prev_link = next ? next->link.prev : arena->free_ranges.prev;
+	struct shm_range *prev = prev_link != &arena->free_ranges ?
+		wl_container_of(prev_link, prev, link) : NULL;
+
+	if (prev && prev->offset + prev->size == offset) {
+		prev->size += size;
+		range = prev;
+	} else {
+		range = calloc(1, sizeof(struct shm_range));
+		if (!range) {
+			// Leaked until the arena is destroyed
+			return;
+		}
+		range->offset = offset;
+		range->size = size;
+		wl_list_insert(prev_link, &range->link);
+	}
+	if (next && range->offset + range->size == next->offset) {
+		range->size += next->size;
+		wl_list_remove(&next->link);
+		free(next);
+	}
+	if (range->offset + range->size == arena->top) {
+		arena->top = range->offset;
+		wl_list_remove(&range->link);
+		free(range);
+	}
+}
+
+static void evict_slot(struct shm_slot *slot) {
+	wl_list_remove(&slot->link);
+	arena->n_cached--;
+	wl_buffer_destroy(slot->buffer);
+	free_shm_block(&slot->block);
+	free(slot);
+}
+
+/*
+ * Evict the least recently cached buffer the compositor is done with.
+ */
+static bool evict_cached(void) {
+	struct shm_slot *slot;
+	wl_list_for_each_reverse(slot, &arena->cached, link) {
+		if (!slot->busy) {
+			evict_slot(slot);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool alloc_range(size_t size, size_t *offset) {
+	do {
+		struct shm_range *range;
+		wl_list_for_each(range, &arena->free_ranges, link) {
+			if (range->size < size) {
+				continue;
+			}
+			*offset = range->offset;
+			range->offset += size;
+			range->size -= size;
+			if (range->size == 0) {
+				wl_list_remove(&range->link);
+				free(range);
+			}
+			memstats_alloc(MEMSTATS_SHM, size);
+			return true;
+		}
+		if (grow_arena(arena->top + size)) {
+			*offset = arena->top;
+			arena->top += size;
+			memstats_alloc(MEMSTATS_SHM, size);
+			return true;
+		}
+		// Out of space, make room from cached buffers
+	} while (evict_cached());
+	return false;
+}
 
+static void prepare_block(void *data, size_t size) {
+	struct rusage before, after;
+	getrusage(RUSAGE_SELF, &before);
+	double start = get_time();
+	prefault(data, size);
+	getrusage(RUSAGE_SELF, &after);
+	swaybg_log(LOG_DEBUG, "Prefaulted %zu byte shm block in %.3f ms, %ld page faults",
+			size, (get_time() - start) * 1000,
+			(after.ru_minflt - before.ru_minflt) + (after.ru_majflt - before.ru_majflt));
+}
+
+/*
+ * Map a block into a pool of its own, for when the arena is full, e.g. with a
+ * large frame ring budget or the buffers of several 8K outputs.
+ */
+static bool alloc_standalone(struct wl_shm *shm, size_t size,
+		struct shm_block *block) {
+	if (size > INT32_MAX) {
+		return false;
+	}
+	int fd = anonymous_shm_open();
+	if (fd < 0) {
+		return false;
+	}
 	if (ftruncate(fd, size) < 0) {
 		close(fd);
 		return false;
 	}
-
+#if HAVE_MEMFD_CREATE
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+#endif
 	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, fd, size);
-	buf->buffer = wl_shm_pool_create_buffer(pool, 0,
-			width, height, stride, format);
-	wl_shm_pool_destroy(pool);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	// The pool keeps its own reference to the file
+	block->pool = wl_shm_create_pool(shm, fd, size);
 	close(fd);
+	block->data = data;
+	block->offset = 0;
+	block->size = size;
+	block->standalone = true;
+	memstats_alloc(MEMSTATS_SHM, size);
+	return true;
+}
+
+bool alloc_shm_block(struct wl_shm *shm, size_t size, struct shm_block *block) {
+	size = page_align(size);
+	size_t offset;
+	if (get_arena(shm) && alloc_range(size, &offset)) {
+		*block = (struct shm_block){
+			.pool = arena->pool,
+			.data = arena->data + offset,
+			.offset = offset,
+			.size = size,
+		};
+	} else if (alloc_standalone(shm, size, block)) {
+		swaybg_log(LOG_DEBUG, "shm arena is full, mapped a pool of %zu bytes "
+				"of its own", size);
+	} else {
+		swaybg_log_errno(LOG_ERROR, "Failed to allocate %zu bytes of shm", size);
+		return false;
+	}
+	prepare_block(block->data, size);
+	return true;
+}
+
+void free_shm_block(struct shm_block *block) {
+	if (block->standalone) {
+		wl_shm_pool_destroy(block->pool);
+		munmap(block->data, block->size);
+		memstats_free(MEMSTATS_SHM, block->size);
+	} else {
+		free_range(block->offset, block->size);
+	}
+	memset(block, 0, sizeof(*block));
+}
 
+void release_buffer(void *data, struct wl_buffer *buffer);
+
+static void handle_buffer_release(void *data, struct wl_buffer *buffer) {
+	struct shm_slot *slot = data;
+	slot->busy = false;
+	if (slot->output) {
+		release_buffer(slot->output, buffer);
+	}
+}
+
+static const struct wl_buffer_listener slot_buffer_listener = {
+	.release = handle_buffer_release,
+};
+
+/*
+ * Find a cached buffer the compositor is done with, preferably of the same
+ * geometry, else of the same size class.
+ */
+static struct shm_slot *find_cached(int32_t width, int32_t height,
+		uint32_t stride, enum pixel_format format, size_t size) {
+	struct shm_slot *slot, *match = NULL;
+	wl_list_for_each(slot, &arena->cached, link) {
+		if (slot->busy) {
+			continue;
+		}
+		if (slot->width == width && slot->height == height &&
+				slot->stride == stride && slot->format == format) {
+			return slot;
+		}
+		if (!match && slot->block.size == size) {
+			match = slot;
+		}
+	}
+	return match;
+}
+
+bool create_buffer(struct pool_buffer *buf, struct wl_shm *shm,
+		int32_t width, int32_t height, enum pixel_format format,
+		struct swaybg_output *output) {
+	cairo_format_t cairo_format = to_cairo_format(format);
+	uint32_t stride = cairo_format_stride_for_width(cairo_format, width);
+	size_t size = stride * height;
+
+	if (!get_arena(shm)) {
+		return false;
+	}
+	struct shm_slot *slot = find_cached(width, height, stride, format,
+			page_align(size));
+	if (slot) {
+		wl_list_remove(&slot->link);
+		arena->n_cached--;
+		if (slot->width != width || slot->height != height ||
+				slot->stride != stride || slot->format != format) {
+			// Same block, new geometry
+			wl_buffer_destroy(slot->buffer);
+			slot->buffer = NULL;
+		}
+	} else {
+		slot = calloc(1, sizeof(struct shm_slot));
+		if (!slot) {
+			return false;
+		}
+		if (!alloc_shm_block(shm, size, &slot->block)) {
+			free(slot);
+			return false;
+		}
+	}
+
+	if (!slot->buffer) {
+		slot->buffer = wl_shm_pool_create_buffer(slot->block.pool, slot->block.offset,
+				width, height, stride, pixel_format_to_wl_shm(format));
+		wl_buffer_add_listener(slot->buffer, &slot_buffer_listener, slot);
+		slot->width = width;
+		slot->height = height;
+		slot->stride = stride;
+		slot->format = format;
+	}
+	slot->output = output;
+	wl_list_init(&slot->link);
+
+	buf->buffer = slot->buffer;
+	buf->slot = slot;
 	buf->size = size;
-	buf->data = data;
-	buf->surface = cairo_image_surface_create_for_data(data,
-			CAIRO_FORMAT_ARGB32, width, height, stride);
-	buf->cairo = cairo_create(buf->surface);
-	wl_buffer_add_listener(buf->buffer, &buffer_listener, output);
+	buf->data = slot->block.data;
+	buf->stride = stride;
+	buf->format = format;
+	buf->available = true;
+	buf->surface = NULL;
+	buf->cairo = NULL;
 	return true;
 }
 
-void destroy_buffer(struct pool_buffer *buffer) {
-	if (buffer->buffer) {
-		wl_buffer_destroy(buffer->buffer);
+cairo_t *get_buffer_cairo(struct pool_buffer *buffer) {
+	if (!buffer->cairo) {
+		struct shm_slot *slot = buffer->slot;
+		buffer->surface = cairo_image_surface_create_for_data(buffer->data,
+				to_cairo_format(buffer->format), slot->width, slot->height,
+				buffer->stride);
+		buffer->cairo = cairo_create(buffer->surface);
 	}
+	return buffer->cairo;
+}
+
+void destroy_buffer(struct pool_buffer *buffer) {
 	if (buffer->cairo) {
 		cairo_destroy(buffer->cairo);
+		buffer->cairo = NULL;
 	}
 	if (buffer->surface) {
 		cairo_surface_destroy(buffer->surface);
+		buffer->surface = NULL;
 	}
-	if (buffer->data) {
-		munmap(buffer->data, buffer->size);
+	struct shm_slot *slot = buffer->slot;
+	if (slot) {
+		// Keep the buffer for the next one of the same size. Until the
+		// compositor releases it, its contents may still be on screen.
+		slot->output = NULL;
+		slot->busy = !buffer->available;
+		wl_list_insert(&arena->cached, &slot->link);
+		arena->n_cached++;
+		if (arena->n_cached > ARENA_MAX_CACHED) {
+			evict_cached();
+		}
 	}
 	memset(buffer, 0, sizeof(struct pool_buffer));
 }
+
+void destroy_shm_arena(void) {
+	if (!arena) {
+		return;
+	}
+	struct shm_slot *slot, *tmp_slot;
+	wl_list_for_each_safe(slot, tmp_slot, &arena->cached, link) {
+		evict_slot(slot);
+	}
+	struct shm_range *range, *tmp_range;
+	wl_list_for_each_safe(range, tmp_range, &arena->free_ranges, link) {
+		wl_list_remove(&range->link);
+		free(range);
+	}
+	if (arena->pool) {
+		wl_shm_pool_destroy(arena->pool);
+	}
+	munmap(arena->data, arena->reserved);
+	close(arena->fd);
+	free(arena);
+	arena = NULL;
+}
@@ -0,0 +1,69 @@
+#include "presentation.h"
+
+// Weight of each new sample in the moving average of the latency, in 1/16ths
+#define LATENCY_WEIGHT 2
+
+void presentation_stats_presented(struct presentation_stats *stats,
+		int64_t commit_ns, int64_t present_ns, uint32_t refresh_ns,
+		int64_t due_ns) {
+	// Presentation may be reported a little before the commit, if the
+	// compositor latched it right at the vblank
+	int64_t latency = present_ns > commit_ns ? present_ns - commit_ns : 0;
+	stats->presented++;
+	stats->latency_sum_ns += latency;
+	if ((uint64_t)latency > stats->latency_max_ns) {
+		stats->latency_max_ns = latency;
+	}
+	if (stats->latency_avg_ns == 0) {
+		stats->latency_avg_ns = latency;
+	} else {
+		stats->latency_avg_ns += (latency - stats->latency_avg_ns) *
+			LATENCY_WEIGHT / 16;
+	}
+
+	stats->refresh_ns = refresh_ns;
+	if (refresh_ns) {
+		int64_t vblanks = latency / refresh_ns;
+		if (stats->presented == 1 || vblanks < stats->min_vblanks) {
+			stats->min_vblanks = vblanks;
+		}
+		stats->missed_vblanks += vblanks - stats->min_vblanks;
+	}
+
+	if (due_ns) {
+		int64_t drift = present_ns - due_ns;
+		if (stats->n_drift == 0 || drift < stats->drift_min_ns) {
+			stats->drift_min_ns = drift;
+		}
+		if (stats->n_drift == 0 || drift > stats->drift_max_ns) {
+			stats->drift_max_ns = drift;
+		}
+		stats->n_drift++;
+		stats->drift_sum_ns += drift;
+		stats->drift_last_ns = drift;
+	}
+}
+
+void presentation_stats_discarded(struct presentation_stats *stats) {
+	stats->discarded++;
+}
+
+void presentation_stats_print(const struct presentation_stats *stats, FILE *f) {
+	if (!stats->presented) {
+		fprintf(f, "    presented 0, discarded %lu\n",
+				(unsigned long)stats->discarded);
+		return;
+	}
+	fprintf(f, "    presented %lu, discarded %lu, latency avg %.2f ms "
+			"max %.2f ms, %lu missed vblanks",
+			(unsigned long)stats->presented, (unsigned long)stats->discarded,
+			stats->latency_sum_ns / (double)stats->presented / 1e6,
+			stats->latency_max_ns / 1e6, (unsigned long)stats->missed_vblanks);
+	if (stats->n_drift) {
+		fprintf(f, ", drift avg %.2f ms min %.2f ms max %.2f ms last %.2f ms",
+				stats->drift_sum_ns / (double)stats->n_drift / 1e6,
+				stats->drift_min_ns / 1e6, stats->drift_max_ns / 1e6,
+				stats->drift_last_ns / 1e6);
+	}
+	fprintf(f, "\n");
+}
@@ -0,0 +1,252 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "frame-ring.h"
+#include "log.h"
+#include "render-thread.h"
+
+// Must be a power of two
+#define RING_SIZE 64
+
+/*
+ * Single-producer, single-consumer ring of jobs. The producer owns head and the
+ * consumer owns tail; each only reads the other's index.
+ */
+struct job_ring {
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	struct render_job *jobs[RING_SIZE];
+};
+
+struct render_thread {
+	pthread_t thread;
+	struct job_ring pending;    // main thread -> render thread
+	struct job_ring completed;  // render thread -> main thread
+	atomic_bool stop;
+
+	// Wakes the render thread when jobs are queued
+	int wake_fds[2];
+	// Readable when jobs have completed
+	int done_fds[2];
+
+	// Only touched by the main thread
+	unsigned long submitted;
+	// Written by the render thread
+	atomic_ulong finished;
+};
+
+static bool ring_push(struct job_ring *ring, struct render_job *job) {
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if (head - tail == RING_SIZE) {
+		return false;
+	}
+	ring->jobs[head & (RING_SIZE - 1)] = job;
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	return true;
+}
+
+static struct render_job *ring_pop(struct job_ring *ring) {
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if (tail == head) {
+		return NULL;
+	}
+	struct render_job *job = ring->jobs[tail & (RING_SIZE - 1)];
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	return job;
+}
+
+static void notify(int fd) {
+	char c = 0;
+	// A full pipe already guarantees a wakeup
+	if (write(fd, &c, 1) < 0 && errno != EAGAIN) {
+		swaybg_log_errno(LOG_ERROR, "Failed to notify render thread");
+	}
+}
+
+static void drain(int fd) {
+	char buf[64];
+	while (read(fd, buf, sizeof(buf)) == sizeof(buf)) {
+		// keep reading
+	}
+}
+
+static double get_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void render_job_run(struct render_job *job) {
+	struct rusage before, after;
+	struct bounding_box frame_damage;
+	double start;
+	switch (job->type) {
+	case RENDER_JOB_FULL:
+		// Full renders are rare and dominated by memory traffic, log what
+		// they cost in time and page faults
+		getrusage(RUSAGE_SELF, &before);
+		start = get_time();
+		for (int i = 0; i < job->n_targets; i++) {
+			fill_lbm_margins(job->targets[i], &job->image, job->background,
+					job->width, job->height, job->stride,
+					job->origin_x, job->origin_y, job->scale);
+			render_lbm_image(job->targets[i], &job->image, job->width,
+					job->height, job->stride, job->origin_x, job->origin_y,
+					job->scale);
+		}
+		getrusage(RUSAGE_SELF, &after);
+		swaybg_log(LOG_DEBUG, "Full render of %ux%u took %.3f ms, %ld page faults",
+				job->width, job->height, (get_time() - start) * 1000,
+				(after.ru_minflt - before.ru_minflt) +
+				(after.ru_majflt - before.ru_majflt));
+		job->damage.min_x = 0;
+		job->damage.min_y = 0;
+		job->damage.max_x = job->width;
+		job->damage.max_y = job->height;
+		break;
+	case RENDER_JOB_DELTA:
+		render_pixel_changes(job->targets[0], &job->image, job->old_generation,
+				job->width, job->height, job->stride,
+				job->origin_x, job->origin_y, job->scale, &frame_damage);
+		render_ranges(job->targets[0], &job->image, job->layout, job->old_lut,
+				job->width, job->height, job->stride,
+				job->origin_x, job->origin_y, job->scale, &job->damage);
+		merge_damage(&job->damage, &frame_damage);
+		break;
+	case RENDER_JOB_RING_PLAN:
+		frame_ring_plan(job->ring);
+		break;
+	case RENDER_JOB_RING_RENDER:
+		frame_ring_render(job->ring, job->targets[0], job->old_lut);
+		break;
+	}
+}
+
+static void *render_loop(void *data) {
+	struct render_thread *thread = data;
+	struct pollfd pfd = { .fd = thread->wake_fds[0], .events = POLLIN };
+
+	while (!atomic_load(&thread->stop)) {
+		struct render_job *job = ring_pop(&thread->pending);
+		if (!job) {
+			// Drain before sleeping; a job queued after the pop also
+			// leaves a byte behind, so no wakeup is lost
+			drain(thread->wake_fds[0]);
+			job = ring_pop(&thread->pending);
+			if (!job) {
+				poll(&pfd, 1, -1);
+				continue;
+			}
+		}
+
+		render_job_run(job);
+
+		// The completed ring holds as many jobs as the pending ring, and
+		// the main thread pops a job before submitting it again
+		ring_push(&thread->completed, job);
+		atomic_fetch_add(&thread->finished, 1);
+		notify(thread->done_fds[1]);
+	}
+	return NULL;
+}
+
+static bool open_pipe(int fds[2]) {
+	if (pipe(fds) < 0) {
+		return false;
+	}
+	for (int i = 0; i < 2; i++) {
+		int flags = fcntl(fds[i], F_GETFL);
+		if (flags < 0 || fcntl(fds[i], F_SETFL, flags | O_NONBLOCK) < 0 ||
+				fcntl(fds[i], F_SETFD, FD_CLOEXEC) < 0) {
+			close(fds[0]);
+			close(fds[1]);
+			return false;
+		}
+	}
+	return true;
+}
+
+struct render_thread *render_thread_create(void) {
+	struct render_thread *thread = calloc(1, sizeof(struct render_thread));
+	if (!thread) {
+		return NULL;
+	}
+	if (!open_pipe(thread->wake_fds)) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create render thread pipe");
+		free(thread);
+		return NULL;
+	}
+	if (!open_pipe(thread->done_fds)) {
+		swaybg_log_errno(LOG_ERROR, "Failed to create render thread pipe");
+		close(thread->wake_fds[0]);
+		close(thread->wake_fds[1]);
+		free(thread);
+		return NULL;
+	}
+	if (pthread_create(&thread->thread, NULL, render_loop, thread) != 0) {
+		swaybg_log(LOG_ERROR, "Failed to create render thread");
+		close(thread->wake_fds[0]);
+		close(thread->wake_fds[1]);
+		close(thread->done_fds[0]);
+		close(thread->done_fds[1]);
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+void render_thread_destroy(struct render_thread *thread) {
+	if (!thread) {
+		return;
+	}
+	atomic_store(&thread->stop, true);
+	notify(thread->wake_fds[1]);
+	pthread_join(thread->thread, NULL);
+	close(thread->wake_fds[0]);
+	close(thread->wake_fds[1]);
+	close(thread->done_fds[0]);
+	close(thread->done_fds[1]);
+	free(thread);
+}
+
+bool render_thread_submit(struct render_thread *thread, struct render_job *job) {
+	if (!ring_push(&thread->pending, job)) {
+		return false;
+	}
+	thread->submitted++;
+	notify(thread->wake_fds[1]);
+	return true;
+}
+
+int render_thread_get_fd(struct render_thread *thread) {
+	return thread->done_fds[0];
+}
+
+struct render_job *render_thread_pop_completed(struct render_thread *thread) {
+	struct render_job *job = ring_pop(&thread->completed);
+	if (!job) {
+		drain(thread->done_fds[0]);
+		// A job may have completed between the pop and the drain
+		job = ring_pop(&thread->completed);
+	}
+	return job;
+}
+
+void render_thread_wait(struct render_thread *thread) {
+	struct pollfd pfd = { .fd = thread->done_fds[0], .events = POLLIN };
+	while (atomic_load(&thread->finished) != thread->submitted) {
+		poll(&pfd, 1, -1);
+		drain(thread->done_fds[0]);
+	}
+	// Completed jobs are popped by the caller, make sure the fd says so
+	notify(thread->done_fds[1]);
+}
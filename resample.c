@@ -0,0 +1,441 @@
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "resample.h"
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+// Bands are at least this many rows, so small buffers are not split
+#define BAND_MIN_ROWS 64
+#define MAX_BAND_THREADS 8
+
+// Weights are fixed point, and those of a pixel sum to WEIGHT_ONE
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+// Rows filtered horizontally keep SAMPLE_BITS below the 8 of the source, so
+// that a full channel is SAMPLE_ONE. The weights of any filter here sum to less
+// than 2 in absolute value, so samples fit in 16 bits with their overshoot.
+#define SAMPLE_BITS 6
+#define SAMPLE_ONE (255 << SAMPLE_BITS)
+
+/*
+ * The channels of a pixel, in the order of their bits in a uint32_t from the
+ * lowest: blue, green, red, alpha. Arithmetic on them compiles to SIMD
+ * instructions on targets that have them.
+ */
+typedef int32_t v4si __attribute__((vector_size(16)));
+typedef uint32_t v4su __attribute__((vector_size(16)));
+typedef int16_t v4hi __attribute__((vector_size(8)));
+typedef uint8_t v4qu __attribute__((vector_size(4)));
+
+static double box(double x) {
+	return x > -0.5 && x <= 0.5 ? 1 : 0;
+}
+
+static double bilinear(double x) {
+	x = fabs(x);
+	return x < 1 ? 1 - x : 0;
+}
+
+static double sinc(double x) {
+	static const double pi = 3.14159265358979323846;
+	if (x == 0) {
+		return 1;
+	}
+	x *= pi;
+	return sin(x) / x;
+}
+
+static double lanczos(double x) {
+	return x > -3 && x < 3 ? sinc(x) * sinc(x / 3) : 0;
+}
+
+struct filter {
+	const char *name;
+	double support;  // radius in source pixels, when not scaling down
+	double (*kernel)(double x);
+};
+
+static const struct filter filters[RESAMPLE_FILTER_INVALID] = {
+	[RESAMPLE_FILTER_BOX] = { "box", 0.5, box },
+	[RESAMPLE_FILTER_BILINEAR] = { "bilinear", 1, bilinear },
+	[RESAMPLE_FILTER_LANCZOS] = { "lanczos", 3, lanczos },
+};
+
+enum resample_filter parse_resample_filter(const char *name) {
+	for (int i = 0; i < RESAMPLE_FILTER_INVALID; i++) {
+		if (strcmp(name, filters[i].name) == 0) {
+			return i;
+		}
+	}
+	swaybg_log(LOG_ERROR, "Unsupported filter: %s", name);
+	return RESAMPLE_FILTER_INVALID;
+}
+
+const char *resample_filter_name(enum resample_filter filter) {
+	return filter < RESAMPLE_FILTER_INVALID ? filters[filter].name : "invalid";
+}
+
+// Source pixels a destination pixel is made of
+struct taps {
+	int first;
+	int n;
+};
+
+// How the destination pixels along one axis are made from source pixels
+struct axis {
+	int start, end;  // destination pixels the source covers
+	int max_taps;
+	struct taps *taps;  // per pixel from start
+	int16_t *weights;   // max_taps per pixel from start
+};
+
+static void free_axis(struct axis *axis) {
+	free(axis->taps);
+	free(axis->weights);
+}
+
+/*
+ * Compute the taps of the destination pixels that a source of src_size pixels
+ * placed at pos and scaled to extent covers, or that it tiles from 0.
+ */
+static bool build_axis(struct axis *axis, const struct filter *filter,
+		int src_size, int dst_size, double pos, double extent, bool tile) {
+	// Down-scaling widens the filter to cover every source pixel
+	const double inv = tile ? 1 : src_size / extent;
+	const double filter_scale = MAX(inv, 1.0);
+	const double support = filter->support * filter_scale;
+	if (tile) {
+		axis->start = 0;
+		axis->end = dst_size;
+		axis->max_taps = 1;
+	} else {
+		axis->start = fmin(fmax(floor(pos + 0.5), 0), dst_size);
+		axis->end = fmin(fmax(floor(pos + extent + 0.5), axis->start), dst_size);
+		axis->max_taps = (int)ceil(support) * 2 + 1;
+	}
+	const int n = axis->end - axis->start;
+	axis->taps = calloc(MAX(n, 1), sizeof(struct taps));
+	axis->weights = calloc((size_t)MAX(n, 1) * axis->max_taps, sizeof(int16_t));
+	double *values = calloc(axis->max_taps, sizeof(double));
+	if (!axis->taps || !axis->weights || !values) {
+		free(values);
+		return false;
+	}
+
+	for (int i = 0; i < n; i++) {
+		struct taps *taps = &axis->taps[i];
+		int16_t *weights = &axis->weights[(size_t)i * axis->max_taps];
+		if (tile) {
+			taps->first = (axis->start + i) % src_size;
+			taps->n = 1;
+			weights[0] = WEIGHT_ONE;
+			continue;
+		}
+		// Center of the destination pixel, in source pixels
+		const double center = (axis->start + i + 0.5 - pos) * inv;
+		const int lo = MAX((int)floor(center - support + 0.5), 0);
+		const int hi = MIN(MIN((int)floor(center + support + 0.5), src_size),
+				lo + axis->max_taps);
+		double total = 0;
+		for (int j = lo; j < hi; j++) {
+			values[j - lo] = filter->kernel((j + 0.5 - center) / filter_scale);
+			total += values[j - lo];
+		}
+		if (hi <= lo || total == 0) {
+			// Only at the edges, where rounding leaves no pixel in reach
+			taps->first = MIN(MAX((int)floor(center), 0), src_size - 1);
+			taps->n = 1;
+			weights[0] = WEIGHT_ONE;
+			continue;
+		}
+		// The box filter has zeros at the ends, which are not worth a tap
+		int a = 0, b = hi - lo;
+		while (values[a] == 0) {
+			a++;
+		}
+		while (values[b - 1] == 0) {
+			b--;
+		}
+		int sum = 0, largest = a;
+		for (int j = a; j < b; j++) {
+			weights[j - a] = lround(values[j] / total * WEIGHT_ONE);
+			sum += weights[j - a];
+			if (fabs(values[j]) > fabs(values[largest])) {
+				largest = j;
+			}
+		}
+		// Rounding must not change the brightness
+		weights[largest - a] += WEIGHT_ONE - sum;
+		taps->first = lo + a;
+		taps->n = b - a;
+	}
+	free(values);
+	return true;
+}
+
+struct resampler {
+	uint8_t *buffer;
+	enum pixel_format format;
+	int width;
+	size_t stride;
+	const struct resample_source *src;
+	struct axis x, y;
+	uint32_t background;  // in the format of the buffer
+	v4si background_channels;
+};
+
+// A band of rows, scaled by one thread
+struct band {
+	const struct resampler *r;
+	int first_row, end_row;
+	bool ok;
+};
+
+static inline v4si unpack_pixel(uint32_t pixel, bool opaque) {
+	if (opaque) {
+		pixel |= 0xFF000000;
+	}
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// The bytes are in channel order, and widen without shifts
+	v4qu bytes;
+	memcpy(&bytes, &pixel, sizeof(bytes));
+	return __builtin_convertvector(bytes, v4si);
+#else
+	v4su channels = (v4su){ pixel, pixel, pixel, pixel } >> (v4su){ 0, 8, 16, 24 };
+	return (v4si)(channels & 0xFF);
+#endif
+}
+
+static void fill_row(const struct resampler *r, uint8_t *row, int x0, int x1) {
+	if (pixel_format_bytes_per_pixel(r->format) == 2) {
+		uint16_t *pixels = (uint16_t *)row;
+		for (int x = x0; x < x1; x++) {
+			pixels[x] = r->background;
+		}
+	} else {
+		uint32_t *pixels = (uint32_t *)row;
+		for (int x = x0; x < x1; x++) {
+			pixels[x] = r->background;
+		}
+	}
+}
+
+// Filter a source row horizontally, into one sample per covered column
+static void filter_row(const struct resampler *r, int src_row, v4hi *out) {
+	const uint32_t *src = (const uint32_t *)((const uint8_t *)r->src->pixels +
+		(size_t)src_row * r->src->stride);
+	const bool opaque = r->src->opaque;
+	const int n = r->x.end - r->x.start;
+	for (int i = 0; i < n; i++) {
+		const struct taps *taps = &r->x.taps[i];
+		const int16_t *weights = &r->x.weights[(size_t)i * r->x.max_taps];
+		const uint32_t *pixels = src + taps->first;
+		v4si acc = { 0 };
+		for (int k = 0; k < taps->n; k++) {
+			acc += unpack_pixel(pixels[k], opaque) * weights[k];
+		}
+		acc = (acc + (1 << (WEIGHT_BITS - SAMPLE_BITS - 1))) >>
+			(WEIGHT_BITS - SAMPLE_BITS);
+		out[i] = __builtin_convertvector(acc, v4hi);
+	}
+}
+
+// The color channels of a filtered pixel over the background, each up to SAMPLE_ONE
+static inline v4si resolve_pixel(v4si acc, v4si background) {
+	v4si c = (acc + (1 << (WEIGHT_BITS - 1))) >> WEIGHT_BITS;
+	const int32_t alpha = MIN(MAX(c[3], 0), SAMPLE_ONE);
+	// Premultiplied channels do not exceed alpha, filters overshoot edges
+	const v4si max = { alpha, alpha, alpha, alpha };
+	c &= ~(c < 0);
+	v4si over = c > max;
+	c = (c & ~over) | (max & over);
+	if (alpha < SAMPLE_ONE) {
+		c += background * (SAMPLE_ONE - alpha) / 255;
+	}
+	return c;
+}
+
+static void store_row(const struct resampler *r, uint8_t *row,
+		const v4si *acc, int n) {
+	const v4si background = r->background_channels;
+	switch (r->format) {
+	case PIXEL_FORMAT_RGB565: {
+		uint16_t *pixels = (uint16_t *)row + r->x.start;
+		for (int x = 0; x < n; x++) {
+			v4si c = resolve_pixel(acc[x], background);
+			c = (c * (v4si){ 31, 63, 31, 0 } + SAMPLE_ONE / 2) / SAMPLE_ONE;
+			pixels[x] = c[2] << 11 | c[1] << 5 | c[0];
+		}
+		break;
+	}
+	case PIXEL_FORMAT_XRGB2101010: {
+		uint32_t *pixels = (uint32_t *)row + r->x.start;
+		for (int x = 0; x < n; x++) {
+			v4si c = resolve_pixel(acc[x], background);
+			c = (c * 1023 + SAMPLE_ONE / 2) / SAMPLE_ONE;
+			pixels[x] = 0x3u << 30 | (uint32_t)c[2] << 20 |
+				(uint32_t)c[1] << 10 | (uint32_t)c[0];
+		}
+		break;
+	}
+	case PIXEL_FORMAT_XRGB8888:
+	case PIXEL_FORMAT_INVALID: {
+		uint32_t *pixels = (uint32_t *)row + r->x.start;
+		for (int x = 0; x < n; x++) {
+			v4si c = resolve_pixel(acc[x], background);
+			c = (c + (1 << (SAMPLE_BITS - 1))) >> SAMPLE_BITS;
+			pixels[x] = 0xFF000000 | (uint32_t)c[2] << 16 |
+				(uint32_t)c[1] << 8 | (uint32_t)c[0];
+		}
+		break;
+	}
+	}
+}
+
+/*
+ * Scale the rows of a band. Source rows filtered horizontally are kept in a
+ * ring as long as the rows of the band below need them, so each is filtered
+ * once per band.
+ */
+static void *resample_band(void *data) {
+	struct band *band = data;
+	const struct resampler *r = band->r;
+	const int n = r->x.end - r->x.start;
+	const int ring_size = r->y.max_taps;
+	v4hi *ring = NULL;
+	int *ring_rows = NULL;  // source row in each slot of the ring, or -1
+	v4si *acc = NULL;
+	if (n > 0 && r->y.end > r->y.start) {
+		ring = malloc((size_t)ring_size * n * sizeof(v4hi));
+		ring_rows = malloc(ring_size * sizeof(int));
+		acc = malloc(n * sizeof(v4si));
+		if (!ring || !ring_rows || !acc) {
+			free(ring);
+			free(ring_rows);
+			free(acc);
+			band->ok = false;
+			return NULL;
+		}
+		for (int i = 0; i < ring_size; i++) {
+			ring_rows[i] = -1;
+		}
+	}
+
+	for (int y = band->first_row; y < band->end_row; y++) {
+		uint8_t *row = r->buffer + (size_t)y * r->stride;
+		if (!ring || y < r->y.start || y >= r->y.end) {
+			fill_row(r, row, 0, r->width);
+			continue;
+		}
+		fill_row(r, row, 0, r->x.start);
+		fill_row(r, row, r->x.end, r->width);
+
+		const int i = y - r->y.start;
+		const struct taps *taps = &r->y.taps[i];
+		const int16_t *weights = &r->y.weights[(size_t)i * r->y.max_taps];
+		memset(acc, 0, n * sizeof(v4si));
+		for (int k = 0; k < taps->n; k++) {
+			const int src_row = taps->first + k;
+			const int slot = src_row % ring_size;
+			v4hi *samples = &ring[(size_t)slot * n];
+			if (ring_rows[slot] != src_row) {
+				filter_row(r, src_row, samples);
+				ring_rows[slot] = src_row;
+			}
+			const int32_t weight = weights[k];
+			for (int x = 0; x < n; x++) {
+				acc[x] += __builtin_convertvector(samples[x], v4si) * weight;
+			}
+		}
+		store_row(r, row, acc, n);
+	}
+	free(ring);
+	free(ring_rows);
+	free(acc);
+	band->ok = true;
+	return NULL;
+}
+
+static double get_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+bool resample_image(void *buffer, enum pixel_format format, int width,
+		int height, size_t stride, const struct resample_source *src,
+		const struct resample_placement *placement, uint32_t background,
+		enum resample_filter filter) {
+	if (src->width <= 0 || src->height <= 0) {
+		return false;
+	}
+	double start = get_time_ms();
+	const struct filter *f = &filters[filter < RESAMPLE_FILTER_INVALID ?
+		filter : RESAMPLE_FILTER_LANCZOS];
+	struct resampler r = {
+		.buffer = buffer,
+		.format = format,
+		.width = width,
+		.stride = stride,
+		.src = src,
+		.background = pixel_format_convert(format, background),
+		.background_channels = unpack_pixel(background & 0xFFFFFF, false),
+	};
+	bool ok = build_axis(&r.x, f, src->width, width, placement->x,
+			placement->width, placement->tile) &&
+		build_axis(&r.y, f, src->height, height, placement->y,
+			placement->height, placement->tile);
+
+	long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int n_threads = MIN(height / BAND_MIN_ROWS,
+		MIN((int)MAX(n_cpus, 1), MAX_BAND_THREADS));
+	n_threads = MAX(n_threads, 1);
+	struct band bands[MAX_BAND_THREADS];
+	pthread_t threads[MAX_BAND_THREADS];
+	bool started[MAX_BAND_THREADS] = { false };
+	for (int t = 0; ok && t < n_threads; t++) {
+		bands[t] = (struct band){
+			.r = &r,
+			.first_row = (int)((long)height * t / n_threads),
+			.end_row = (int)((long)height * (t + 1) / n_threads),
+		};
+		// The calling thread takes the first band, and any that a thread
+		// cannot be started for
+		if (t > 0) {
+			started[t] = pthread_create(&threads[t], NULL, resample_band,
+					&bands[t]) == 0;
+		}
+	}
+	for (int t = 0; ok && t < n_threads; t++) {
+		if (!started[t]) {
+			resample_band(&bands[t]);
+		}
+	}
+	bool bands_ok = ok;
+	for (int t = 0; ok && t < n_threads; t++) {
+		if (started[t]) {
+			pthread_join(threads[t], NULL);
+		}
+		bands_ok = bands_ok && bands[t].ok;
+	}
+	ok = bands_ok;
+	free_axis(&r.x);
+	free_axis(&r.y);
+
+	if (!ok) {
+		swaybg_log(LOG_ERROR, "Failed to allocate memory to scale an image");
+		return false;
+	}
+	swaybg_log(LOG_DEBUG, "Scaled %dx%d to %dx%d with the %s filter on %d "
+			"threads in %.1f ms", src->width, src->height,
+			r.x.end - r.x.start, r.y.end - r.y.start, f->name, n_threads,
+			get_time_ms() - start);
+	return true;
+}
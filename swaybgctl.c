@@ -0,0 +1,78 @@
+#define _DEFAULT_SOURCE
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "control.h"
+#include "log.h"
+
+int main(int argc, char **argv) {
+	swaybg_log_init(LOG_ERROR);
+
+	static struct option long_options[] = {
+		{"help", no_argument, NULL, 'h'},
+		{"socket", required_argument, NULL, 'S'},
+		{"version", no_argument, NULL, 'v'},
+		{0, 0, 0, 0}
+	};
+
+	const char *usage =
+		"Usage: swaybgctl [options...] <command> [arguments...]\n"
+		"\n"
+		"  -h, --help             Show help message and quit.\n"
+		"  -S, --socket           Use this control socket.\n"
+		"  -v, --version          Show the version number and quit.\n"
+		"\n"
+		"Commands:\n"
+		"  pause                  Stop cycling colors.\n"
+		"  resume                 Carry on cycling from where it was paused.\n"
+		"  fps <n>                Update animations at most n times per second,\n"
+		"                         or as often as they change if n is 0.\n"
+		"  smooth                 Blend between the steps of color ranges.\n"
+		"  stepped                Move color ranges one whole step at a time.\n"
+		"  image <path> [output]  Show another image on every or one output.\n"
+		"  stats                  Show the state of animations and memory use.\n";
+
+	char path[PATH_MAX];
+	const char *socket_path = NULL;
+	int c;
+	while ((c = getopt_long(argc, argv, "+hS:v", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'v':
+			fprintf(stdout, "swaybgctl version " SWAYBG_VERSION "\n");
+			return EXIT_SUCCESS;
+		default:
+			fprintf(c == 'h' ? stdout : stderr, "%s", usage);
+			return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind == argc || argc - optind > CONTROL_MAX_ARGS) {
+		fprintf(stderr, "%s", usage);
+		return EXIT_FAILURE;
+	}
+	if (!socket_path) {
+		if (!control_socket_path(path, sizeof(path))) {
+			swaybg_log(LOG_ERROR, "XDG_RUNTIME_DIR is not set, "
+					"pass the socket with --socket");
+			return EXIT_FAILURE;
+		}
+		socket_path = path;
+	}
+
+	// swaybg resolves relative paths against its own working directory
+	char image_path[PATH_MAX];
+	if (strcmp(argv[optind], "image") == 0 && optind + 1 < argc) {
+		if (!realpath(argv[optind + 1], image_path)) {
+			swaybg_log_errno(LOG_ERROR, "Cannot find %s", argv[optind + 1]);
+			return EXIT_FAILURE;
+		}
+		argv[optind + 1] = image_path;
+	}
+
+	return control_send(socket_path, argc - optind, &argv[optind], stdout) ?
+		EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "log.h"
+#include "thumbnail-cache.h"
+
+// Source pixels averaged per thumbnail pixel and axis, at most
+#define MAX_SAMPLES 16
+
+/*
+ * Average a grid of samples of each cell of a width x height image. get_pixel
+ * returns the XRGB8888 color of a pixel.
+ */
+static void downscale(int width, int height, uint32_t (*get_pixel)(const void *,
+		int, int), const void *data, struct thumbnail *thumb) {
+	for (int ty = 0; ty < THUMBNAIL_SIZE; ty++) {
+		for (int tx = 0; tx < THUMBNAIL_SIZE; tx++) {
+			int x0 = tx * width / THUMBNAIL_SIZE;
+			int x1 = (tx + 1) * width / THUMBNAIL_SIZE;
+			int y0 = ty * height / THUMBNAIL_SIZE;
+			int y1 = (ty + 1) * height / THUMBNAIL_SIZE;
+			int step_x = (x1 - x0 + MAX_SAMPLES - 1) / MAX_SAMPLES;
+			int step_y = (y1 - y0 + MAX_SAMPLES - 1) / MAX_SAMPLES;
+			uint32_t r = 0, g = 0, b = 0, n = 0;
+			for (int y = y0; y < y1; y += step_y) {
+				for (int x = x0; x < x1; x += step_x) {
+					uint32_t p = get_pixel(data, x, y);
+					r += (p >> 16) & 0xff;
+					g += (p >> 8) & 0xff;
+					b += p & 0xff;
+					n++;
+				}
+			}
+			if (n > 0) {
+				r /= n;
+				g /= n;
+				b /= n;
+			}
+			thumb->pixels[ty * THUMBNAIL_SIZE + tx] = r << 16 | g << 8 | b;
+		}
+	}
+}
+
+static uint32_t get_surface_pixel(const void *data, int x, int y) {
+	cairo_surface_t *surface = (cairo_surface_t *)data;
+	const uint8_t *row = cairo_image_surface_get_data(surface) +
+		y * cairo_image_surface_get_stride(surface);
+	return ((const uint32_t *)row)[x];
+}
+
+void thumbnail_from_surface(cairo_surface_t *surface, struct thumbnail *thumb) {
+	memset(thumb, 0, sizeof(*thumb));
+	cairo_format_t format = cairo_image_surface_get_format(surface);
+	if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+		return;
+	}
+	cairo_surface_flush(surface);
+	downscale(cairo_image_surface_get_width(surface),
+			cairo_image_surface_get_height(surface),
+			get_surface_pixel, surface, thumb);
+}
+
+static uint32_t get_lbm_pixel(const void *data, int x, int y) {
+	const struct lbm_image *image = data;
+	return image->palette[image->pixels[y * image->width + x]];
+}
+
+void thumbnail_from_lbm(const struct lbm_image *image, struct thumbnail *thumb) {
+	memset(thumb, 0, sizeof(*thumb));
+	downscale(image->width, image->height, get_lbm_pixel, image, thumb);
+}
+
+uint32_t thumbnail_dominant_color(const struct thumbnail *thumb) {
+	// Colors quantized to 4 bits per channel vote, and the winners are
+	// averaged
+	static const int n = THUMBNAIL_SIZE * THUMBNAIL_SIZE;
+	const uint32_t mask = 0xf0f0f0;
+	int best = 0, best_count = 0;
+	for (int i = 0; i < n; i++) {
+		int count = 0;
+		for (int j = 0; j < n; j++) {
+			if ((thumb->pixels[i] & mask) == (thumb->pixels[j] & mask)) {
+				count++;
+			}
+		}
+		if (count > best_count) {
+			best = i;
+			best_count = count;
+		}
+	}
+	uint32_t r = 0, g = 0, b = 0;
+	for (int j = 0; j < n; j++) {
+		uint32_t p = thumb->pixels[j];
+		if ((p & mask) == (thumb->pixels[best] & mask)) {
+			r += (p >> 16) & 0xff;
+			g += (p >> 8) & 0xff;
+			b += p & 0xff;
+		}
+	}
+	r /= best_count;
+	g /= best_count;
+	b /= best_count;
+	return r << 24 | g << 16 | b << 8 | 0xff;
+}
+
+static bool get_cache_dir(char *dir, size_t size) {
+	const char *cache_home = getenv("XDG_CACHE_HOME");
+	int len;
+	if (cache_home && cache_home[0] == '/') {
+		len = snprintf(dir, size, "%s/swaybg", cache_home);
+	} else {
+		const char *home = getenv("HOME");
+		if (!home) {
+			return false;
+		}
+		len = snprintf(dir, size, "%s/.cache/swaybg", home);
+	}
+	return len > 0 && (size_t)len < size;
+}
+
+static bool get_cache_path(const char *path, char *cache_path, size_t size) {
+	struct stat st;
+	char dir[PATH_MAX];
+	if (stat(path, &st) < 0 || !get_cache_dir(dir, sizeof(dir))) {
+		return false;
+	}
+
+	// FNV-1a over the path, size and modification time of the image
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const uint64_t prime = 0x100000001b3ULL;
+	for (const char *c = path; *c; c++) {
+		hash = (hash ^ (uint8_t)*c) * prime;
+	}
+	uint64_t fields[] = {
+		(uint64_t)st.st_size,
+		(uint64_t)st.st_mtim.tv_sec,
+		(uint64_t)st.st_mtim.tv_nsec,
+	};
+	for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+		for (int shift = 0; shift < 64; shift += 8) {
+			hash = (hash ^ ((fields[i] >> shift) & 0xff)) * prime;
+		}
+	}
+
+	int len = snprintf(cache_path, size, "%s/%016llx.ppm", dir,
+			(unsigned long long)hash);
+	return len > 0 && (size_t)len < size;
+}
+
+bool thumbnail_cache_read(const char *path, struct thumbnail *thumb) {
+	char cache_path[PATH_MAX];
+	if (!get_cache_path(path, cache_path, sizeof(cache_path))) {
+		return false;
+	}
+	FILE *f = fopen(cache_path, "rb");
+	if (!f) {
+		return false;
+	}
+	int width, height, maxval;
+	uint8_t rgb[THUMBNAIL_SIZE * THUMBNAIL_SIZE * 3];
+	bool ok = fscanf(f, "P6 %d %d %d", &width, &height, &maxval) == 3 &&
+		width == THUMBNAIL_SIZE && height == THUMBNAIL_SIZE &&
+		maxval == 255 && fgetc(f) != EOF &&
+		fread(rgb, 1, sizeof(rgb), f) == sizeof(rgb);
+	fclose(f);
+	if (!ok) {
+		swaybg_log(LOG_DEBUG, "Ignoring invalid thumbnail %s", cache_path);
+		return false;
+	}
+	for (int i = 0; i < THUMBNAIL_SIZE * THUMBNAIL_SIZE; i++) {
+		thumb->pixels[i] = (uint32_t)rgb[3 * i] << 16 |
+			(uint32_t)rgb[3 * i + 1] << 8 | rgb[3 * i + 2];
+	}
+	return true;
+}
+
+static bool make_dirs(char *dir) {
+	// Create each missing component, e.g. ~/.cache itself
+	for (char *slash = strchr(dir + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+		if (slash) {
+			*slash = '\0';
+		}
+		bool ok = mkdir(dir, 0700) == 0 || errno == EEXIST;
+		if (slash) {
+			*slash = '/';
+		}
+		if (!ok) {
+			return false;
+		}
+		if (!slash) {
+			return true;
+		}
+	}
+}
+
+void thumbnail_cache_write(const char *path, const struct thumbnail *thumb) {
+	char cache_path[PATH_MAX], dir[PATH_MAX];
+	if (!get_cache_path(path, cache_path, sizeof(cache_path)) ||
+			!get_cache_dir(dir, sizeof(dir))) {
+		return;
+	}
+	if (access(cache_path, F_OK) == 0) {
+		return;
+	}
+	if (!make_dirs(dir)) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to create %s", dir);
+		return;
+	}
+
+	// Written aside and renamed into place, so readers never see part of it
+	char tmp_path[PATH_MAX + 16];
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", cache_path, (long)getpid());
+	FILE *f = fopen(tmp_path, "wb");
+	if (!f) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to write %s", tmp_path);
+		return;
+	}
+	uint8_t rgb[THUMBNAIL_SIZE * THUMBNAIL_SIZE * 3];
+	for (int i = 0; i < THUMBNAIL_SIZE * THUMBNAIL_SIZE; i++) {
+		rgb[3 * i] = thumb->pixels[i] >> 16;
+		rgb[3 * i + 1] = thumb->pixels[i] >> 8;
+		rgb[3 * i + 2] = thumb->pixels[i];
+	}
+	bool ok = fprintf(f, "P6\n%d %d\n255\n", THUMBNAIL_SIZE, THUMBNAIL_SIZE) > 0 &&
+		fwrite(rgb, 1, sizeof(rgb), f) == sizeof(rgb);
+	if (fclose(f) != 0 || !ok || rename(tmp_path, cache_path) < 0) {
+		swaybg_log_errno(LOG_DEBUG, "Failed to write %s", cache_path);
+		unlink(tmp_path);
+		return;
+	}
+	swaybg_log(LOG_DEBUG, "Cached thumbnail of %s in %s", path, cache_path);
+}